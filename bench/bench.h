@@ -0,0 +1,51 @@
+#ifndef BENCH_H__
+#define BENCH_H__
+// Helpers shared by the benchmarks.
+// Users must define _POSIX_C_SOURCE before any includes for clock_gettime.
+
+#include <stdint.h>
+#include <time.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+// Encode instructions by hand, since we have no assembler here
+#define ENC_R(FUNC, D, S, T) \
+    (((uint32_t)(S) << 21) | ((uint32_t)(T) << 16) | ((uint32_t)(D) << 11) \
+     | (uint32_t)(FUNC))
+#define ENC_I(OP, S, T, IMM) \
+    (((uint32_t)(OP) << 26) | ((uint32_t)(S) << 21) | ((uint32_t)(T) << 16) \
+     | (uint16_t)(IMM))
+
+// Monotonic wall clock in seconds
+static inline double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Loads a counted loop with some arithmetic and stack traffic.
+// Returns the number of instructions it will retire.
+static inline uint64_t bench_load_loop(Machine *m, uint32_t iterations) {
+    const uint32_t program[] = {
+        ENC_R(FUNC_LIS, 1, 0, 0), iterations,   // $1 = counter
+        ENC_R(FUNC_LIS, 2, 0, 0), 1,            // $2 = 1
+        ENC_R(FUNC_LIS, 3, 0, 0), 0,            // $3 = sum
+        // loop:
+        ENC_R(FUNC_ADD, 3, 3, 1),
+        ENC_I(OP_SW, 30, 3, -4),
+        ENC_I(OP_LW, 30, 4, -4),
+        ENC_R(FUNC_SUB, 1, 1, 2),
+        ENC_I(OP_BNE, 1, 0, -5),
+        ENC_R(FUNC_JR, 0, 31, 0)
+    };
+
+    for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+        m_write_word(m, i, program[i]);
+
+    m->pc = 0;
+    m->registers[30] = m->mem_size * 4;
+    m->registers[31] = RETURN_ADDRESS;
+    return 3 + 5 * (uint64_t)iterations + 1;
+}
+
+#endif
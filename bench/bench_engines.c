@@ -0,0 +1,65 @@
+// Compares the run engines on a long-running loop, reporting emulated
+//   instructions per second for each.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "machine/machine.h"
+#include "machine/impl.h"
+#include "machine/engine.h"
+#include "machine/block.h"
+
+#define ITERATIONS 50000000
+
+static EmulatorStatus run_step_machine(Machine *const m) {
+    EmulatorStatus status;
+    do status = step_machine(m);
+    while (status.retcode == IR_SUCCESS);
+    return status;
+}
+
+// The block engine without the JIT tier
+static EmulatorStatus run_interpreted_blocks(Machine *const m) {
+    BlockCache *cache = block_cache(m);
+    jit_destroy(cache->jit);
+    cache->jit = NULL;
+    uint64_t retired;
+    return run_blocks(m, UINT64_MAX, &retired);
+}
+
+static EmulatorStatus run_all_blocks(Machine *const m) {
+    uint64_t retired;
+    return run_blocks(m, UINT64_MAX, &retired);
+}
+
+static double run(EmulatorStatus (*engine)(Machine *const)) {
+    Machine *m = init_machine(0);
+    const uint64_t retired = bench_load_loop(m, ITERATIONS);
+
+    const double start = bench_now();
+    const EmulatorStatus status = engine(m);
+    const double elapsed = bench_now() - start;
+
+    if (status.retcode != IR_DONE) {
+        fprintf(stderr, "benchmark program failed with retcode %d\n", status.retcode);
+        exit(EXIT_FAILURE);
+    }
+
+    destroy_machine(m);
+    return retired / elapsed;
+}
+
+int main(void) {
+    const double stepped = run(run_step_machine);
+    const double threaded = run(run_threaded);
+    const double blocks = run(run_interpreted_blocks);
+    const double jit = run(run_all_blocks);
+
+    printf("step_machine: %8.2f MIPS\n", stepped / 1e6);
+    printf("threaded:     %8.2f MIPS (%.2fx)\n", threaded / 1e6, threaded / stepped);
+    printf("blocks:       %8.2f MIPS (%.2fx)\n", blocks / 1e6, blocks / stepped);
+    printf("blocks+jit:   %8.2f MIPS (%.2fx)\n", jit / 1e6, jit / stepped);
+    return 0;
+}
@@ -0,0 +1,539 @@
+// The benchmark suite: microbenchmarks of the core entry points and
+//   macro workloads that stress different kinds of guest code.
+//
+// Usage: bench_suite [-q] [-r repeats] [-j results.json] [name...]
+//
+// Each benchmark runs repeats times (3 by default) and the fastest run is
+//   reported, as millions of emulated instructions (or words, or decodes)
+//   per second and nanoseconds per one. Where the kernel allows it, host
+//   cycles and instructions come from perf_event_open. -q runs smaller
+//   workloads, and names pick which benchmarks run.
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "bench.h"
+#include "emulator/emulator.h"
+#include "machine/decode.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+#include "machine/machine.h"
+
+// Host counters around a measured region, when there are any
+typedef struct Counters {
+    bool available;
+    uint64_t cycles;
+    uint64_t instructions;
+} Counters;
+
+typedef struct Measurement {
+    int fds[2];         // cycles, instructions; -1 when unavailable
+    double start;
+    double seconds;
+    Counters counters;
+} Measurement;
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void measure_begin(Measurement *m) {
+    m->fds[0] = m->fds[1] = -1;
+#ifdef __linux__
+    m->fds[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (m->fds[0] != -1)
+        m->fds[1] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, m->fds[0]);
+    if (m->fds[0] != -1 && m->fds[1] != -1) {
+        ioctl(m->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(m->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+    m->start = bench_now();
+}
+
+static void measure_end(Measurement *m) {
+    m->seconds = bench_now() - m->start;
+    m->counters.available = false;
+#ifdef __linux__
+    if (m->fds[0] != -1 && m->fds[1] != -1) {
+        ioctl(m->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        m->counters.available =
+            read(m->fds[0], &m->counters.cycles, sizeof(uint64_t)) == sizeof(uint64_t)
+            && read(m->fds[1], &m->counters.instructions, sizeof(uint64_t))
+               == sizeof(uint64_t);
+    }
+#endif
+    for (int i = 0; i < 2; ++i)
+        if (m->fds[i] != -1)
+            close(m->fds[i]);
+}
+
+
+static bool quick = false;
+
+static void fail(const char *what) {
+    fprintf(stderr, "bench_suite: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+
+// Guest programs, assembled into words at address 0
+typedef struct Program {
+    uint32_t words[128];
+    uint32_t len;
+} Program;
+
+static uint32_t here(const Program *p) {
+    return p->len * 4;
+}
+
+static void emit(Program *p, uint32_t word) {
+    p->words[p->len++] = word;
+}
+
+static void emit_lis(Program *p, uint8_t reg, uint32_t value) {
+    emit(p, ENC_R(FUNC_LIS, reg, 0, 0));
+    emit(p, value);
+}
+
+// The offset a beq or bne emitted next needs to reach target
+static int16_t to(const Program *p, uint32_t target) {
+    return (int16_t)(((int32_t)target - (int32_t)here(p) - 4) / 4);
+}
+
+static Machine *load(const Program *p) {
+    Machine *m = init_machine(0);
+    for (uint32_t i = 0; i < p->len; ++i)
+        m_write_word(m, i, p->words[i]);
+    m->pc = 0;
+    m->registers[30] = m->mem_size * 4;
+    m->registers[31] = RETURN_ADDRESS;
+    return m;
+}
+
+// Arithmetic: add, sub, mult, div, moves and compares in a counted loop
+static void arith_program(Program *p) {
+    const uint32_t iterations = quick ? 1000000 : 10000000;
+    emit_lis(p, 1, iterations);
+    emit_lis(p, 2, 1);
+    emit_lis(p, 5, 7);
+    emit_lis(p, 6, 3);
+    const uint32_t loop = here(p);
+    emit(p, ENC_R(FUNC_ADD, 3, 3, 1));
+    emit(p, ENC_R(FUNC_SUB, 4, 3, 2));
+    emit(p, ENC_R(FUNC_MULT, 0, 3, 5));
+    emit(p, ENC_R(FUNC_MFLO, 8, 0, 0));
+    emit(p, ENC_R(FUNC_DIV, 0, 8, 6));
+    emit(p, ENC_R(FUNC_MFHI, 9, 0, 0));
+    emit(p, ENC_R(FUNC_SLT, 10, 9, 5));
+    emit(p, ENC_R(FUNC_SLTU, 11, 5, 9));
+    emit(p, ENC_R(FUNC_SUB, 1, 1, 2));
+    emit(p, ENC_I(OP_BNE, 1, 0, to(p, loop)));
+    emit(p, ENC_R(FUNC_JR, 0, 31, 0));
+}
+
+// Calls: naive recursive fibonacci through jalr and jr, with a stack
+static void calls_program(Program *p) {
+    const uint32_t n = quick ? 22 : 27;
+    emit(p, ENC_I(OP_SW, 30, 31, -4));
+    emit_lis(p, 2, 4);
+    emit(p, ENC_R(FUNC_SUB, 30, 30, 2));
+    emit_lis(p, 1, n);
+    emit_lis(p, 7, 2);
+    const uint32_t fib_lis = here(p);
+    emit_lis(p, 4, 0);                      // patched below
+    emit(p, ENC_R(FUNC_JALR, 0, 4, 0));
+    emit(p, ENC_R(FUNC_ADD, 30, 30, 2));
+    emit(p, ENC_I(OP_LW, 30, 31, -4));
+    emit(p, ENC_R(FUNC_JR, 0, 31, 0));
+
+    // fib: $3 = fib($1), keeping $2, $4 and $7
+    const uint32_t fib = here(p);
+    p->words[fib_lis / 4 + 1] = fib;
+    emit(p, ENC_R(FUNC_SLT, 5, 1, 7));
+    emit(p, ENC_I(OP_BEQ, 5, 0, 2));
+    emit(p, ENC_R(FUNC_ADD, 3, 1, 0));
+    emit(p, ENC_R(FUNC_JR, 0, 31, 0));
+    // frame: 8 = $31, 4 = n, 0 = fib(n - 1)
+    emit(p, ENC_I(OP_SW, 30, 31, -4));
+    emit(p, ENC_I(OP_SW, 30, 1, -8));
+    emit_lis(p, 6, 12);
+    emit(p, ENC_R(FUNC_SUB, 30, 30, 6));
+    emit_lis(p, 6, 1);
+    emit(p, ENC_R(FUNC_SUB, 1, 1, 6));
+    emit(p, ENC_R(FUNC_JALR, 0, 4, 0));
+    emit(p, ENC_I(OP_SW, 30, 3, 0));
+    emit(p, ENC_I(OP_LW, 30, 1, 4));
+    emit_lis(p, 6, 2);
+    emit(p, ENC_R(FUNC_SUB, 1, 1, 6));
+    emit(p, ENC_R(FUNC_JALR, 0, 4, 0));
+    emit(p, ENC_I(OP_LW, 30, 5, 0));
+    emit(p, ENC_R(FUNC_ADD, 3, 3, 5));
+    emit(p, ENC_I(OP_LW, 30, 31, 8));
+    emit_lis(p, 6, 12);
+    emit(p, ENC_R(FUNC_ADD, 30, 30, 6));
+    emit(p, ENC_R(FUNC_JR, 0, 31, 0));
+}
+
+// Arrays: fill a 16 KB array and sum it, over and over
+static void array_program(Program *p) {
+    const uint32_t base = 0x10000, words = 4096;
+    emit_lis(p, 20, quick ? 50 : 500);
+    emit_lis(p, 2, 1);
+    emit_lis(p, 21, 4);
+    emit_lis(p, 22, words);
+    const uint32_t outer = here(p);
+    emit_lis(p, 10, base);
+    emit(p, ENC_R(FUNC_ADD, 11, 22, 0));
+    emit(p, ENC_R(FUNC_ADD, 12, 0, 0));
+    const uint32_t fill = here(p);
+    emit(p, ENC_I(OP_SW, 10, 12, 0));
+    emit(p, ENC_R(FUNC_ADD, 12, 12, 2));
+    emit(p, ENC_R(FUNC_ADD, 10, 10, 21));
+    emit(p, ENC_R(FUNC_SUB, 11, 11, 2));
+    emit(p, ENC_I(OP_BNE, 11, 0, to(p, fill)));
+    emit_lis(p, 10, base);
+    emit(p, ENC_R(FUNC_ADD, 11, 22, 0));
+    const uint32_t sum = here(p);
+    emit(p, ENC_I(OP_LW, 10, 13, 0));
+    emit(p, ENC_R(FUNC_ADD, 3, 3, 13));
+    emit(p, ENC_R(FUNC_ADD, 10, 10, 21));
+    emit(p, ENC_R(FUNC_SUB, 11, 11, 2));
+    emit(p, ENC_I(OP_BNE, 11, 0, to(p, sum)));
+    emit(p, ENC_R(FUNC_SUB, 20, 20, 2));
+    emit(p, ENC_I(OP_BNE, 20, 0, to(p, outer)));
+    emit(p, ENC_R(FUNC_JR, 0, 31, 0));
+}
+
+// Output: a character at a time through the mapped output address
+static void output_program(Program *p) {
+    emit_lis(p, 1, quick ? 1000000 : 10000000);
+    emit_lis(p, 2, 1);
+    emit_lis(p, 5, MAPPED_OUTPUT_ADDR);
+    emit_lis(p, 6, 'a');
+    const uint32_t loop = here(p);
+    emit(p, ENC_I(OP_SW, 5, 6, 0));
+    emit(p, ENC_R(FUNC_SUB, 1, 1, 2));
+    emit(p, ENC_I(OP_BNE, 1, 0, to(p, loop)));
+    emit(p, ENC_R(FUNC_JR, 0, 31, 0));
+}
+
+static void discard(void *context, const uint8_t *bytes, size_t len) {
+    (void)context;
+    (void)bytes;
+    (void)len;
+}
+
+// Runs a program to the end with the default engine, returning how many
+//   instructions it retired
+static uint64_t run_workload(void (*build)(Program *), Measurement *measure) {
+    Program p = { { 0 }, 0 };
+    build(&p);
+
+    // count them on a machine of its own
+    Machine *counted = load(&p);
+    m_output_to_callback(counted, discard, NULL);
+    uint64_t retired;
+    if (step_machine_n(counted, UINT64_MAX, &retired).retcode != IR_DONE)
+        fail("a workload did not finish");
+    destroy_machine(counted);
+
+    Machine *m = load(&p);
+    m_output_to_callback(m, discard, NULL);
+    measure_begin(measure);
+    const EmulatorStatus status = step_machine_loop(m);
+    measure_end(measure);
+    if (status.retcode != IR_DONE)
+        fail("a workload did not finish");
+    destroy_machine(m);
+    return retired;
+}
+
+static uint64_t macro_arith(Measurement *measure) {
+    return run_workload(arith_program, measure);
+}
+
+static uint64_t macro_calls(Measurement *measure) {
+    return run_workload(calls_program, measure);
+}
+
+static uint64_t macro_array(Measurement *measure) {
+    return run_workload(array_program, measure);
+}
+
+static uint64_t macro_output(Measurement *measure) {
+    return run_workload(output_program, measure);
+}
+
+
+enum { DECODE_WORDS = 1 << 16 };
+
+// Fills words with the same random words every time
+static void random_words(uint32_t *words, uint32_t n) {
+    uint32_t x = 2463534242u;
+    for (uint32_t i = 0; i < n; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        words[i] = x;
+    }
+}
+
+static uint64_t micro_decode(Measurement *measure) {
+    enum { NUM_WORDS = DECODE_WORDS };
+    const uint64_t rounds = quick ? 32 : 256;
+    static uint32_t words[NUM_WORDS];
+    random_words(words, NUM_WORDS);
+
+    volatile uint32_t sink = 0;
+    measure_begin(measure);
+    for (uint64_t r = 0; r < rounds; ++r) {
+        uint32_t acc = 0;
+        for (uint32_t i = 0; i < NUM_WORDS; ++i) {
+            const Instruction ins = decode_instruction(words[i]);
+            acc += ins.type + ins.code + ins.decoded.i.imm;
+        }
+        sink += acc;
+    }
+    measure_end(measure);
+    (void)sink;
+    return rounds * NUM_WORDS;
+}
+
+static uint64_t micro_decode_batch(Measurement *measure) {
+    const uint64_t rounds = quick ? 32 : 256;
+    static uint32_t words[DECODE_WORDS];
+    static uint8_t type[DECODE_WORDS], code[DECODE_WORDS];
+    static uint8_t s[DECODE_WORDS], t[DECODE_WORDS], d[DECODE_WORDS];
+    static int16_t imm[DECODE_WORDS];
+    const DecodedTable table = { type, code, s, t, d, imm };
+    random_words(words, DECODE_WORDS);
+
+    measure_begin(measure);
+    for (uint64_t r = 0; r < rounds; ++r)
+        decode_instructions(words, DECODE_WORDS, &table);
+    measure_end(measure);
+    return rounds * DECODE_WORDS;
+}
+
+static uint64_t micro_step_machine(Measurement *measure) {
+    Machine *m = init_machine(0);
+    const uint64_t retired = bench_load_loop(m, quick ? 2000000 : 20000000);
+    EmulatorStatus status;
+    measure_begin(measure);
+    do status = step_machine(m);
+    while (status.retcode == IR_SUCCESS);
+    measure_end(measure);
+    if (status.retcode != IR_DONE)
+        fail("the step_machine loop did not finish");
+    destroy_machine(m);
+    return retired;
+}
+
+static uint64_t micro_step_machine_loop(Measurement *measure) {
+    Machine *m = init_machine(0);
+    const uint64_t retired = bench_load_loop(m, quick ? 2000000 : 20000000);
+    measure_begin(measure);
+    const EmulatorStatus status = step_machine_loop(m);
+    measure_end(measure);
+    if (status.retcode != IR_DONE)
+        fail("the step_machine_loop loop did not finish");
+    destroy_machine(m);
+    return retired;
+}
+
+static uint64_t micro_load_program(Measurement *measure) {
+    const uint32_t words = quick ? 1 << 20 : NUM_WORDS_MEMORY;
+    FILE *file = tmpfile();
+    if (file == NULL)
+        fail("can't make a temporary file");
+    uint8_t chunk[4096];
+    for (size_t i = 0; i < sizeof(chunk); ++i)
+        chunk[i] = (uint8_t)(i * 31 + 7);
+    for (uint32_t i = 0; i < words * 4 / sizeof(chunk); ++i)
+        if (fwrite(chunk, 1, sizeof(chunk), file) != sizeof(chunk))
+            fail("can't write a temporary file");
+    fflush(file);
+    rewind(file);
+
+    Machine *m = init_machine(0);
+    measure_begin(measure);
+    load_program(file, m, 0);   // closes the file
+    measure_end(measure);
+    destroy_machine(m);
+    return words;
+}
+
+static uint64_t micro_dump_memory(Measurement *measure) {
+    Machine *m = init_machine(quick ? 4 << 20 : 0);
+    for (uint32_t i = 0; i < m->mem_size; ++i)
+        m->mem[i] = i * 2654435761u;
+    measure_begin(measure);
+    dump_memory(m, "/dev/null");
+    measure_end(measure);
+    const uint64_t words = m->mem_size;
+    destroy_machine(m);
+    return words;
+}
+
+
+// Reuses one machine the way mips241-batch does, each run writing a
+//   program and a few pages of stack before the machine is reset
+static uint64_t micro_reset_machine(Measurement *measure) {
+    const uint64_t runs = quick ? 1000 : 20000;
+    Machine *m = init_machine(0);
+    measure_begin(measure);
+    for (uint64_t run = 0; run < runs; ++run) {
+        for (uint32_t i = 0; i < 256; ++i)
+            m_write_word(m, i, i);
+        for (uint32_t page = 1; page <= 16; ++page)
+            m_write_word(m, NUM_WORDS_MEMORY / 4 - page * DIRTY_PAGE_WORDS, page);
+        reset_machine(m);
+    }
+    measure_end(measure);
+    destroy_machine(m);
+    return runs;
+}
+
+
+typedef struct Benchmark {
+    const char *name;
+    const char *kind;   // micro or macro
+    const char *unit;   // what is counted
+    uint64_t (*run)(Measurement *);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "decode_instruction", "micro", "decodes", micro_decode },
+    { "decode_instructions", "micro", "decodes", micro_decode_batch },
+    { "step_machine", "micro", "instructions", micro_step_machine },
+    { "step_machine_loop", "micro", "instructions", micro_step_machine_loop },
+    { "load_program", "micro", "words", micro_load_program },
+    { "dump_memory", "micro", "words", micro_dump_memory },
+    { "reset_machine", "micro", "resets", micro_reset_machine },
+    { "arith", "macro", "instructions", macro_arith },
+    { "calls", "macro", "instructions", macro_calls },
+    { "array", "macro", "instructions", macro_array },
+    { "output", "macro", "instructions", macro_output }
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+typedef struct Result {
+    const Benchmark *benchmark;
+    uint64_t count;
+    Measurement best;
+} Result;
+
+static bool selected(const char *name, int argc, char **argv) {
+    if (optind == argc)
+        return true;
+    for (int i = optind; i < argc; ++i)
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    return false;
+}
+
+static void write_json(FILE *out, const Result *results, size_t num_results, int repeats) {
+    fprintf(out, "{\n  \"quick\": %s,\n  \"repeats\": %d,\n  \"benchmarks\": [",
+            quick ? "true" : "false", repeats);
+    for (size_t i = 0; i < num_results; ++i) {
+        const Result *r = &results[i];
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"kind\": \"%s\", \"unit\": \"%s\", "
+                "\"count\": %" PRIu64 ", \"seconds\": %.9f, \"mips\": %.3f, "
+                "\"ns_per_op\": %.4f, ",
+                i ? "," : "", r->benchmark->name, r->benchmark->kind, r->benchmark->unit,
+                r->count, r->best.seconds, r->count / r->best.seconds / 1e6,
+                r->best.seconds * 1e9 / r->count);
+        if (r->best.counters.available)
+            fprintf(out, "\"host_cycles\": %" PRIu64 ", \"host_instructions\": %" PRIu64 "}",
+                    r->best.counters.cycles, r->best.counters.instructions);
+        else
+            fprintf(out, "\"host_cycles\": null, \"host_instructions\": null}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    int repeats = 3;
+    const char *json = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "qr:j:")) != -1) {
+        switch (opt) {
+            case 'q':
+                quick = true;
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 'j':
+                json = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-q] [-r repeats] [-j results.json] [name...]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (repeats < 1)
+        repeats = 1;
+
+    Result results[NUM_BENCHMARKS];
+    size_t num_results = 0;
+    printf("%-20s %6s %14s %10s %10s %14s %14s\n", "benchmark", "kind", "count",
+           "M/s", "ns/op", "host cycles", "host instrs");
+    for (size_t i = 0; i < NUM_BENCHMARKS; ++i) {
+        if (!selected(benchmarks[i].name, argc, argv))
+            continue;
+
+        Result *r = &results[num_results++];
+        r->benchmark = &benchmarks[i];
+        for (int rep = 0; rep < repeats; ++rep) {
+            Measurement measure;
+            r->count = benchmarks[i].run(&measure);
+            if (rep == 0 || measure.seconds < r->best.seconds)
+                r->best = measure;
+        }
+
+        printf("%-20s %6s %14" PRIu64 " %10.2f %10.3f", r->benchmark->name,
+               r->benchmark->kind, r->count, r->count / r->best.seconds / 1e6,
+               r->best.seconds * 1e9 / r->count);
+        if (r->best.counters.available)
+            printf(" %14" PRIu64 " %14" PRIu64 "\n", r->best.counters.cycles,
+                   r->best.counters.instructions);
+        else
+            printf(" %14s %14s\n", "-", "-");
+        fflush(stdout);
+    }
+
+    if (json != NULL) {
+        FILE *out = fopen(json, "w");
+        if (out == NULL)
+            fail("can't write the JSON results");
+        write_json(out, results, num_results, repeats);
+        if (fclose(out) != 0)
+            fail("can't write the JSON results");
+    }
+    return EXIT_SUCCESS;
+}
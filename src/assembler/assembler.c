@@ -0,0 +1,394 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assembler/assembler.h"
+#include "machine/byteorder.h"
+#include "machine/machine.h"
+
+// How an instruction's operands are written
+enum form {
+    FORM_DST,       // add $d, $s, $t
+    FORM_ST,        // mult $s, $t
+    FORM_D,         // mfhi $d
+    FORM_S,         // jr $s
+    FORM_BRANCH,    // beq $s, $t, i
+    FORM_MEMORY,    // lw $t, i($s)
+    FORM_WORD       // .word i
+};
+
+static const struct Mnemonic {
+    const char *name;
+    enum form form;
+    uint8_t code;   // func, or opcode for I-types
+} mnemonics[] = {
+    { "add", FORM_DST, FUNC_ADD }, { "sub", FORM_DST, FUNC_SUB },
+    { "slt", FORM_DST, FUNC_SLT }, { "sltu", FORM_DST, FUNC_SLTU },
+    { "mult", FORM_ST, FUNC_MULT }, { "multu", FORM_ST, FUNC_MULTU },
+    { "div", FORM_ST, FUNC_DIV }, { "divu", FORM_ST, FUNC_DIVU },
+    { "mfhi", FORM_D, FUNC_MFHI }, { "mflo", FORM_D, FUNC_MFLO },
+    { "lis", FORM_D, FUNC_LIS },
+    { "jr", FORM_S, FUNC_JR }, { "jalr", FORM_S, FUNC_JALR },
+    { "beq", FORM_BRANCH, OP_BEQ }, { "bne", FORM_BRANCH, OP_BNE },
+    { "lw", FORM_MEMORY, OP_LW }, { "sw", FORM_MEMORY, OP_SW },
+    { ".word", FORM_WORD, 0 }
+};
+
+typedef struct Label {
+    const char *name;   // into the source, NULL for an empty slot
+    size_t len;
+    uint32_t addr;
+} Label;
+
+// A word that needs a label's address, or offset for a branch
+typedef struct Fixup {
+    uint32_t idx;
+    uint32_t line;
+    const char *name;
+    size_t len;
+    bool branch;
+} Fixup;
+
+typedef struct Assembler {
+    const char *p;      // where we are in the current line
+    const char *end;    // the end of it, or of the comment starting it
+    uint32_t line;
+    char *error;
+    size_t error_cap;
+    bool failed;
+
+    uint32_t *words;
+    size_t num_words;
+    size_t words_cap;
+
+    Label *labels;      // open addressing, at most half full
+    size_t num_labels;
+    size_t labels_cap;
+
+    Fixup *fixups;
+    size_t num_fixups;
+    size_t fixups_cap;
+} Assembler;
+
+
+// Records the first error; the rest would only follow from it
+static bool fail(Assembler *as, uint32_t line, const char *format, ...) {
+    if (!as->failed) {
+        as->failed = true;
+        if (as->error_cap != 0) {
+            va_list args;
+            va_start(args, format);
+            const int n = snprintf(as->error, as->error_cap, "line %u: ", line);
+            if (n >= 0 && (size_t)n < as->error_cap)
+                vsnprintf(as->error + n, as->error_cap - n, format, args);
+            va_end(args);
+        }
+    }
+    return false;
+}
+
+// Makes room for one more element in a growing array
+static bool reserve(Assembler *as, void **items, size_t count, size_t *cap, size_t size) {
+    if (count < *cap)
+        return true;
+    const size_t new_cap = *cap != 0 ? 2 * *cap : 256;
+    void *grown = realloc(*items, new_cap * size);
+    if (grown == NULL)
+        return fail(as, as->line, "out of memory");
+    *items = grown;
+    *cap = new_cap;
+    return true;
+}
+
+static bool emit(Assembler *as, uint32_t word) {
+    if (as->num_words == UINT32_MAX / 4)
+        return fail(as, as->line, "the program is too big");
+    if (!reserve(as, (void **)&as->words, as->num_words, &as->words_cap, sizeof(uint32_t)))
+        return false;
+    as->words[as->num_words++] = word;
+    return true;
+}
+
+
+static uint64_t hash_name(const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)name[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Returns the slot for a label, empty if it hasn't been defined
+static Label *find_label(Label *labels, size_t cap, const char *name, size_t len) {
+    for (size_t i = hash_name(name, len) & (cap - 1); ; i = (i + 1) & (cap - 1)) {
+        Label *l = &labels[i];
+        if (l->name == NULL || (l->len == len && memcmp(l->name, name, len) == 0))
+            return l;
+    }
+}
+
+static bool define_label(Assembler *as, const char *name, size_t len) {
+    if (2 * (as->num_labels + 1) > as->labels_cap) {
+        const size_t new_cap = as->labels_cap != 0 ? 2 * as->labels_cap : 256;
+        Label *grown = calloc(new_cap, sizeof(Label));
+        if (grown == NULL)
+            return fail(as, as->line, "out of memory");
+        for (size_t i = 0; i < as->labels_cap; ++i)
+            if (as->labels[i].name != NULL)
+                *find_label(grown, new_cap, as->labels[i].name, as->labels[i].len) = as->labels[i];
+        free(as->labels);
+        as->labels = grown;
+        as->labels_cap = new_cap;
+    }
+
+    Label *l = find_label(as->labels, as->labels_cap, name, len);
+    if (l->name != NULL)
+        return fail(as, as->line, "duplicate label: %.*s", (int)len, name);
+    *l = (Label) { name, len, (uint32_t)as->num_words * 4 };
+    as->num_labels++;
+    return true;
+}
+
+
+static inline bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static void skip_space(Assembler *as) {
+    while (as->p < as->end && (*as->p == ' ' || *as->p == '\t' || *as->p == '\r'
+                               || *as->p == '\f' || *as->p == '\v'))
+        as->p++;
+}
+
+// Reads a label or mnemonic: a letter (or . for .word) then letters and
+//   digits
+static size_t read_name(Assembler *as) {
+    const char *start = as->p;
+    if (as->p < as->end && (is_alpha(*as->p) || *as->p == '.'))
+        as->p++;
+    while (as->p < as->end && (is_alpha(*as->p) || is_digit(*as->p)))
+        as->p++;
+    return (size_t)(as->p - start);
+}
+
+static bool expect(Assembler *as, char c) {
+    skip_space(as);
+    if (as->p == as->end || *as->p != c)
+        return fail(as, as->line, "expected '%c'", c);
+    as->p++;
+    return true;
+}
+
+static bool parse_register(Assembler *as, uint32_t *reg) {
+    if (!expect(as, '$'))
+        return false;
+    uint32_t value = 0;
+    const char *start = as->p;
+    while (as->p < as->end && is_digit(*as->p) && value <= NUM_REGISTERS)
+        value = value * 10 + (uint32_t)(*as->p++ - '0');
+    if (as->p == start || value >= NUM_REGISTERS
+        || (as->p < as->end && (is_digit(*as->p) || is_alpha(*as->p))))
+        return fail(as, as->line, "bad register");
+    *reg = value;
+    return true;
+}
+
+// Reads a decimal or 0x hexadecimal integer that fits in bits, or a
+//   label for fixing up later. Decimal integers may be negative, down to
+//   -2^(bits-1); hex ones are the bits themselves.
+static bool parse_operand(Assembler *as, unsigned bits, bool label_ok, bool branch,
+                          uint32_t *value) {
+    skip_space(as);
+    const char *start = as->p;
+    if (label_ok && as->p < as->end && is_alpha(*as->p)) {
+        const size_t len = read_name(as);
+        if (!reserve(as, (void **)&as->fixups, as->num_fixups, &as->fixups_cap, sizeof(Fixup)))
+            return false;
+        as->fixups[as->num_fixups++] =
+            (Fixup) { (uint32_t)as->num_words, as->line, start, len, branch };
+        *value = 0;
+        return true;
+    }
+
+    const uint64_t max = (1ull << bits) - 1;
+    uint64_t magnitude = 0;
+    bool negative = false, any = false;
+    if (as->end - as->p > 2 && as->p[0] == '0' && (as->p[1] == 'x' || as->p[1] == 'X')) {
+        as->p += 2;
+        for (;; ++as->p, any = true) {
+            const char c = as->p < as->end ? *as->p : '\0';
+            const int digit = is_digit(c) ? c - '0'
+                            : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                            : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0)
+                break;
+            magnitude = magnitude * 16 + (uint64_t)digit;
+            if (magnitude > max)
+                return fail(as, as->line, "hex integer out of range: %.*s",
+                            (int)(as->end - start), start);
+        }
+    } else {
+        if (as->p < as->end && *as->p == '-') {
+            negative = true;
+            as->p++;
+        }
+        for (; as->p < as->end && is_digit(*as->p); ++as->p, any = true) {
+            magnitude = magnitude * 10 + (uint64_t)(*as->p - '0');
+            // negative down to -2^(bits-1), positive up to 2^bits - 1 for
+            //   words or 2^(bits-1) - 1 for immediates
+            const uint64_t limit = negative ? 1ull << (bits - 1)
+                                 : bits == 32 ? max : max >> 1;
+            if (magnitude > limit)
+                return fail(as, as->line, "integer out of range: %.*s",
+                            (int)(as->end - start), start);
+        }
+    }
+    if (!any || (as->p < as->end && (is_alpha(*as->p) || is_digit(*as->p))))
+        return fail(as, as->line, "bad integer");
+    *value = (uint32_t)((negative ? 0 - magnitude : magnitude) & max);
+    return true;
+}
+
+// Assembles the instruction the line is at, if any
+static bool assemble_instruction(Assembler *as, const char *name, size_t len) {
+    const struct Mnemonic *mn = NULL;
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); ++i)
+        if (strlen(mnemonics[i].name) == len && memcmp(mnemonics[i].name, name, len) == 0)
+            mn = &mnemonics[i];
+    if (mn == NULL)
+        return fail(as, as->line, "unknown instruction: %.*s", (int)len, name);
+
+    uint32_t d = 0, s = 0, t = 0, imm = 0, word;
+    bool ok;
+    switch (mn->form) {
+        case FORM_DST:
+            ok = parse_register(as, &d) && expect(as, ',') && parse_register(as, &s)
+                 && expect(as, ',') && parse_register(as, &t);
+            word = (s << 21) | (t << 16) | (d << 11) | mn->code;
+            break;
+        case FORM_ST:
+            ok = parse_register(as, &s) && expect(as, ',') && parse_register(as, &t);
+            word = (s << 21) | (t << 16) | mn->code;
+            break;
+        case FORM_D:
+            ok = parse_register(as, &d);
+            word = (d << 11) | mn->code;
+            break;
+        case FORM_S:
+            ok = parse_register(as, &s);
+            word = (s << 21) | mn->code;
+            break;
+        case FORM_BRANCH:
+            ok = parse_register(as, &s) && expect(as, ',') && parse_register(as, &t)
+                 && expect(as, ',') && parse_operand(as, 16, true, true, &imm);
+            word = ((uint32_t)mn->code << 26) | (s << 21) | (t << 16) | imm;
+            break;
+        case FORM_MEMORY:
+            ok = parse_register(as, &t) && expect(as, ',')
+                 && parse_operand(as, 16, false, false, &imm)
+                 && expect(as, '(') && parse_register(as, &s) && expect(as, ')');
+            word = ((uint32_t)mn->code << 26) | (s << 21) | (t << 16) | imm;
+            break;
+        case FORM_WORD:
+        default:
+            ok = parse_operand(as, 32, true, false, &imm);
+            word = imm;
+            break;
+    }
+    return ok && emit(as, word);
+}
+
+// Assembles a line: any number of labels, then at most one instruction
+static bool assemble_line(Assembler *as) {
+    for (;;) {
+        skip_space(as);
+        if (as->p == as->end)
+            return true;
+
+        const char *name = as->p;
+        const size_t len = read_name(as);
+        if (len == 0)
+            return fail(as, as->line, "unexpected '%c'", *as->p);
+        if (as->p < as->end && *as->p == ':') {
+            as->p++;
+            if (*name == '.' || !define_label(as, name, len))
+                return fail(as, as->line, "bad label: %.*s", (int)len, name);
+            continue;
+        }
+
+        if (!assemble_instruction(as, name, len))
+            return false;
+        skip_space(as);
+        if (as->p != as->end)
+            return fail(as, as->line, "expected the end of the line");
+        return true;
+    }
+}
+
+static bool resolve_fixups(Assembler *as) {
+    for (size_t i = 0; i < as->num_fixups; ++i) {
+        const Fixup *f = &as->fixups[i];
+        const Label *l = as->labels_cap != 0
+            ? find_label(as->labels, as->labels_cap, f->name, f->len) : NULL;
+        if (l == NULL || l->name == NULL)
+            return fail(as, f->line, "no such label: %.*s", (int)f->len, f->name);
+        if (!f->branch) {
+            as->words[f->idx] |= l->addr;
+            continue;
+        }
+        const int64_t offset = ((int64_t)l->addr - ((int64_t)f->idx * 4 + 4)) / 4;
+        if (offset < INT16_MIN || offset > INT16_MAX)
+            return fail(as, f->line, "branch to %.*s is too far", (int)f->len, f->name);
+        as->words[f->idx] |= (uint16_t)offset;
+    }
+    return true;
+}
+
+
+uint8_t *asm_assemble(const char *source, size_t len, size_t *code_len,
+                      char *error, size_t error_cap) {
+    Assembler as = { 0 };
+    as.error = error;
+    as.error_cap = error_cap;
+
+    const char *const source_end = source + len;
+    for (const char *line = source; line < source_end && !as.failed; ) {
+        const char *newline = memchr(line, '\n', (size_t)(source_end - line));
+        const char *line_end = newline != NULL ? newline : source_end;
+        const char *comment = memchr(line, ';', (size_t)(line_end - line));
+        as.p = line;
+        as.end = comment != NULL ? comment : line_end;
+        as.line++;
+        assemble_line(&as);
+        line = line_end + 1;
+    }
+    if (!as.failed)
+        resolve_fixups(&as);
+
+    uint8_t *code = NULL;
+    if (!as.failed) {
+        code = malloc(as.num_words * 4 + 1);
+        if (code == NULL)
+            fail(&as, as.line, "out of memory");
+        else
+            copy_words_be(code, as.words, as.num_words);
+    }
+    free(as.words);
+    free(as.labels);
+    free(as.fixups);
+    if (as.failed) {
+        free(code);
+        return NULL;
+    }
+    *code_len = as.num_words * 4;
+    return code;
+}
+
+void asm_free(uint8_t *code) {
+    free(code);
+}
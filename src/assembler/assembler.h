@@ -0,0 +1,29 @@
+/**
+ * An assembler for the CS 241 subset of MIPS, giving the same words as
+ * cs241.binasm: the instructions in common/defs.h, .word, labels, and
+ * comments from ; to the end of a line. Programs are assembled to be
+ * loaded at address 0, so a label is the byte address of what follows it.
+ */
+#ifndef ASSEMBLER_H__
+#define ASSEMBLER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common/defs.h"
+
+// What asm_assemble's output is cached as, in place of an assembler's
+//   command line. Change it along with what asm_assemble gives.
+#define ASM_TOOL "mips241 builtin 1"
+
+// Assembles len bytes of source into big-endian machine code, like a
+//   program file. Returns the code, to free with asm_free, setting
+//   *code_len to its length in bytes. On an error returns NULL and
+//   writes a message like "line 3: no such label: loop" to error, which
+//   has room for error_cap bytes.
+mips241_EXPORT uint8_t *asm_assemble(const char *source, size_t len, size_t *code_len,
+                                     char *error, size_t error_cap);
+
+// Frees code from asm_assemble or asm_cache_get.
+mips241_EXPORT void asm_free(uint8_t *code);
+
+#endif
@@ -0,0 +1,167 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assembler/assembler.h"
+#include "assembler/cache.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define make_dir(PATH) _mkdir(PATH)
+#define process_id() _getpid()
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define make_dir(PATH) mkdir(PATH, 0777)
+#define process_id() getpid()
+#endif
+
+#define CACHE_MAGIC "MIPS241C"
+#define HEADER_BYTES 32         // the magic, then three lengths
+#define MAX_PATH_BYTES 4096
+
+
+const char *asm_cache_dir(void) {
+    static char dir[MAX_PATH_BYTES];
+    const char *env = getenv("MIPS241_CACHE_DIR");
+    if (env != NULL)
+        return env[0] != '\0' ? env : NULL;
+
+    int n = -1;
+    if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+        n = snprintf(dir, sizeof(dir), "%s/mips241", env);
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+        n = snprintf(dir, sizeof(dir), "%s/.cache/mips241", env);
+    return n > 0 && (size_t)n < sizeof(dir) ? dir : NULL;
+}
+
+
+// FNV-1a over the tool, a NUL and the source
+static uint64_t hash_entry(const char *tool, const char *source, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const char *c = tool; ; ++c) {
+        h = (h ^ (uint8_t)*c) * 0x100000001b3ull;
+        if (*c == '\0')
+            break;
+    }
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)source[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static bool entry_path(char *path, const char *dir, const char *tool,
+                       const char *source, size_t len) {
+    const int n = snprintf(path, MAX_PATH_BYTES, "%s/%016llx.bin", dir,
+                           (unsigned long long)hash_entry(tool, source, len));
+    return n > 0 && n < MAX_PATH_BYTES;
+}
+
+// Lengths in the header are little-endian
+static void put_length(uint8_t *p, uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+        p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t get_length(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+
+uint8_t *asm_cache_get(const char *dir, const char *tool, const char *source,
+                       size_t len, size_t *code_len) {
+    char path[MAX_PATH_BYTES];
+    if (dir == NULL || !entry_path(path, dir, tool, source, len))
+        return NULL;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    uint8_t header[HEADER_BYTES];
+    uint8_t *code = NULL;
+    char *stored = NULL;
+    const size_t tool_len = strlen(tool);
+    if (fread(header, 1, sizeof(header), f) != sizeof(header)
+        || memcmp(header, CACHE_MAGIC, 8) != 0
+        || get_length(header + 8) != tool_len
+        || get_length(header + 16) != len
+        || get_length(header + 24) > SIZE_MAX / 2)
+        goto miss;
+
+    // a collision has a different tool or source
+    stored = malloc(tool_len + len + 1);
+    if (stored == NULL || fread(stored, 1, tool_len + len, f) != tool_len + len
+        || memcmp(stored, tool, tool_len) != 0
+        || memcmp(stored + tool_len, source, len) != 0)
+        goto miss;
+
+    *code_len = (size_t)get_length(header + 24);
+    code = malloc(*code_len + 1);
+    if (code == NULL || fread(code, 1, *code_len, f) != *code_len || fgetc(f) != EOF) {
+        free(code);
+        code = NULL;
+    }
+
+miss:
+    free(stored);
+    fclose(f);
+    return code;
+}
+
+
+// Makes dir and any directories it's in
+static bool make_dirs(const char *dir) {
+    char path[MAX_PATH_BYTES];
+    const size_t len = strlen(dir);
+    if (len >= sizeof(path))
+        return false;
+    memcpy(path, dir, len + 1);
+    for (size_t i = 1; i <= len; ++i) {
+        if (path[i] == '/' || path[i] == '\\' || path[i] == '\0') {
+            const char c = path[i];
+            path[i] = '\0';
+            if (make_dir(path) != 0 && errno != EEXIST)
+                return false;
+            path[i] = c;
+        }
+    }
+    return true;
+}
+
+bool asm_cache_put(const char *dir, const char *tool, const char *source, size_t len,
+                   const uint8_t *code, size_t code_len) {
+    char path[MAX_PATH_BYTES], temp[MAX_PATH_BYTES];
+    if (dir == NULL || !entry_path(path, dir, tool, source, len) || !make_dirs(dir))
+        return false;
+    const int n = snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)process_id());
+    if (n <= 0 || n >= (int)sizeof(temp))
+        return false;
+
+    FILE *f = fopen(temp, "wb");
+    if (f == NULL)
+        return false;
+    uint8_t header[HEADER_BYTES];
+    const size_t tool_len = strlen(tool);
+    memcpy(header, CACHE_MAGIC, 8);
+    put_length(header + 8, tool_len);
+    put_length(header + 16, len);
+    put_length(header + 24, code_len);
+    bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header)
+              && fwrite(tool, 1, tool_len, f) == tool_len
+              && fwrite(source, 1, len, f) == len
+              && fwrite(code, 1, code_len, f) == code_len;
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok || rename(temp, path) != 0) {
+        remove(temp);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+/**
+ * A cache of assembled programs on disk, so that assembling the same
+ * source again is a file read rather than a run of the assembler.
+ *
+ * Entries are named by a hash of the source and of the tool that
+ * assembled it, a string like its command line. Each holds both in
+ * full, so a hash collision is a miss rather than the wrong program.
+ * Entries are written to a temporary file and renamed into place, so
+ * runs sharing a cache never see half of one.
+ */
+#ifndef ASM_CACHE_H__
+#define ASM_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common/defs.h"
+
+// Returns the directory to cache in: $MIPS241_CACHE_DIR if it's set, or
+//   mips241 in $XDG_CACHE_HOME or ~/.cache. Returns NULL if none of
+//   those are set, or if MIPS241_CACHE_DIR is empty.
+mips241_EXPORT const char *asm_cache_dir(void);
+
+// Returns the code cached in dir for len bytes of source assembled by
+//   tool, to free with asm_free, setting *code_len to its length. Returns
+//   NULL if there is none.
+mips241_EXPORT uint8_t *asm_cache_get(const char *dir, const char *tool,
+                                      const char *source, size_t len,
+                                      size_t *code_len);
+
+// Caches code_len bytes of code for source assembled by tool in dir,
+//   creating it if need be. Returns false if it can't.
+mips241_EXPORT bool asm_cache_put(const char *dir, const char *tool,
+                                  const char *source, size_t len,
+                                  const uint8_t *code, size_t code_len);
+
+#endif
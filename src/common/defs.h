@@ -32,12 +32,15 @@
 #define OP_SW       0x2B
 
 static const uint32_t RETURN_ADDRESS = 0x8123456c;
+static const uint32_t MAPPED_INPUT_ADDR = 0xFFFF000C;
+static const uint32_t MAPPED_OUTPUT_ADDR = 0xFFFF0004;
 
 typedef struct Instruction {
    enum {
        TYPE_INVALID = 0,
        TYPE_R = 1,
-       TYPE_I = 2
+       TYPE_I = 2,
+       TYPE_BREAK = 3 // a breakpoint, in the predecode cache only
    } type;
    union {
        struct {
@@ -62,7 +65,9 @@ enum instruction_retcode {
     IR_OUT_OF_RANGE_MEMORY_ACCESS,
     IR_OUT_OF_RANGE_INSTRUCTION_FETCH,
     IR_INVALID_INSTRUCTION,
-    IR_BREAKPOINT
+    IR_BREAKPOINT,
+    IR_BUDGET_EXHAUSTED,
+    IR_INPUT_WAIT
 };
 
 typedef struct EmulatorStatus {
@@ -1,40 +1,140 @@
+#define _POSIX_C_SOURCE 200112L // fileno
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
 #include "emulator/emulator.h"
 #include "machine/machine.h"
 #include "machine/impl.h"
 #include "machine/decode.h"
+#include "machine/byteorder.h"
 #include "util/util.h"
 #include "common/defs.h"
 
 
-// 16 megabytes of memory
-void load_program(FILE * const infile, Machine *const machine, uint32_t offset) {
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MIPS241_MMAP
+#endif
+
+#define STAGING_BYTES (1024 * 1024) // for streamed loads and dumps
+#define PAGE_WORDS 1024             // granularity of trimmed dumps
+
+
+// Copies num_words big-endian words of program into memory at word idx
+static void place_program(Machine *const machine, const uint8_t *program,
+                          uint32_t idx, size_t num_words) {
+    give_up_unless(m_write_words(machine, idx, program, num_words * 4, true),
+                   "Your program is too big", PROGRAM_FAILURE, machine);
+}
+
+#ifdef MIPS241_MMAP
+// Loads the rest of a regular file by mapping it instead of reading it,
+//   advancing *idx past it. Returns false if infile isn't one, leaving it
+//   untouched.
+static bool load_mapped(FILE *const infile, Machine *const machine, uint32_t *idx) {
+    struct stat st;
+    const int fd = fileno(infile);
+    const long pos = ftell(infile);
+    if (fd < 0 || pos < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size <= pos)
+        return false;
+
+    const size_t bytes = (size_t)st.st_size;
+    void *const file = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED)
+        return false;
+
+    const size_t num_words = (bytes - pos) / 4;
+    place_program(machine, (const uint8_t *)file + pos, *idx, num_words);
+    *idx += (uint32_t)num_words;
+    munmap(file, bytes);
+    // leave the file where reading it would have
+    fseek(infile, 0, SEEK_END);
+    return true;
+}
+#endif
+
+// Loads a program from a pipe or anything else that can't be mapped,
+//   advancing *idx past it
+static void load_stream(FILE *const infile, Machine *const machine, uint32_t *idx) {
+    uint8_t *const staging = malloc(STAGING_BYTES);
+    give_up_unless(staging != NULL, "Can't allocate a load buffer", EXIT_FAILURE, machine);
+
+    size_t have = 0, got;
+    do {
+        got = fread(staging + have, 1, STAGING_BYTES - have, infile);
+        have += got;
+        const size_t num_words = have / 4;
+        place_program(machine, staging, *idx, num_words);
+        *idx += (uint32_t)num_words;
+        // keep a partial word for the next read
+        memmove(staging, staging + num_words * 4, have % 4);
+        have %= 4;
+    } while (got != 0);
+
+    free(staging);
+}
+
+uint32_t load_program(FILE * const infile, Machine *const machine, uint32_t offset) {
 
 
     // load the entire program into memory
     give_up_unless(infile != NULL, "Invalid file handle for load_program", EXIT_FAILURE, machine);
     give_up_unless(machine != NULL, "Null pointer for machine", EXIT_FAILURE, machine);
+    give_up_unless(offset % 4 == 0 && offset / 4 <= machine->mem_size,
+                   "Invalid load address", EXIT_FAILURE, machine);
+
+    // offset is a byte address, like the pc
+    uint32_t idx = offset / 4;
+#ifdef MIPS241_MMAP
+    if (!load_mapped(infile, machine, &idx))
+#endif
+        load_stream(infile, machine, &idx);
 
-    uint32_t curword;
-    uint32_t i = 0;
-    while (fread(&curword, sizeof(curword), 1, infile) != 0) {
-        if (is_little_endian())
-            curword = bswap_32(curword);
-        machine->mem[i + offset] = curword;
-        ++i;
-        give_up_unless(i < machine->mem_size, "Your program is too big", PROGRAM_FAILURE, machine);
-    }
     machine->pc = offset;
     machine->registers[31] = RETURN_ADDRESS;
     fclose(infile);
+    return idx * 4;
 }
 
+uint32_t load_program_bytes(const uint8_t *program, size_t len, Machine *const machine,
+                            uint32_t offset) {
+    give_up_unless(machine != NULL, "Null pointer for machine", EXIT_FAILURE, machine);
+    give_up_unless(offset % 4 == 0 && offset / 4 <= machine->mem_size,
+                   "Invalid load address", EXIT_FAILURE, machine);
+
+    const uint32_t idx = offset / 4;
+    place_program(machine, program, idx, len / 4);
+    machine->pc = offset;
+    machine->registers[31] = RETURN_ADDRESS;
+    return (idx + (uint32_t)(len / 4)) * 4;
+}
+
+
+// Returns whether count words from words are all zero
+static bool all_zero(const uint32_t *words, size_t count) {
+    uint32_t bits = 0;
+    for (size_t i = 0; i < count; ++i)
+        bits |= words[i];
+    return bits == 0;
+}
+
+// Writes memory big-endian, stopping early at a run of zero pages
+//   reaching the end of memory if trim is set
+static void dump(const Machine *const machine, const char *filename, bool trim) {
+    size_t end = machine->mem_size;
+    while (trim && end > 0) {
+        const size_t page = (end - 1) / PAGE_WORDS * PAGE_WORDS;
+        if (!all_zero(machine->mem + page, end - page))
+            break;
+        end = page;
+    }
 
-void dump_memory(const Machine *const machine, const char *filename) {
     FILE *dumpfile = fopen(filename, "wb");
 
     if (dumpfile == NULL) {
@@ -42,18 +142,83 @@ void dump_memory(const Machine *const machine, const char *filename) {
         return;
     }
 
-    for (size_t i = 0; i < machine->mem_size; ++i) {
-        const uint32_t word = bswap_32(machine->mem[i]);
-        size_t ret = fwrite(&word, sizeof(word), 1, dumpfile);
+    uint8_t *const staging = malloc(STAGING_BYTES);
+    if (staging == NULL) {
+        fprintf(stderr, "Unable to allocate a buffer for memory dump.");
+        fclose(dumpfile);
+        return;
+    }
+
+    for (size_t i = 0; i < end; i += STAGING_BYTES / 4) {
+        const size_t num_words = end - i < STAGING_BYTES / 4 ? end - i : STAGING_BYTES / 4;
+        copy_words_be(staging, machine->mem + i, num_words);
+        size_t ret = fwrite(staging, 4, num_words, dumpfile);
 
-        if (ret != 1) {
+        if (ret != num_words) {
             fprintf(stderr, "Memory dump to file %s failed.", filename);
             break;
         }
     }
 
+    free(staging);
     fclose(dumpfile);
 }
 
+void dump_memory(const Machine *const machine, const char *filename) {
+    dump(machine, filename, false);
+}
+
+void dump_memory_trimmed(const Machine *const machine, const char *filename) {
+    dump(machine, filename, true);
+}
+
+bool dump_memory_changes(const Machine *const machine, const char *filename) {
+    const uint32_t count = m_changed_pages(machine, NULL, 0);
+    uint32_t *pages = malloc(sizeof(uint32_t) * ((size_t)count + 1));
+    uint8_t *staging = malloc(8 + 4 * DIRTY_PAGE_WORDS);
+    FILE *dumpfile = pages != NULL && staging != NULL ? fopen(filename, "wb") : NULL;
+    if (dumpfile == NULL) {
+        free(pages);
+        free(staging);
+        return false;
+    }
+
+    m_changed_pages(machine, pages, count);
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        const size_t first = (size_t)pages[i] * DIRTY_PAGE_WORDS;
+        const uint32_t num_words = machine->mem_size - first < DIRTY_PAGE_WORDS
+                                   ? (uint32_t)(machine->mem_size - first) : DIRTY_PAGE_WORDS;
+        const uint32_t head[2] = { pages[i], num_words };
+        copy_words_be(staging, head, 2);
+        copy_words_be(staging + 8, machine->mem + first, num_words);
+        ok = fwrite(staging, 4, 2 + (size_t)num_words, dumpfile) == 2 + (size_t)num_words;
+    }
+
+    ok = fclose(dumpfile) == 0 && ok;
+    free(pages);
+    free(staging);
+    return ok;
+}
+
+const char *status_string(enum instruction_retcode retcode) {
+    static const char * status_strings[] = {
+        [IR_DONE] = "Program completed successfully.",
+        [IR_SUCCESS] = "Program execution paused.",
+        [IR_UNALIGNED_MEMORY_ACCESS] = "Program attempted to read/write an unaligned address.",
+        [IR_UNALIGNED_INSTRUCTION_FETCH] = "Program counter contains an unaligned address.",
+        [IR_OUT_OF_RANGE_MEMORY_ACCESS] = "Program attempted to read/write memory that was out of bounds.",
+        [IR_OUT_OF_RANGE_INSTRUCTION_FETCH] = "Program counter contains an out-of-bounds address.",
+        [IR_INVALID_INSTRUCTION] = "An invalid instruction was encountered.",
+        [IR_BREAKPOINT] = "Program stopped at a breakpoint.",
+        [IR_BUDGET_EXHAUSTED] = "Program stopped after the instruction limit.",
+        [IR_INPUT_WAIT] = "Program is waiting for input."
+    };
+
+    if ((size_t)retcode >= sizeof(status_strings) / sizeof(status_strings[0]))
+        return "Unknown error!";
+    return status_strings[retcode];
+}
+
 void init_emulator(void) {
 }
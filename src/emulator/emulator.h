@@ -6,13 +6,24 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include "common/defs.h"
 #include "machine/machine.h"
 
 
-// Load a program from a FILE into the machine at the offset.
-mips241_EXPORT void load_program(FILE *const file, Machine *const machine, 
-                                 uint32_t offset);
+// Load a program from a FILE into the machine at the byte address offset,
+//   and close the file. Regular files are mapped rather than read.
+//   Returns the byte address just past the program.
+mips241_EXPORT uint32_t load_program(FILE *const file, Machine *const machine,
+                                     uint32_t offset);
+
+// Like load_program, but from len bytes of big-endian machine code
+//   already in memory, such as from asm_assemble.
+mips241_EXPORT uint32_t load_program_bytes(const uint8_t *program, size_t len,
+                                           Machine *const machine, uint32_t offset);
+
+// Describes how a program stopped, the way the legacy frontend does.
+mips241_EXPORT const char *status_string(enum instruction_retcode retcode);
 
 // Must call this function on startup to initialize things.
 mips241_EXPORT void init_emulator(void);
@@ -21,4 +32,14 @@ mips241_EXPORT void init_emulator(void);
 mips241_EXPORT void dump_memory(const Machine *const machine,
                                 const char *filename);
 
+// Like dump_memory, but leaves out zero pages at the end of memory
+mips241_EXPORT void dump_memory_trimmed(const Machine *const machine,
+                                        const char *filename);
+
+// Dumps only the pages of memory m_changed_pages lists, each as its page
+//   number, its length in words and then its words, all big-endian.
+//   Returns false if it can't.
+mips241_EXPORT bool dump_memory_changes(const Machine *const machine,
+                                        const char *filename);
+
 #endif
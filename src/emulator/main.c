@@ -1,36 +1,516 @@
+/**
+ * The native frontend: loads a program, runs it, and prints the registers
+ * and how it stopped the way mips241.legacy does, without the Racket
+ * runtime to start up first.
+ *
+ * Usage: cmips241 [options] [file]
+ *     --version                 print the version number
+ *     -l, --load-at ADDRESS     load the program at ADDRESS (0 by default)
+ *     -t, --type binary|ascii|image
+ *                               what the file holds, instead of guessing
+ *     -a, --assembler COMMAND   assembles ascii files, reading standard
+ *                               input, instead of the builtin assembler
+ *     --no-cache                don't cache assembled programs
+ *     -n, --max-instructions N  stop after running N instructions
+ *     -m, --mode MODE           basic, twoints or array
+ *     --full-memory             back the whole 4 GB address space
+ *     --profile PREFIX          write PREFIX.flat and PREFIX.folded
+ *     --trace FILE              record every instruction run in FILE
+ *                               (not with --profile)
+ *     --save-image FILE         save the machine to FILE when it stops
+ *     --stats[=json]            print how much ran, and how fast
+ *
+ * Assembled programs are cached in the directory asm_cache_dir picks, so
+ * running the same file again skips the assembler.
+ *
+ * With no file, or -, machine code is read from standard input. Like the
+ * Racket frontends, $30 starts past the program and at least at
+ * 0x01000000, and $31 at the return address.
+ *
+ * twoints asks for $1 and $2 before running. array asks for a length and
+ * that many words, which go just past the program, with their address in
+ * $1 and the length in $2. Both read standard input a line at a time,
+ * leaving the rest of it for the program. The mode defaults to the end of
+ * the name this was run by, so it can be linked to as mips.twoints.
+ *
+ * A machine image (see machine/image.h) carries on from where it was
+ * saved, so -l, -m and --full-memory don't apply to it. Saving with -n
+ * checkpoints a long run to carry on with later.
+ *
+ * --stats prints the machine's counters (see MachineStats) to standard
+ * error after the registers, as text or as one line of JSON.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "machine/machine.h"
+#include "machine/impl.h"
+#include "machine/image.h"
+#include "machine/io.h"
+#include "machine/profile.h"
+#include "machine/trace.h"
 #include "emulator/emulator.h"
+#include "assembler/assembler.h"
+#include "assembler/cache.h"
 #include "common/defs.h"
+#include "util/util.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#include <unistd.h>
+#define MIPS241_POSIX
+#endif
+
+#define VERSION "0.1"
+#define STACK_ADDRESS 0x01000000 // $30 starts here, like the frontends
+#define GUESS_BYTES 32          // sampled to guess a file's type
+#define MAX_ARGS 64             // in the assembler command
+#define ERROR_BYTES 256         // for messages from the assembler
+
+enum mode { MODE_BASIC, MODE_TWOINTS, MODE_ARRAY };
+enum file_type { FILE_GUESS, FILE_BINARY, FILE_ASCII, FILE_IMAGE };
+enum stats { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+typedef struct Options {
+    enum mode mode;
+    enum file_type type;
+    uint32_t load_at;
+    const char *assembler;      // NULL for the builtin one
+    bool use_cache;
+    uint64_t max_instructions;  // UINT64_MAX for no limit
+    bool full_memory;
+    const char *profile_prefix;
+    const char *trace_path;
+    const char *image_path;     // to save the machine to
+    enum stats stats;
+    const char *filename;       // NULL for standard input
+} Options;
+
+
+static void fail(const char *format, const char *detail) {
+    fprintf(stderr, "cmips241: ");
+    fprintf(stderr, format, detail);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static void usage(FILE *out) {
+    fprintf(out,
+            "Usage: cmips241 [options] [file]\n"
+            "    --version                 print the version number\n"
+            "    -l, --load-at ADDRESS     load the program at ADDRESS\n"
+            "    -t, --type binary|ascii|image\n"
+            "                              what the file holds, instead of guessing\n"
+            "    -a, --assembler COMMAND   assembles ascii files from standard input\n"
+            "    --no-cache                don't cache assembled programs\n"
+            "    -n, --max-instructions N  stop after running N instructions\n"
+            "    -m, --mode MODE           basic, twoints or array\n"
+            "    --full-memory             back the whole 4 GB address space\n"
+            "    --profile PREFIX          write PREFIX.flat and PREFIX.folded\n"
+            "    --trace FILE              record every instruction run in FILE\n"
+            "                              (not with --profile)\n"
+            "    --save-image FILE         save the machine to FILE when it stops\n"
+            "    --stats[=json]            print how much ran, and how fast\n"
+            "For input from standard input, give - as the file or none at all.\n");
+}
+
+static uint64_t parse_number(const char *text, uint64_t max, const char *what) {
+    char *end;
+    errno = 0;
+    const unsigned long long value = strtoull(text, &end, 0);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-' || value > max)
+        fail(what, text);
+    return value;
+}
 
-static void print_status(FILE *out, const EmulatorStatus * const status) {
-    // TODO
-    static const char * status_strings[] = {
-        [IR_DONE] = "Program completed successfully.",
-        [IR_SUCCESS] = "Program execution paused.",
-        [IR_UNALIGNED_MEMORY_ACCESS] = "Program attempted to read/write an unaligned address.",
-        [IR_UNALIGNED_INSTRUCTION_FETCH] = "Program counter contains an unaligned address.",
-        [IR_OUT_OF_RANGE_MEMORY_ACCESS] = "Program attempted to read/write memory that was out of bounds.",
-        [IR_OUT_OF_RANGE_INSTRUCTION_FETCH] = "Program counter contains an  out-of-bounds address.",
-        [IR_INVALID_INSTRUCTION] = "An invalid instruction was encountered."
+static enum mode parse_mode(const char *name) {
+    if (strcmp(name, "basic") == 0)
+        return MODE_BASIC;
+    if (strcmp(name, "twoints") == 0)
+        return MODE_TWOINTS;
+    if (strcmp(name, "array") == 0)
+        return MODE_ARRAY;
+    fail("Unknown mode %s", name);
+    return MODE_BASIC;
+}
+
+// The mode a name like mips.twoints or /bin/cmips241-array asks for
+static enum mode mode_from_name(const char *argv0) {
+    const size_t len = strlen(argv0);
+    if (len >= 7 && strcmp(argv0 + len - 7, "twoints") == 0)
+        return MODE_TWOINTS;
+    if (len >= 5 && strcmp(argv0 + len - 5, "array") == 0)
+        return MODE_ARRAY;
+    return MODE_BASIC;
+}
+
+// Matches argv[*i] against a flag, taking its value from the next
+//   argument or after an = for long flags
+static bool flag(int argc, char **argv, int *i, const char *short_name,
+                 const char *long_name, const char **value) {
+    const char *arg = argv[*i];
+    const size_t long_len = strlen(long_name);
+    if (strncmp(arg, long_name, long_len) == 0 && arg[long_len] == '=') {
+        *value = arg + long_len + 1;
+        return true;
+    }
+    if (strcmp(arg, long_name) != 0 && (short_name == NULL || strcmp(arg, short_name) != 0))
+        return false;
+    if (*i + 1 == argc)
+        fail("%s needs a value", arg);
+    *value = argv[++*i];
+    return true;
+}
+
+static Options parse_options(int argc, char **argv) {
+    Options options = {
+        mode_from_name(argv[0]), FILE_GUESS, 0, NULL, true,
+        UINT64_MAX, false, NULL, NULL, NULL, STATS_OFF, NULL
     };
 
-    fprintf(out, "%s\n", status_strings[status->retcode]);
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i], *value;
+        if (strcmp(arg, "--version") == 0) {
+            printf("%s\n", VERSION);
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage(stdout);
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(arg, "--full-memory") == 0) {
+            options.full_memory = true;
+        } else if (strcmp(arg, "--no-cache") == 0) {
+            options.use_cache = false;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options.stats = STATS_TEXT;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            options.stats = STATS_JSON;
+        } else if (flag(argc, argv, &i, "-l", "--load-at", &value)) {
+            options.load_at = (uint32_t)parse_number(value, UINT32_MAX, "Invalid load address %s");
+            if (options.load_at % 4 != 0)
+                fail("Invalid load address %s", value);
+        } else if (flag(argc, argv, &i, "-t", "--type", &value)) {
+            if (strcmp(value, "binary") == 0)
+                options.type = FILE_BINARY;
+            else if (strcmp(value, "ascii") == 0)
+                options.type = FILE_ASCII;
+            else if (strcmp(value, "image") == 0)
+                options.type = FILE_IMAGE;
+            else
+                fail("Unknown file type %s", value);
+        } else if (flag(argc, argv, &i, "-a", "--assembler", &value)) {
+            options.assembler = value;
+        } else if (flag(argc, argv, &i, "-n", "--max-instructions", &value)) {
+            options.max_instructions = parse_number(value, UINT64_MAX, "Invalid instruction limit %s");
+        } else if (flag(argc, argv, &i, "-m", "--mode", &value)) {
+            options.mode = parse_mode(value);
+        } else if (flag(argc, argv, &i, NULL, "--profile", &value)) {
+            options.profile_prefix = value;
+        } else if (flag(argc, argv, &i, NULL, "--trace", &value)) {
+            options.trace_path = value;
+        } else if (flag(argc, argv, &i, NULL, "--save-image", &value)) {
+            options.image_path = value;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            usage(stderr);
+            fail("Unknown option %s", arg);
+        } else if (options.filename == NULL && i == argc - 1) {
+            options.filename = strcmp(arg, "-") == 0 ? NULL : arg;
+        } else {
+            usage(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // a run is either profiled or traced, not both
+    if (options.profile_prefix != NULL && options.trace_path != NULL) {
+        usage(stderr);
+        fail("%s", "--profile and --trace can't be used together");
+    }
+    return options;
 }
 
 
-int main(void) {
-    init_emulator();
-    Machine *m = init_machine(0);
+// Guesses whether a file is assembly, like guess-file-type.rkt: it's
+//   ascii if nearly all of its first few bytes are printable
+static enum file_type guess_file_type(FILE *file) {
+    uint8_t bytes[GUESS_BYTES];
+    const size_t len = fread(bytes, 1, sizeof(bytes), file);
+    rewind(file);
+    if (m_is_image(bytes, len))
+        return FILE_IMAGE;
+
+    size_t printable = 0;
+    for (size_t i = 0; i < len; ++i)
+        printable += (bytes[i] >= 32 && bytes[i] <= 127) || bytes[i] == '\n';
+    return printable != 0 && printable >= 0.95 * len ? FILE_ASCII : FILE_BINARY;
+}
+
+// Reads the rest of a file into memory, setting *len to its length
+static uint8_t *read_all(FILE *file, size_t *len) {
+    size_t cap = 4096;
+    uint8_t *bytes = malloc(cap);
+    *len = 0;
+    for (size_t got = 1; bytes != NULL && got != 0; ) {
+        if (*len == cap) {
+            uint8_t *grown = realloc(bytes, cap *= 2);
+            if (grown == NULL)
+                free(bytes);
+            bytes = grown;
+            if (bytes == NULL)
+                break;
+        }
+        got = fread(bytes + *len, 1, cap - *len, file);
+        *len += got;
+    }
+    if (bytes == NULL || ferror(file))
+        fail("Can't read %s", "the program");
+    return bytes;
+}
+
+#ifdef MIPS241_POSIX
+// Starts the assembler reading source, returning what it writes
+static FILE *start_assembler(const char *command, FILE *source, pid_t *pid) {
+    char *const words = strdup(command);
+    char *argv[MAX_ARGS + 1];
+    int argc = 0;
+    for (char *word = strtok(words, " \t"); word != NULL && argc < MAX_ARGS;
+         word = strtok(NULL, " \t"))
+        argv[argc++] = word;
+    argv[argc] = NULL;
+    if (argc == 0)
+        fail("Invalid path to assembler \"%s\"", command);
+
+    int fds[2];
+    if (pipe(fds) != 0)
+        fail("Can't start the assembler %s", argv[0]);
+    *pid = fork();
+    if (*pid < 0)
+        fail("Can't start the assembler %s", argv[0]);
+    if (*pid == 0) {
+        dup2(fileno(source), STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        fprintf(stderr, "cmips241: Assembler \"%s\" not found in PATH\n", argv[0]);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    free(words);
+    return fdopen(fds[0], "rb");
+}
+#endif
+
+// Assembles the source in file, which is still open at its start, or
+//   takes what it gave last time from the cache
+static uint8_t *assemble(const Options *options, FILE *file, const uint8_t *source,
+                         size_t len, size_t *code_len) {
+    const char *dir = options->use_cache ? asm_cache_dir() : NULL;
+    const char *tool = options->assembler != NULL ? options->assembler : ASM_TOOL;
+    uint8_t *code = asm_cache_get(dir, tool, (const char *)source, len, code_len);
+    if (code != NULL)
+        return code;
+
+    if (options->assembler == NULL) {
+        char error[ERROR_BYTES];
+        code = asm_assemble((const char *)source, len, code_len, error, sizeof(error));
+        if (code == NULL)
+            fail("Can't assemble the program: %s", error);
+    } else {
+#ifdef MIPS241_POSIX
+        pid_t pid;
+        FILE *assembled = start_assembler(options->assembler, file, &pid);
+        code = read_all(assembled, code_len);
+        fclose(assembled);
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fail("Assembler \"%s\" failed", options->assembler);
+#else
+        (void)file;
+        fail("Can't run an assembler here; assemble %s first", options->filename);
+#endif
+    }
+    // a cache we can't write to only costs the next run time
+    asm_cache_put(dir, tool, (const char *)source, len, code, *code_len);
+    return code;
+}
+
+// Returns the machine in the image options asks for, or NULL if the file
+//   isn't one
+static Machine *load_image(const Options *options, ImageInfo *info) {
+    if (options->filename == NULL && options->type == FILE_IMAGE)
+        fail("Can't load an image from %s", "standard input");
+    if (options->filename == NULL || options->type == FILE_BINARY
+        || options->type == FILE_ASCII)
+        return NULL;
+    if (options->type == FILE_GUESS) {
+        FILE *file = fopen(options->filename, "rb");
+        if (file == NULL)
+            fail("Can't open %s", options->filename);
+        const enum file_type type = guess_file_type(file);
+        fclose(file);
+        if (type != FILE_IMAGE)
+            return NULL;
+    }
+
+    enum image_error error;
+    Machine *m = m_load_image(options->filename, info, &error);
+    if (m == NULL)
+        fail("Can't load the image: %s", image_error_string(error));
+    return m;
+}
+
+// Loads the program options asks for, assembling it first if need be.
+//   Returns the byte address just past it.
+static uint32_t load(const Options *options, Machine *m) {
+    if (options->filename == NULL)
+        return load_program(stdin, m, options->load_at);
+
+    FILE *file = fopen(options->filename, "rb");
+    if (file == NULL)
+        fail("Can't open %s", options->filename);
+    const enum file_type type =
+        options->type == FILE_GUESS ? guess_file_type(file) : options->type;
+    if (type == FILE_BINARY)
+        return load_program(file, m, options->load_at);
+
+    size_t len, code_len;
+    uint8_t *source = read_all(file, &len);
+    rewind(file);
+    uint8_t *code = assemble(options, file, source, len, &code_len);
+    fclose(file);
+    free(source);
+
+    const uint32_t end = load_program_bytes(code, code_len, m, options->load_at);
+    asm_free(code);
+    return end;
+}
 
-    load_program(stdin, m, 0);
 
+// Reads a line of standard input without reading ahead of it, since the
+//   machine reads the rest straight from the file descriptor
+static bool read_line(char *buf, size_t cap) {
+    size_t len = 0;
+    for (;;) {
+        uint8_t c;
+#ifdef MIPS241_POSIX
+        const long n = (long)read(STDIN_FILENO, &c, 1);
+#else
+        const long n = (long)fread(&c, 1, 1, stdin);
+#endif
+        if (n <= 0 || c == '\n')
+            break;
+        if (len + 1 < cap)
+            buf[len++] = (char)c;
+    }
+    buf[len] = '\0';
+    return len != 0;
+}
+
+// Asks for an integer, taken as a word whether it's signed or not
+static uint32_t ask_word(const char *prompt, int index, Machine *m) {
+    char line[64];
+    fprintf(stderr, prompt, index);
+    if (!read_line(line, sizeof(line)))
+        give_up("Expected an integer", EXIT_FAILURE, m);
+
+    char *end;
+    errno = 0;
+    const long long value = strtoll(line, &end, 10);
+    give_up_unless(errno == 0 && end != line && *end == '\0'
+                   && value >= INT32_MIN && value <= (long long)UINT32_MAX,
+                   "Invalid integer", EXIT_FAILURE, m);
+    return (uint32_t)value;
+}
+
+// Sets up $1 and $2 as the mode asks. Returns the byte address just past
+//   anything it put in memory.
+static uint32_t init_mode(enum mode mode, Machine *m, uint32_t end) {
+    if (mode == MODE_TWOINTS) {
+        m->registers[1] = ask_word("Enter value for register %d: ", 1, m);
+        m->registers[2] = ask_word("Enter value for register %d: ", 2, m);
+    } else if (mode == MODE_ARRAY) {
+        const uint32_t length = ask_word("Enter length of array: ", 0, m);
+        give_up_unless(length <= m->mem_size && end / 4 <= m->mem_size - length,
+                       "The array doesn't fit in memory", EXIT_FAILURE, m);
+        for (uint32_t i = 0; i < length; ++i)
+            m_write_word(m, end / 4 + i, ask_word("Enter array element %d: ", (int)i, m));
+        m->registers[1] = end;
+        m->registers[2] = length;
+        end += length * 4;
+    }
+    return end;
+}
+
+
+static EmulatorStatus run(const Options *options, Machine *m) {
     EmulatorStatus status;
-    do status = step_machine(m);
-    while (status.retcode == IR_SUCCESS);
+    uint64_t retired;
+    if (options->profile_prefix != NULL) {
+        Profile *profile = profile_create(m);
+        give_up_unless(profile != NULL, "Can't allocate a profile", EXIT_FAILURE, m);
+        status = step_machine_profiled(m, profile, options->max_instructions, &retired);
+
+        const size_t len = strlen(options->profile_prefix);
+        char *path = malloc(len + sizeof(".folded"));
+        give_up_unless(path != NULL, "Bye bye memory", EXIT_FAILURE, m);
+        sprintf(path, "%s.flat", options->profile_prefix);
+        bool written = profile_write_flat(profile, path, 0);
+        sprintf(path, "%s.folded", options->profile_prefix);
+        written = profile_write_collapsed(profile, path) && written;
+        if (!written)
+            fprintf(stderr, "cmips241: Can't write the profile\n");
+        free(path);
+        profile_destroy(profile);
+    } else if (options->trace_path != NULL) {
+        Trace *trace = trace_open(m, options->trace_path);
+        give_up_unless(trace != NULL, "Can't open the trace file", EXIT_FAILURE, m);
+        status = step_machine_traced(m, trace, options->max_instructions, &retired);
+        if (!trace_close(trace))
+            fprintf(stderr, "cmips241: Can't write the trace\n");
+    } else if (options->max_instructions != UINT64_MAX) {
+        status = step_machine_n(m, options->max_instructions, &retired);
+    } else {
+        status = step_machine_loop(m);
+    }
+    m_flush_output(m);
+    return status;
+}
 
+int main(int argc, char **argv) {
+    const Options options = parse_options(argc, argv);
+    init_emulator();
+    ImageInfo info;
+    Machine *m = load_image(&options, &info);
+    if (m == NULL) {
+        m = options.full_memory ? init_machine_full() : init_machine(0);
+        uint32_t end = load(&options, m);
+        end = init_mode(options.mode, m, end);
+        m->registers[30] = end > STACK_ADDRESS ? end : STACK_ADDRESS;
+        info = (ImageInfo) { options.load_at, options.load_at };
+    }
+
+    const EmulatorStatus status = run(&options, m);
     m_print_registers(m);
-    print_status(stderr, &status);
+    fprintf(stderr, "%s\n", status_string(status.retcode));
+    if (options.stats != STATS_OFF)
+        m_write_stats(m, stderr, options.stats == STATS_JSON);
+
+    int exit_code = 0;
+    if (options.image_path != NULL) {
+        const enum image_error error = m_save_image(m, options.image_path, &info);
+        if (error != IMAGE_OK) {
+            fprintf(stderr, "cmips241: Can't save the image: %s\n", image_error_string(error));
+            exit_code = EXIT_FAILURE;
+        }
+    }
 
     destroy_machine(m);
+    return exit_code;
 }
@@ -0,0 +1,618 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/defs.h"
+#include "machine/block.h"
+#include "machine/debug.h"
+#include "machine/decode.h"
+#include "machine/engine.h"
+#include "machine/impl.h"
+#include "machine/machine.h"
+#include "machine/verify.h"
+#include "util/util.h"
+
+#define make_signed(X) \
+       (int32_t)( (X > INT32_MAX) ? X - UINT32_MAX - 1 : X )
+
+BlockCache *block_cache(Machine *machine) {
+    if (machine->blocks != NULL)
+        return machine->blocks;
+
+    BlockCache *cache = calloc(1, sizeof(BlockCache));
+    give_up_unless(cache != NULL, "Can't allocate the block cache. Bye.",
+                   EXIT_FAILURE, machine);
+    cache->num_words = machine->mem_size;
+    cache->map = m_alloc_pages((size_t)cache->num_words * sizeof(Block *));
+    cache->code = m_alloc_pages(cache->num_words / 8 + 1);
+    give_up_unless(cache->map != NULL && cache->code != NULL,
+                   "Can't allocate the block cache. Bye.",
+                   EXIT_FAILURE, machine);
+
+    cache->jit = jit_create();
+    cache->jit_threshold = JIT_HOT_THRESHOLD;
+
+    machine->blocks = cache;
+    return cache;
+}
+
+
+void block_cache_flush(BlockCache *cache) {
+    for (uint32_t i = 0; i < cache->num_blocks; ++i) {
+        Block *block = cache->all[i];
+        cache->map[block->start / 4] = NULL;
+        for (uint32_t w = block->start / 4; w < block->end / 4; ++w)
+            cache->code[w / 8] &= ~(1 << (w % 8));
+        free(block);
+    }
+    cache->num_blocks = 0;
+    if (cache->jit != NULL)
+        jit_reset(cache->jit);
+}
+
+
+void block_cache_destroy(BlockCache *cache) {
+    if (cache != NULL) {
+        block_cache_flush(cache);
+        jit_destroy(cache->jit);
+        free(cache->all);
+        m_free_pages(cache->code, cache->num_words / 8 + 1);
+        m_free_pages(cache->map, (size_t)cache->num_words * sizeof(Block *));
+        free(cache);
+    }
+}
+
+
+bool block_cache_covers_range(const BlockCache *cache, uint32_t idx, uint32_t count) {
+    const uint32_t end = idx + count;
+    uint32_t i = idx;
+    for (; i < end && i % 8 != 0; ++i)
+        if (block_cache_covers(cache, i))
+            return true;
+    // a byte of the bitmap at a time in between
+    for (; i + 8 <= end; i += 8)
+        if (cache->code[i / 8] != 0)
+            return true;
+    for (; i < end; ++i)
+        if (block_cache_covers(cache, i))
+            return true;
+    return false;
+}
+
+
+void m_invalidate_code(Machine *machine, uint32_t idx) {
+    if (block_cache_covers(machine->blocks, idx))
+        block_cache_flush(machine->blocks);
+}
+
+
+// Maps an instruction that can be an op by itself to its kind.
+//   Returns false for terminators and anything we don't translate.
+static bool simple_kind(const Instruction ins, OpKind *kind) {
+    if (ins.type == TYPE_R) {
+        switch (ins.code) {
+            case FUNC_ADD: *kind = OPK_ADD; return true;
+            case FUNC_SUB: *kind = OPK_SUB; return true;
+            case FUNC_MULT: *kind = OPK_MULT; return true;
+            case FUNC_MULTU: *kind = OPK_MULTU; return true;
+            case FUNC_DIV: *kind = OPK_DIV; return true;
+            case FUNC_DIVU: *kind = OPK_DIVU; return true;
+            case FUNC_MFHI: *kind = OPK_MFHI; return true;
+            case FUNC_MFLO: *kind = OPK_MFLO; return true;
+            case FUNC_SLT: *kind = OPK_SLT; return true;
+            case FUNC_SLTU: *kind = OPK_SLTU; return true;
+        }
+    } else {
+        switch (ins.code) {
+            case OP_LW: *kind = OPK_LW; return true;
+            case OP_SW: *kind = OPK_SW; return true;
+        }
+    }
+    return false;
+}
+
+static bool is_rtype(const Instruction ins, uint8_t func) {
+    return ins.type == TYPE_R && ins.code == func;
+}
+
+static bool is_itype(const Instruction ins, uint8_t opcode) {
+    return ins.type == TYPE_I && ins.code == opcode;
+}
+
+
+// Whether code at pc can be fetched without going through step_machine.
+//   The last word of the address space never is, so that a block, and
+//   the words translate looks ahead at, never wrap around to 0.
+static bool fetchable(const Machine *machine, uint32_t pc) {
+    return pc / 4 < machine->mem_size && pc < UINT32_MAX - 3 && pc != RETURN_ADDRESS;
+}
+
+// Whether the instruction at pc can go in a block. Blocks end before
+//   breakpoints, so that step_machine gets to stop there.
+static bool translatable(const Machine *machine, uint32_t pc) {
+    return fetchable(machine, pc) && !debug_breakpoint_at(machine->debug, pc / 4);
+}
+
+
+// Translates the block starting at pc. Returns NULL if not even the
+//   first instruction can be translated.
+static Block *translate(Machine *machine, uint32_t start) {
+    Op ops[MAX_BLOCK_OPS + 1];
+    uint32_t num_ops = 0;
+    uint32_t retired = 0, loads = 0, stores = 0;
+    uint32_t pc = start;
+    bool terminated = false;
+
+    while (!terminated && num_ops < MAX_BLOCK_OPS && translatable(machine, pc)) {
+        const Instruction ins = decode_instruction(machine->mem[pc / 4]);
+        Op op = { .pc = pc, .count = 1 };
+        uint32_t words = 1;
+
+        // the instruction after this one, if it's there
+        const bool has_next = fetchable(machine, pc + 4);
+        const bool next_fusable = translatable(machine, pc + 4);
+        const Instruction next = next_fusable
+            ? decode_instruction(machine->mem[pc / 4 + 1])
+            : (Instruction) { .type = TYPE_INVALID };
+
+        if (is_rtype(ins, FUNC_LIS)) {
+            const uint8_t x = ins.decoded.r.d;
+            if (!has_next)
+                break; // the constant isn't there, let step_machine fault
+            op.kind = OPK_LIS;
+            op.r[0] = x;
+            op.imm = machine->mem[pc / 4 + 1];
+            words = 2;
+
+            // try to fuse with the instruction after the constant
+            const bool has_after = translatable(machine, pc + 8);
+            const Instruction after = has_after
+                ? decode_instruction(machine->mem[pc / 4 + 2])
+                : (Instruction) { .type = TYPE_INVALID };
+            // writes to $0 have to be dropped in between, so never fuse them
+            if (x != 0 && (is_rtype(after, FUNC_ADD) || is_rtype(after, FUNC_SUB))) {
+                op.kind = after.code == FUNC_ADD ? OPK_LIS_ADD : OPK_LIS_SUB;
+                op.r[1] = after.decoded.r.d;
+                op.r[2] = after.decoded.r.s;
+                op.r[3] = after.decoded.r.t;
+                op.count = 2;
+                words = 3;
+            } else if (x != 0 && is_rtype(after, FUNC_JR) && after.decoded.r.s == x) {
+                op.kind = OPK_LIS_JR;
+                op.count = 2;
+                words = 3;
+                terminated = true;
+            } else if (x != 0 && is_rtype(after, FUNC_JALR) && after.decoded.r.s == x) {
+                op.kind = OPK_LIS_JALR;
+                op.count = 2;
+                words = 3;
+                terminated = true;
+            }
+        } else if (is_itype(ins, OP_SW) && ins.decoded.i.s == 30 && ins.decoded.i.imm == -4
+                   && is_rtype(next, FUNC_SUB) && next.decoded.r.d == 30
+                   && next.decoded.r.s == 30) {
+            op.kind = OPK_PUSH;
+            op.r[0] = ins.decoded.i.t;
+            op.r[1] = next.decoded.r.t;
+            op.count = 2;
+            words = 2;
+        } else if (is_rtype(ins, FUNC_ADD) && ins.decoded.r.d == 30 && ins.decoded.r.s == 30
+                   && is_itype(next, OP_LW) && next.decoded.i.s == 30
+                   && next.decoded.i.imm == -4) {
+            op.kind = OPK_POP;
+            op.r[0] = next.decoded.i.t;
+            op.r[1] = ins.decoded.r.t;
+            op.count = 2;
+            words = 2;
+        } else if (is_itype(ins, OP_BEQ) || is_itype(ins, OP_BNE)) {
+            op.kind = ins.code == OP_BEQ ? OPK_BEQ : OPK_BNE;
+            op.r[0] = ins.decoded.i.s;
+            op.r[1] = ins.decoded.i.t;
+            op.imm = pc + 4 + (uint32_t)ins.decoded.i.imm * 4;
+            terminated = true;
+        } else if (is_rtype(ins, FUNC_JR) || is_rtype(ins, FUNC_JALR)) {
+            op.kind = ins.code == FUNC_JR ? OPK_JR : OPK_JALR;
+            op.r[0] = ins.decoded.r.s;
+            terminated = true;
+        } else {
+            OpKind kind;
+            if (!simple_kind(ins, &kind))
+                break;
+            op.kind = kind;
+            if (ins.type == TYPE_R) {
+                op.r[0] = ins.decoded.r.d;
+                op.r[1] = ins.decoded.r.s;
+                op.r[2] = ins.decoded.r.t;
+            } else {
+                op.r[0] = ins.decoded.i.t;
+                op.r[1] = ins.decoded.i.s;
+                op.imm = (uint32_t)ins.decoded.i.imm;
+            }
+        }
+
+        ops[num_ops++] = op;
+        retired += op.count;
+        loads += op_loads(&op);
+        stores += op_stores(&op);
+        pc += words * 4;
+    }
+
+    if (num_ops == 0)
+        return NULL;
+    if (!terminated)
+        ops[num_ops++] = (Op) { .kind = OPK_FALL, .pc = pc };
+
+    Block *block = malloc(sizeof(Block) + num_ops * sizeof(Op));
+    give_up_unless(block != NULL, "Can't allocate a block. Bye.", EXIT_FAILURE, machine);
+    block->start = start;
+    block->end = pc;
+    block->retired = retired;
+    block->loads = loads;
+    block->stores = stores;
+    block->num_ops = num_ops;
+    block->heat = 0;
+    block->native = NULL;
+    memcpy(block->ops, ops, num_ops * sizeof(Op));
+    return block;
+}
+
+
+Block *block_lookup(Machine *machine, BlockCache *cache, uint32_t pc) {
+    Block *block = cache->map[pc / 4];
+    if (block != NULL)
+        return block;
+
+    block = translate(machine, pc);
+    if (block == NULL)
+        return NULL;
+    verify_block(machine, block);
+
+    if (cache->num_blocks == cache->max_blocks) {
+        const uint32_t max_blocks = cache->max_blocks ? cache->max_blocks * 2 : 256;
+        Block **all = realloc(cache->all, max_blocks * sizeof(Block *));
+        give_up_unless(all != NULL, "Can't grow the block cache. Bye.", EXIT_FAILURE, machine);
+        cache->all = all;
+        cache->max_blocks = max_blocks;
+    }
+    cache->all[cache->num_blocks++] = block;
+    cache->map[pc / 4] = block;
+    for (uint32_t w = block->start / 4; w < block->end / 4; ++w)
+        cache->code[w / 8] |= 1 << (w % 8);
+
+    return block;
+}
+
+
+// Register operands of the current op
+#define R0 regs[op->r[0]]
+#define R1 regs[op->r[1]]
+#define R2 regs[op->r[2]]
+#define R3 regs[op->r[3]]
+
+// Counts for the machine's stats, kept in locals while running blocks
+typedef struct Tally {
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t taken;
+    uint64_t not_taken;
+    uint64_t calls;
+    uint64_t stepped;   // instructions step_machine retired, and counted
+} Tally;
+
+// Whether a word address can be loaded from or stored to without help
+#define PLAIN_ACCESS(BYTE_ADDR) \
+    ((BYTE_ADDR) / 4 < mem_size && (BYTE_ADDR) % 4 == 0)
+
+// Instructions retired by the ops of a block before op, adding the
+//   loads and stores among them to tally
+static uint32_t retired_before(const Block *block, const Op *op, Tally *tally) {
+    uint32_t retired = 0;
+    for (const Op *prev = block->ops; prev != op; ++prev) {
+        retired += prev->count;
+        tally->loads += op_loads(prev);
+        tally->stores += op_stores(prev);
+    }
+    return retired;
+}
+
+// Runs one instruction at a time, for when every lw and sw has to be
+//   checked against watchpoints
+static EmulatorStatus run_stepping(Machine *const machine, uint64_t budget,
+                                   uint64_t *retired_out) {
+    EmulatorStatus status = { IR_BUDGET_EXHAUSTED, machine->pc };
+    uint64_t retired = 0;
+    for (; retired < budget; ++retired) {
+        status = step_machine(machine);
+        if (status.retcode != IR_SUCCESS)
+            break;
+        status = (EmulatorStatus) { IR_BUDGET_EXHAUSTED, machine->pc };
+    }
+    *retired_out = retired;
+    return status;
+}
+
+EmulatorStatus run_blocks(Machine *const machine, uint64_t budget,
+                          uint64_t *retired_out) {
+    if (machine->debug != NULL && machine->debug->num_watchpoints != 0)
+        return run_stepping(machine, budget, retired_out);
+
+    BlockCache *const cache = block_cache(machine);
+    uint32_t *const regs = machine->registers;
+    uint32_t *const mem = machine->mem;
+    const uint32_t mem_size = machine->mem_size;
+    EmulatorStatus status;
+    uint64_t retired = 0;
+    Tally tally = { 0 };
+
+    for (;;) {
+        uint32_t pc = machine->pc;
+        uint32_t bail_pc;
+        Block *block = NULL;
+
+        // the budget is only checked once per block
+        const uint64_t remaining = budget - retired;
+        if (remaining == 0) {
+            status = (EmulatorStatus) {IR_BUDGET_EXHAUSTED, pc};
+            goto RETURN;
+        }
+
+        if (pc % 4 == 0 && fetchable(machine, pc))
+            block = block_lookup(machine, cache, pc);
+        // near the end of the budget, finish up one at a time
+        if (block == NULL || block->retired > remaining) {
+            bail_pc = pc;
+            goto BAIL;
+        }
+
+        // the safe ops are only safe while the guard holds
+        if (block->guard.on && !guard_holds(&block->guard, machine)) {
+            if (++block->guard.failures == GUARD_FAILURE_LIMIT) {
+                unverify_block(block);
+            } else {
+                bail_pc = pc;
+                goto BAIL;
+            }
+        }
+
+        if (block->native == NULL && cache->jit != NULL
+            && ++block->heat == cache->jit_threshold)
+            jit_compile(cache->jit, machine, cache, block);
+
+        if (block->native != NULL) {
+            const uint64_t limit = budget - block->retired;
+            switch ((enum jit_exit)block->native(machine, &retired, limit)) {
+                case JIT_NEXT:
+                    continue;
+                case JIT_BAIL:
+                    bail_pc = machine->pc;
+                    goto BAIL;
+                case JIT_FLUSH:
+                    block_cache_flush(cache);
+                    continue;
+            }
+        }
+
+        for (const Op *op = block->ops; ; ++op) {
+            switch ((OpKind)op->kind) {
+                case OPK_ADD:
+                    R0 = R1 + R2;
+                    break;
+                case OPK_SUB:
+                    R0 = R1 - R2;
+                    break;
+                case OPK_MULT:
+                {
+                    const uint64_t result = (int64_t)make_signed(R1) * make_signed(R2);
+                    machine->hi = result >> 32;
+                    machine->lo = result & 0xFFFFFFFF;
+                    break;
+                }
+                case OPK_MULTU:
+                {
+                    const uint64_t result = (uint64_t)R1 * R2;
+                    machine->hi = result >> 32;
+                    machine->lo = result & 0xFFFFFFFF;
+                    break;
+                }
+                case OPK_DIV:
+                    m_div(R1, R2, &machine->hi, &machine->lo);
+                    break;
+                case OPK_DIVU:
+                    m_divu(R1, R2, &machine->hi, &machine->lo);
+                    break;
+                case OPK_MFHI:
+                    R0 = machine->hi;
+                    break;
+                case OPK_MFLO:
+                    R0 = machine->lo;
+                    break;
+                case OPK_LIS:
+                    R0 = op->imm;
+                    break;
+                case OPK_SLT:
+                    R0 = make_signed(R1) < make_signed(R2);
+                    break;
+                case OPK_SLTU:
+                    R0 = R1 < R2;
+                    break;
+                case OPK_LW:
+                {
+                    const uint32_t byte_addr = R1 + op->imm;
+                    if (!PLAIN_ACCESS(byte_addr) || byte_addr == MAPPED_INPUT_ADDR) {
+                        retired += retired_before(block, op, &tally);
+                        bail_pc = op->pc;
+                        goto BAIL;
+                    }
+                    R0 = mem[byte_addr / 4];
+                    break;
+                }
+                case OPK_SW:
+                {
+                    const uint32_t byte_addr = R1 + op->imm;
+                    if (!PLAIN_ACCESS(byte_addr) || byte_addr == MAPPED_OUTPUT_ADDR) {
+                        retired += retired_before(block, op, &tally);
+                        bail_pc = op->pc;
+                        goto BAIL;
+                    }
+                    mem[byte_addr / 4] = R0;
+                    m_mark_dirty(machine, byte_addr / 4);
+                    if (machine->decoded != NULL)
+                        machine->decoded[byte_addr / 4].type = TYPE_INVALID;
+                    if (block_cache_covers(cache, byte_addr / 4)) {
+                        // this block may be gone now
+                        retired += retired_before(block, op, &tally) + 1;
+                        tally.stores++;
+                        block_cache_flush(cache);
+                        pc = op->pc + 4;
+                        goto NEXT_PC;
+                    }
+                    break;
+                }
+                case OPK_LW_SAFE:
+                    R0 = mem[(R1 + op->imm) / 4];
+                    break;
+                case OPK_SW_SAFE:
+                {
+                    const uint32_t byte_addr = R1 + op->imm;
+                    mem[byte_addr / 4] = R0;
+                    m_mark_dirty(machine, byte_addr / 4);
+                    if (machine->decoded != NULL)
+                        machine->decoded[byte_addr / 4].type = TYPE_INVALID;
+                    if (block_cache_covers(cache, byte_addr / 4)) {
+                        retired += retired_before(block, op, &tally) + 1;
+                        tally.stores++;
+                        block_cache_flush(cache);
+                        pc = op->pc + 4;
+                        goto NEXT_PC;
+                    }
+                    break;
+                }
+                case OPK_LIS_ADD:
+                    regs[op->r[0]] = op->imm;
+                    R1 = R2 + R3;
+                    break;
+                case OPK_LIS_SUB:
+                    regs[op->r[0]] = op->imm;
+                    R1 = R2 - R3;
+                    break;
+                case OPK_PUSH:
+                {
+                    const uint32_t byte_addr = regs[30] - 4;
+                    if (!PLAIN_ACCESS(byte_addr) || byte_addr == MAPPED_OUTPUT_ADDR) {
+                        retired += retired_before(block, op, &tally);
+                        bail_pc = op->pc;
+                        goto BAIL;
+                    }
+                    mem[byte_addr / 4] = R0;
+                    m_mark_dirty(machine, byte_addr / 4);
+                    if (machine->decoded != NULL)
+                        machine->decoded[byte_addr / 4].type = TYPE_INVALID;
+                    if (block_cache_covers(cache, byte_addr / 4)) {
+                        // the store may have replaced the sub
+                        retired += retired_before(block, op, &tally) + 1;
+                        tally.stores++;
+                        block_cache_flush(cache);
+                        pc = op->pc + 4;
+                        goto NEXT_PC;
+                    }
+                    regs[30] -= R1;
+                    break;
+                }
+                case OPK_POP:
+                {
+                    regs[30] += R1;
+                    regs[0] = 0;
+                    const uint32_t byte_addr = regs[30] - 4;
+                    if (!PLAIN_ACCESS(byte_addr) || byte_addr == MAPPED_INPUT_ADDR) {
+                        // the add has retired, the load goes the slow way
+                        retired += retired_before(block, op, &tally) + 1;
+                        bail_pc = op->pc + 4;
+                        goto BAIL;
+                    }
+                    R0 = mem[byte_addr / 4];
+                    break;
+                }
+                case OPK_PUSH_SAFE:
+                {
+                    const uint32_t word_addr = (regs[30] - 4) / 4;
+                    mem[word_addr] = R0;
+                    m_mark_dirty(machine, word_addr);
+                    if (machine->decoded != NULL)
+                        machine->decoded[word_addr].type = TYPE_INVALID;
+                    if (block_cache_covers(cache, word_addr)) {
+                        retired += retired_before(block, op, &tally) + 1;
+                        tally.stores++;
+                        block_cache_flush(cache);
+                        pc = op->pc + 4;
+                        goto NEXT_PC;
+                    }
+                    regs[30] -= R1;
+                    break;
+                }
+                case OPK_POP_SAFE:
+                    regs[30] += R1;
+                    regs[0] = 0;
+                    R0 = mem[(regs[30] - 4) / 4];
+                    break;
+                case OPK_BEQ:
+                case OPK_BNE:
+                {
+                    const bool taken = (R0 == R1) == (op->kind == OPK_BEQ);
+                    pc = taken ? op->imm : block->end;
+                    tally.taken += taken;
+                    tally.not_taken += !taken;
+                    goto NEXT_BLOCK;
+                }
+                case OPK_JR:
+                    pc = R0;
+                    goto NEXT_BLOCK;
+                case OPK_JALR:
+                    pc = R0;
+                    regs[31] = block->end;
+                    tally.calls++;
+                    goto NEXT_BLOCK;
+                case OPK_LIS_JR:
+                    pc = R0 = op->imm;
+                    goto NEXT_BLOCK;
+                case OPK_LIS_JALR:
+                    R0 = op->imm;
+                    pc = op->imm;
+                    regs[31] = block->end;
+                    tally.calls++;
+                    goto NEXT_BLOCK;
+                case OPK_FALL:
+                    pc = block->end;
+                    goto NEXT_BLOCK;
+            }
+            regs[0] = 0;
+        }
+
+NEXT_BLOCK:
+        retired += block->retired;
+        tally.loads += block->loads;
+        tally.stores += block->stores;
+NEXT_PC:
+        regs[0] = 0;
+        machine->pc = pc;
+        continue;
+
+BAIL:
+        machine->pc = bail_pc;
+        status = step_machine(machine);
+        if (status.retcode != IR_SUCCESS)
+            goto RETURN;
+        ++retired;
+        ++tally.stepped;
+    }
+
+RETURN:
+    // compiled code adds its own, and step_machine counted what it ran
+    machine->stats.retired += retired - tally.stepped;
+    machine->stats.loads += tally.loads;
+    machine->stats.stores += tally.stores;
+    machine->stats.branches_taken += tally.taken;
+    machine->stats.branches_not_taken += tally.not_taken;
+    machine->stats.calls += tally.calls;
+    *retired_out = retired;
+    return status;
+}
@@ -0,0 +1,120 @@
+/**
+ * Basic-block translation of loaded code. Blocks are runs of
+ * instructions ending at beq/bne/jr/jalr, translated into ops where
+ * common CS 241 idioms are fused into single superinstructions.
+ */
+#ifndef BLOCK_H__
+#define BLOCK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+#include "machine/jit.h"
+
+// the longest block we'll translate, in ops
+#define MAX_BLOCK_OPS 64
+// the most registers a block's guard can assume the values of
+#define MAX_GUARD_ASSUMED 4
+
+typedef enum OpKind {
+    // one instruction each
+    OPK_ADD, OPK_SUB, OPK_MULT, OPK_MULTU, OPK_DIV, OPK_DIVU,
+    OPK_MFHI, OPK_MFLO, OPK_LIS, OPK_SLT, OPK_SLTU, OPK_LW, OPK_SW,
+    // superinstructions
+    OPK_LIS_ADD,    // lis $x; .word N; add $d, $s, $t
+    OPK_LIS_SUB,    // lis $x; .word N; sub $d, $s, $t
+    OPK_PUSH,       // sw $t, -4($30); sub $30, $30, $k
+    OPK_POP,        // add $30, $30, $k; lw $t, -4($30)
+    // lw, sw, push and pop that verify_block proved can't fault
+    OPK_LW_SAFE, OPK_SW_SAFE, OPK_PUSH_SAFE, OPK_POP_SAFE,
+    // block terminators
+    OPK_BEQ, OPK_BNE, OPK_JR, OPK_JALR,
+    OPK_LIS_JR,     // lis $x; .word N; jr $x
+    OPK_LIS_JALR,   // lis $x; .word N; jalr $x
+    OPK_FALL        // continue at the end of the block
+} OpKind;
+
+typedef struct Op {
+    uint8_t kind;    // an OpKind
+    uint8_t count;   // instructions retired by this op
+    uint8_t r[4];    // register operands, meaning depends on kind
+    uint32_t imm;    // immediate, lis constant or branch target
+    uint32_t pc;     // address of the first instruction of the op
+} Op;
+
+// Loads and stores an op makes, for the machine's stats
+static inline uint32_t op_loads(const Op *op) {
+    return op->kind == OPK_LW || op->kind == OPK_LW_SAFE
+           || op->kind == OPK_POP || op->kind == OPK_POP_SAFE;
+}
+
+static inline uint32_t op_stores(const Op *op) {
+    return op->kind == OPK_SW || op->kind == OPK_SW_SAFE
+           || op->kind == OPK_PUSH || op->kind == OPK_PUSH_SAFE;
+}
+
+// What has to hold when a block starts for its safe ops not to fault:
+//   $30 is aligned, the words from $30 + lo to $30 + hi are below limit,
+//   and the assumed registers have the values they had when it was
+//   translated.
+typedef struct BlockGuard {
+    bool on;
+    uint8_t num_assumed;
+    uint8_t assumed_regs[MAX_GUARD_ASSUMED];
+    uint32_t assumed_values[MAX_GUARD_ASSUMED];
+    int32_t lo;
+    int32_t hi;
+    uint64_t limit;     // memory, or the mapped I/O addresses if lower
+    uint32_t failures;  // times it didn't hold
+} BlockGuard;
+
+typedef struct Block {
+    uint32_t start;    // pc of the first instruction
+    uint32_t end;      // pc just past the last word
+    uint32_t retired;  // instructions retired by running the whole block
+    uint32_t loads;    // and the loads and stores among them
+    uint32_t stores;
+    uint32_t num_ops;
+    uint32_t heat;     // times run, until it is compiled
+    JitCode native;    // compiled code, or NULL
+    BlockGuard guard;  // checked before running, if on
+    Op ops[];
+} Block;
+
+typedef struct BlockCache {
+    Block **map;            // block starting at each word, or NULL
+    uint8_t *code;          // bitmap of words covered by some block
+    uint32_t num_words;     // words of memory covered by map and code
+    Block **all;            // every live block, for flushing
+    uint32_t num_blocks;
+    uint32_t max_blocks;
+    JitBuffer *jit;         // NULL when there is no JIT
+    uint32_t jit_threshold; // runs before a block is compiled
+} BlockCache;
+
+// Returns the machine's block cache, creating it if needed.
+BlockCache *block_cache(Machine *machine);
+
+// Frees a block cache and all of its blocks.
+void block_cache_destroy(BlockCache *cache);
+
+// Throws away every translated block.
+void block_cache_flush(BlockCache *cache);
+
+// Returns whether the word at idx is part of a translated block.
+static inline bool block_cache_covers(const BlockCache *cache, uint32_t idx) {
+    return (cache->code[idx / 8] >> (idx % 8)) & 1;
+}
+
+// Returns whether any of count words from idx is part of a translated
+//   block.
+bool block_cache_covers_range(const BlockCache *cache, uint32_t idx, uint32_t count);
+
+// Returns the block starting at pc, translating it if needed.
+//   Returns NULL if the first instruction can't be translated, in which
+//   case the caller should use step_machine.
+// Requires: pc is aligned, in range and not RETURN_ADDRESS
+Block *block_lookup(Machine *machine, BlockCache *cache, uint32_t pc);
+
+#endif
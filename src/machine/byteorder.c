@@ -0,0 +1,76 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "machine/byteorder.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MIPS241_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static const uint32_t one = 1;
+
+static void copy_words_scalar(uint8_t *dst, const uint8_t *src, size_t num_words) {
+    for (size_t i = 0; i < num_words; ++i) {
+        uint32_t word;
+        memcpy(&word, src + 4 * i, 4);
+        word = (word >> 24) | ((word >> 8) & 0xff00)
+               | ((word << 8) & 0xff0000) | (word << 24);
+        memcpy(dst + 4 * i, &word, 4);
+    }
+}
+
+#ifdef MIPS241_X86_SIMD
+__attribute__((target("avx2")))
+static void copy_words_avx2(uint8_t *dst, const uint8_t *src, size_t num_words) {
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                          11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4,
+                                          11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 16 <= num_words; i += 16) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(src + 4 * i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + 4 * i), _mm256_shuffle_epi8(a, swap));
+        _mm256_storeu_si256((__m256i *)(dst + 4 * i + 32), _mm256_shuffle_epi8(b, swap));
+    }
+    for (; i + 8 <= num_words; i += 8) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+        _mm256_storeu_si256((__m256i *)(dst + 4 * i), _mm256_shuffle_epi8(a, swap));
+    }
+    copy_words_scalar(dst + 4 * i, src + 4 * i, num_words - i);
+}
+
+__attribute__((target("ssse3")))
+static void copy_words_ssse3(uint8_t *dst, const uint8_t *src, size_t num_words) {
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                       11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 4 <= num_words; i += 4) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_shuffle_epi8(a, swap));
+    }
+    copy_words_scalar(dst + 4 * i, src + 4 * i, num_words - i);
+}
+#endif
+
+void copy_words_be(void *dst, const void *src, size_t num_words) {
+    if (((const uint8_t *)&one)[0] == 0) {
+        // big-endian hosts already agree with MIPS
+        if (dst != src)
+            memcpy(dst, src, 4 * num_words);
+        return;
+    }
+
+#ifdef MIPS241_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        copy_words_avx2(dst, src, num_words);
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        copy_words_ssse3(dst, src, num_words);
+        return;
+    }
+#endif
+    copy_words_scalar(dst, src, num_words);
+}
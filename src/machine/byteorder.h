@@ -0,0 +1,16 @@
+/**
+ * Bulk conversion between big-endian MIPS words and host order.
+ */
+#ifndef BYTEORDER_H__
+#define BYTEORDER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Copies num_words words from src to dst, converting between big-endian
+//   and host order. The conversion is its own inverse, so this goes both
+//   ways. Neither pointer needs to be aligned, but they must not overlap
+//   unless they are equal.
+void copy_words_be(void *dst, const void *src, size_t num_words);
+
+#endif
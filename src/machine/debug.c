@@ -0,0 +1,187 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/block.h"
+#include "machine/debug.h"
+#include "machine/machine.h"
+
+static size_t breakpoint_bytes(uint32_t mem_size) {
+    return ((size_t)mem_size + 7) / 8;
+}
+
+static size_t page_bitmap_bytes(uint32_t mem_size) {
+    const size_t pages = ((size_t)mem_size * 4 + WATCH_PAGE_BYTES - 1) / WATCH_PAGE_BYTES;
+    return (pages + 7) / 8;
+}
+
+
+void debug_destroy(MachineDebug *debug, uint32_t mem_size) {
+    if (debug != NULL) {
+        m_free_pages(debug->breakpoints, breakpoint_bytes(mem_size));
+        free(debug->watchpoints);
+        free(debug->watched_pages);
+        free(debug);
+    }
+}
+
+// Returns the machine's debug state, making it if needed, or NULL.
+static MachineDebug *get_debug(Machine *machine) {
+    if (machine->debug == NULL)
+        machine->debug = calloc(1, sizeof(MachineDebug));
+    return machine->debug;
+}
+
+// Frees the debug state once nothing is set, so the engines go back to
+//   running at full speed.
+static void maybe_free_debug(Machine *machine) {
+    MachineDebug *debug = machine->debug;
+    if (debug != NULL && debug->num_breakpoints == 0 && debug->num_watchpoints == 0) {
+        debug_destroy(debug, machine->mem_size);
+        machine->debug = NULL;
+    }
+}
+
+
+bool debug_watch_hit(MachineDebug *debug, uint32_t byte_addr, int kind) {
+    const uint32_t page = byte_addr / WATCH_PAGE_BYTES;
+    if (!((debug->watched_pages[page / 8] >> (page % 8)) & 1))
+        return false;
+
+    for (uint32_t i = 0; i < debug->num_watchpoints; ++i) {
+        const Watchpoint *w = &debug->watchpoints[i];
+        // the accessed word is [byte_addr, byte_addr + 4)
+        if ((w->kinds & kind) && byte_addr < w->end && w->start < byte_addr + 4)
+            return true;
+    }
+    return false;
+}
+
+
+bool m_set_breakpoint(Machine *machine, uint32_t pc) {
+    if (pc % 4 != 0 || pc / 4 >= machine->mem_size)
+        return false;
+
+    MachineDebug *debug = get_debug(machine);
+    if (debug == NULL)
+        return false;
+    if (debug->breakpoints == NULL) {
+        debug->breakpoints = m_alloc_pages(breakpoint_bytes(machine->mem_size));
+        if (debug->breakpoints == NULL) {
+            maybe_free_debug(machine);
+            return false;
+        }
+    }
+
+    const uint32_t idx = pc / 4;
+    if (!debug_breakpoint_at(debug, idx)) {
+        debug->breakpoints[idx / 8] |= 1 << (idx % 8);
+        debug->num_breakpoints++;
+    }
+
+    // translated code runs straight through, so it has to end here now
+    if (machine->decoded != NULL)
+        machine->decoded[idx].type = TYPE_INVALID;
+    if (machine->blocks != NULL)
+        block_cache_flush(machine->blocks);
+    return true;
+}
+
+void m_clear_breakpoint(Machine *machine, uint32_t pc) {
+    MachineDebug *debug = machine->debug;
+    if (pc % 4 != 0 || pc / 4 >= machine->mem_size || !debug_breakpoint_at(debug, pc / 4))
+        return;
+
+    const uint32_t idx = pc / 4;
+    debug->breakpoints[idx / 8] &= ~(1 << (idx % 8));
+    debug->num_breakpoints--;
+    // blocks can now run through it again
+    if (machine->decoded != NULL)
+        machine->decoded[idx].type = TYPE_INVALID;
+    if (machine->blocks != NULL)
+        block_cache_flush(machine->blocks);
+    maybe_free_debug(machine);
+}
+
+
+// Marks the pages each watchpoint touches
+static void mark_watched_pages(MachineDebug *debug, uint32_t mem_size) {
+    memset(debug->watched_pages, 0, page_bitmap_bytes(mem_size));
+    for (uint32_t i = 0; i < debug->num_watchpoints; ++i) {
+        const Watchpoint *w = &debug->watchpoints[i];
+        // accesses are whole words, so the word holding start counts
+        for (uint64_t page = (w->start & ~3u) / WATCH_PAGE_BYTES;
+             page <= (w->end - 1) / WATCH_PAGE_BYTES; ++page)
+            debug->watched_pages[page / 8] |= 1 << (page % 8);
+    }
+}
+
+bool m_add_watchpoint(Machine *machine, uint32_t addr, uint32_t len, int kinds) {
+    if (len == 0 || (kinds & (WATCH_READ | WATCH_WRITE)) == 0
+        || (uint64_t)addr + len > (uint64_t)machine->mem_size * 4)
+        return false;
+
+    MachineDebug *debug = get_debug(machine);
+    if (debug == NULL)
+        return false;
+    if (debug->watched_pages == NULL)
+        debug->watched_pages = calloc(page_bitmap_bytes(machine->mem_size), 1);
+    if (debug->num_watchpoints == debug->max_watchpoints && debug->watched_pages != NULL) {
+        const uint32_t max = debug->max_watchpoints ? debug->max_watchpoints * 2 : 8;
+        Watchpoint *watchpoints = realloc(debug->watchpoints, max * sizeof(Watchpoint));
+        if (watchpoints != NULL) {
+            debug->watchpoints = watchpoints;
+            debug->max_watchpoints = max;
+        }
+    }
+    if (debug->watched_pages == NULL || debug->num_watchpoints == debug->max_watchpoints) {
+        maybe_free_debug(machine);
+        return false;
+    }
+
+    debug->watchpoints[debug->num_watchpoints++] =
+        (Watchpoint) { addr, addr + len, kinds & (WATCH_READ | WATCH_WRITE) };
+    mark_watched_pages(debug, machine->mem_size);
+    return true;
+}
+
+void m_remove_watchpoint(Machine *machine, uint32_t addr, uint32_t len) {
+    MachineDebug *debug = machine->debug;
+    if (debug == NULL)
+        return;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < debug->num_watchpoints; ++i) {
+        const Watchpoint w = debug->watchpoints[i];
+        if (w.start != addr || w.end - w.start != len)
+            debug->watchpoints[kept++] = w;
+    }
+    debug->num_watchpoints = kept;
+    if (debug->watched_pages != NULL)
+        mark_watched_pages(debug, machine->mem_size);
+    maybe_free_debug(machine);
+}
+
+
+void m_clear_debug(Machine *machine) {
+    if (machine->debug == NULL)
+        return;
+    machine->debug->num_breakpoints = 0;
+    machine->debug->num_watchpoints = 0;
+    maybe_free_debug(machine);
+
+    // entries that were breakpoints are refilled as plain instructions
+    if (machine->decoded != NULL)
+        m_zero_pages(machine->decoded, sizeof(Instruction) * (size_t)machine->mem_size);
+    if (machine->blocks != NULL)
+        block_cache_flush(machine->blocks);
+}
+
+
+bool m_watch_hit(const Machine *machine, uint32_t *addr) {
+    if (machine->debug == NULL || !machine->debug->watch_hit)
+        return false;
+    if (addr != NULL)
+        *addr = machine->debug->watch_addr;
+    return true;
+}
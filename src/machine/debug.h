@@ -0,0 +1,107 @@
+/**
+ * Breakpoints and watchpoints.
+ *
+ * A breakpoint stops a machine before it runs the instruction at a pc.
+ * A watchpoint stops it before a lw or sw touches a range of memory.
+ * Either way the run returns IR_BREAKPOINT with the status pc, and the
+ * machine's pc, at the instruction that didn't run yet. Running again
+ * from there runs it without stopping on it again.
+ *
+ * Nothing is paid for this while none are set. Breakpoints are marked
+ * in the predecode cache as TYPE_BREAK entries, and translated blocks
+ * end before them, so only step_machine ever sees them. While any
+ * watchpoints are set, runs go one instruction at a time through
+ * step_machine, which checks a bitmap of watched pages on lw and sw.
+ */
+#ifndef DEBUG_H__
+#define DEBUG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+enum watch_kind {
+    WATCH_READ = 1,
+    WATCH_WRITE = 2
+};
+
+typedef struct Watchpoint {
+    uint32_t start;     // byte addresses [start, end)
+    uint32_t end;
+    int kinds;          // WATCH_READ and/or WATCH_WRITE
+} Watchpoint;
+
+typedef struct MachineDebug {
+    uint8_t *breakpoints;   // bitmap of words with a breakpoint
+    uint32_t num_breakpoints;
+    Watchpoint *watchpoints;
+    uint32_t num_watchpoints;
+    uint32_t max_watchpoints;
+    uint8_t *watched_pages;  // bitmap of pages any watchpoint touches
+    bool resuming;           // the next run at resume_pc doesn't stop there
+    uint32_t resume_pc;
+    bool watch_hit;          // why the last stop happened
+    uint32_t watch_addr;
+} MachineDebug;
+
+#define WATCH_PAGE_BYTES 4096
+
+// Frees a machine's breakpoints and watchpoints.
+void debug_destroy(MachineDebug *debug, uint32_t mem_size);
+
+// Whether there is a breakpoint on the word at idx.
+static inline bool debug_breakpoint_at(const MachineDebug *debug, uint32_t idx) {
+    return debug != NULL && debug->num_breakpoints != 0
+           && (debug->breakpoints[idx / 8] >> (idx % 8)) & 1;
+}
+
+// Whether a stop was just resumed from pc, which then doesn't stop again.
+static inline bool debug_resume(MachineDebug *debug, uint32_t pc) {
+    if (debug->resuming && debug->resume_pc == pc) {
+        debug->resuming = false;
+        return true;
+    }
+    return false;
+}
+
+// Stops before the instruction at pc, which was about to access watch_addr
+//   if watch is set.
+static inline EmulatorStatus debug_stop(Machine *const machine, uint32_t pc,
+                                        bool watch, uint32_t watch_addr) {
+    machine->debug->resuming = true;
+    machine->debug->resume_pc = pc;
+    machine->debug->watch_hit = watch;
+    machine->debug->watch_addr = watch_addr;
+    machine->pc = pc;
+    return (EmulatorStatus) {IR_BREAKPOINT, pc};
+}
+
+// Whether an access of kind to the word at byte_addr hits a watchpoint.
+bool debug_watch_hit(MachineDebug *debug, uint32_t byte_addr, int kind);
+
+
+// Stops before the instruction at pc runs. Returns false if pc is not an
+//   aligned address in memory.
+mips241_EXPORT bool m_set_breakpoint(Machine *machine, uint32_t pc);
+
+// Removes the breakpoint at pc, if there is one.
+mips241_EXPORT void m_clear_breakpoint(Machine *machine, uint32_t pc);
+
+// Stops before lw (WATCH_READ) and/or sw (WATCH_WRITE) touch any of the
+//   len bytes from addr. Returns false if they aren't all in memory.
+mips241_EXPORT bool m_add_watchpoint(Machine *machine, uint32_t addr,
+                                     uint32_t len, int kinds);
+
+// Removes watchpoints added with exactly this addr and len.
+mips241_EXPORT void m_remove_watchpoint(Machine *machine, uint32_t addr,
+                                        uint32_t len);
+
+// Removes every breakpoint and watchpoint.
+mips241_EXPORT void m_clear_debug(Machine *machine);
+
+// Whether the last IR_BREAKPOINT was a watchpoint, setting *addr to the
+//   address that was about to be accessed if so.
+mips241_EXPORT bool m_watch_hit(const Machine *machine, uint32_t *addr);
+
+#endif
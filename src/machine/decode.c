@@ -1,5 +1,18 @@
+#include <stddef.h>
 #include "machine/decode.h"
 
+// AVX2 is chosen at run time, as in byteorder.c, so one build uses it
+//   where it's there; SSE2 is always there on x86-64
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define DECODE_AVX2
+#define DECODE_SSE2
+#define DECODE_AVX2_FN __attribute__((target("avx2")))
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DECODE_SSE2
+#endif
+
 Instruction decode_instruction(uint32_t word) {
     const uint8_t s = (word >> 21) & 0x1F; //0b11111 (5)
     const uint8_t t = (word >> 16) & 0x1F;
@@ -29,3 +42,209 @@ Instruction decode_instruction(uint32_t word) {
 
     // Note: invalid instructions will be caught at dispatch
 }
+
+
+// One word at a time, for hosts without vector instructions and for
+//   what's left over after them
+static void decode_scalar(const uint32_t *words, size_t start, size_t n,
+                          const DecodedTable *table) {
+    for (size_t i = start; i < n; ++i) {
+        const uint32_t word = words[i];
+        const uint8_t opcode = word >> 26;
+        table->type[i] = opcode == 0 ? TYPE_R : TYPE_I;
+        table->code[i] = opcode == 0 ? (word & 0x3F) : opcode;
+        table->s[i] = (word >> 21) & 0x1F;
+        table->t[i] = (word >> 16) & 0x1F;
+        table->d[i] = (word >> 11) & 0x1F;
+        table->imm[i] = (int16_t)(word & 0xFFFF);
+    }
+}
+
+#ifdef DECODE_AVX2
+#define AVX2_BATCH 32
+
+// Narrows fields of 32 words, 8 to a vector, to bytes in order
+DECODE_AVX2_FN
+static inline __m256i narrow_bytes_avx2(__m256i a, __m256i b, __m256i c, __m256i d) {
+    // packing works within 128-bit lanes, leaving the words interleaved
+    const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a, b),
+                                               _mm256_packs_epi32(c, d));
+    return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+// Narrows fields of 16 words to halfwords in order
+DECODE_AVX2_FN
+static inline __m256i narrow_halves_avx2(__m256i a, __m256i b) {
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+}
+
+DECODE_AVX2_FN
+static size_t decode_avx2(const uint32_t *words, size_t n, const DecodedTable *table) {
+    const __m256i five = _mm256_set1_epi32(0x1F);
+    size_t i = 0;
+    for (; i + AVX2_BATCH <= n; i += AVX2_BATCH) {
+        __m256i w[4], opcode[4], func[4], s[4], t[4], d[4], imm[4];
+        for (int k = 0; k < 4; ++k) {
+            w[k] = _mm256_loadu_si256((const __m256i *)(words + i + 8 * k));
+            opcode[k] = _mm256_srli_epi32(w[k], 26);
+            func[k] = _mm256_and_si256(w[k], _mm256_set1_epi32(0x3F));
+            s[k] = _mm256_and_si256(_mm256_srli_epi32(w[k], 21), five);
+            t[k] = _mm256_and_si256(_mm256_srli_epi32(w[k], 16), five);
+            d[k] = _mm256_and_si256(_mm256_srli_epi32(w[k], 11), five);
+            imm[k] = _mm256_srai_epi32(_mm256_slli_epi32(w[k], 16), 16);
+        }
+
+        const __m256i ops = narrow_bytes_avx2(opcode[0], opcode[1], opcode[2], opcode[3]);
+        const __m256i funcs = narrow_bytes_avx2(func[0], func[1], func[2], func[3]);
+        const __m256i is_r = _mm256_cmpeq_epi8(ops, _mm256_setzero_si256());
+        // TYPE_R is TYPE_I - 1, and is_r is -1 where it's an R-type
+        const __m256i type = _mm256_add_epi8(_mm256_set1_epi8(TYPE_I), is_r);
+        const __m256i code = _mm256_or_si256(_mm256_and_si256(is_r, funcs),
+                                             _mm256_andnot_si256(is_r, ops));
+
+        _mm256_storeu_si256((__m256i *)(table->type + i), type);
+        _mm256_storeu_si256((__m256i *)(table->code + i), code);
+        _mm256_storeu_si256((__m256i *)(table->s + i), narrow_bytes_avx2(s[0], s[1], s[2], s[3]));
+        _mm256_storeu_si256((__m256i *)(table->t + i), narrow_bytes_avx2(t[0], t[1], t[2], t[3]));
+        _mm256_storeu_si256((__m256i *)(table->d + i), narrow_bytes_avx2(d[0], d[1], d[2], d[3]));
+        _mm256_storeu_si256((__m256i *)(table->imm + i), narrow_halves_avx2(imm[0], imm[1]));
+        _mm256_storeu_si256((__m256i *)(table->imm + i + 16), narrow_halves_avx2(imm[2], imm[3]));
+    }
+    return i;
+}
+#endif
+
+#ifdef DECODE_SSE2
+#define SSE2_BATCH 16
+
+// Narrows fields of 16 words, 4 to a vector, to bytes
+static inline __m128i narrow_bytes_sse2(__m128i a, __m128i b, __m128i c, __m128i d) {
+    return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+
+static size_t decode_sse2(const uint32_t *words, size_t n, const DecodedTable *table) {
+    const __m128i five = _mm_set1_epi32(0x1F);
+    size_t i = 0;
+    for (; i + SSE2_BATCH <= n; i += SSE2_BATCH) {
+        __m128i w[4], opcode[4], func[4], s[4], t[4], d[4], imm[4];
+        for (int k = 0; k < 4; ++k) {
+            w[k] = _mm_loadu_si128((const __m128i *)(words + i + 4 * k));
+            opcode[k] = _mm_srli_epi32(w[k], 26);
+            func[k] = _mm_and_si128(w[k], _mm_set1_epi32(0x3F));
+            s[k] = _mm_and_si128(_mm_srli_epi32(w[k], 21), five);
+            t[k] = _mm_and_si128(_mm_srli_epi32(w[k], 16), five);
+            d[k] = _mm_and_si128(_mm_srli_epi32(w[k], 11), five);
+            imm[k] = _mm_srai_epi32(_mm_slli_epi32(w[k], 16), 16);
+        }
+
+        const __m128i ops = narrow_bytes_sse2(opcode[0], opcode[1], opcode[2], opcode[3]);
+        const __m128i funcs = narrow_bytes_sse2(func[0], func[1], func[2], func[3]);
+        const __m128i is_r = _mm_cmpeq_epi8(ops, _mm_setzero_si128());
+        // TYPE_R is TYPE_I - 1, and is_r is -1 where it's an R-type
+        const __m128i type = _mm_add_epi8(_mm_set1_epi8(TYPE_I), is_r);
+        const __m128i code = _mm_or_si128(_mm_and_si128(is_r, funcs),
+                                          _mm_andnot_si128(is_r, ops));
+
+        _mm_storeu_si128((__m128i *)(table->type + i), type);
+        _mm_storeu_si128((__m128i *)(table->code + i), code);
+        _mm_storeu_si128((__m128i *)(table->s + i), narrow_bytes_sse2(s[0], s[1], s[2], s[3]));
+        _mm_storeu_si128((__m128i *)(table->t + i), narrow_bytes_sse2(t[0], t[1], t[2], t[3]));
+        _mm_storeu_si128((__m128i *)(table->d + i), narrow_bytes_sse2(d[0], d[1], d[2], d[3]));
+        _mm_storeu_si128((__m128i *)(table->imm + i), _mm_packs_epi32(imm[0], imm[1]));
+        _mm_storeu_si128((__m128i *)(table->imm + i + 8), _mm_packs_epi32(imm[2], imm[3]));
+    }
+    return i;
+}
+#endif
+
+// Decodes as many words as it can a batch at a time, returning how many
+static size_t decode_vector(const uint32_t *words, size_t n, const DecodedTable *table) {
+#ifdef DECODE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return decode_avx2(words, n, table);
+#endif
+#ifdef DECODE_SSE2
+    return decode_sse2(words, n, table);
+#else
+    (void) words; (void) n; (void) table;
+    return 0;
+#endif
+}
+
+void decode_instructions(const uint32_t *words, size_t n, const DecodedTable *table) {
+    decode_scalar(words, decode_vector(words, n, table), n, table);
+}
+
+bool decode_instructions_with(enum decode_path path, const uint32_t *words, size_t n,
+                              const DecodedTable *table) {
+    size_t done = 0;
+    switch (path) {
+        case DECODE_WITH_BEST:
+            done = decode_vector(words, n, table);
+            break;
+        case DECODE_WITH_SCALAR:
+            break;
+        case DECODE_WITH_SSE2:
+#ifdef DECODE_SSE2
+            done = decode_sse2(words, n, table);
+            break;
+#else
+            return false;
+#endif
+        case DECODE_WITH_AVX2:
+#ifdef DECODE_AVX2
+            if (!__builtin_cpu_supports("avx2"))
+                return false;
+            done = decode_avx2(words, n, table);
+            break;
+#else
+            return false;
+#endif
+        default:
+            return false;
+    }
+    decode_scalar(words, done, n, table);
+    return true;
+}
+
+
+void instruction_destinations(Instruction ins, uint8_t dest[2]) {
+    dest[0] = dest[1] = REG_NONE;
+    if (ins.type == TYPE_R) {
+        switch (ins.code) {
+            case FUNC_ADD: case FUNC_SUB: case FUNC_SLT: case FUNC_SLTU:
+            case FUNC_MFHI: case FUNC_MFLO: case FUNC_LIS:
+                dest[0] = ins.decoded.r.d;
+                break;
+            case FUNC_JALR:
+                dest[0] = 31;
+                break;
+            case FUNC_MULT: case FUNC_MULTU: case FUNC_DIV: case FUNC_DIVU:
+                dest[0] = REG_HI;
+                dest[1] = REG_LO;
+                break;
+        }
+    } else if (ins.type == TYPE_I && ins.code == OP_LW) {
+        dest[0] = ins.decoded.i.t;
+    }
+}
+
+const char *instruction_name(Instruction ins) {
+    static const char *const r_names[64] = {
+        [FUNC_ADD] = "add", [FUNC_SUB] = "sub",
+        [FUNC_MULT] = "mult", [FUNC_MULTU] = "multu",
+        [FUNC_DIV] = "div", [FUNC_DIVU] = "divu",
+        [FUNC_MFHI] = "mfhi", [FUNC_MFLO] = "mflo", [FUNC_LIS] = "lis",
+        [FUNC_SLT] = "slt", [FUNC_SLTU] = "sltu",
+        [FUNC_JR] = "jr", [FUNC_JALR] = "jalr"
+    };
+    static const char *const i_names[64] = {
+        [OP_BEQ] = "beq", [OP_BNE] = "bne", [OP_LW] = "lw", [OP_SW] = "sw"
+    };
+
+    switch (ins.type) {
+        case TYPE_R: return r_names[ins.code & 0x3F];
+        case TYPE_I: return i_names[ins.code & 0x3F];
+        default: return NULL;
+    }
+}
@@ -4,6 +4,8 @@
 #ifndef INSTRUCTION_H__
 #define INSTRUCTION_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "common/defs.h"
 
@@ -12,4 +14,64 @@
 // The caller must check for a valid opcode in the return value.
 mips241_EXPORT Instruction decode_instruction(uint32_t);
 
+// Decoded instructions field by field, for going through many at once.
+//   Entry i of each array comes from word i. Every field is filled for
+//   every word, whichever type it is.
+typedef struct DecodedTable {
+    uint8_t *type;  // TYPE_R or TYPE_I
+    uint8_t *code;  // func or opcode, as in Instruction
+    uint8_t *s;
+    uint8_t *t;
+    uint8_t *d;
+    int16_t *imm;
+} DecodedTable;
+
+// Decodes n words into entries 0 to n - 1 of table, like
+//   decode_instruction does. On x86-64 this uses AVX2 if the CPU it runs
+//   on has it and SSE2 otherwise, and elsewhere decodes one at a time.
+mips241_EXPORT void decode_instructions(const uint32_t *words, size_t n,
+                                        const DecodedTable *table);
+
+// The ways decode_instructions can go about it
+enum decode_path {
+    DECODE_WITH_BEST,       // what decode_instructions picks
+    DECODE_WITH_SCALAR,
+    DECODE_WITH_SSE2,
+    DECODE_WITH_AVX2
+};
+
+// decode_instructions, but always the given way, for testing each one.
+//   Returns false, decoding nothing, if this build or CPU can't.
+mips241_EXPORT bool decode_instructions_with(enum decode_path path, const uint32_t *words,
+                                             size_t n, const DecodedTable *table);
+
+// Returns entry i of table as decode_instruction would have.
+static inline Instruction decoded_table_get(const DecodedTable *table, size_t i) {
+    if (table->type[i] == TYPE_R) {
+        return (Instruction) {
+            .type = TYPE_R,
+            .decoded = {.r = { .d = table->d[i], .s = table->s[i], .t = table->t[i] }},
+            .code = table->code[i]
+        };
+    }
+    return (Instruction) {
+        .type = TYPE_I,
+        .decoded = {.i = { .s = table->s[i], .t = table->t[i], .imm = table->imm[i] }},
+        .code = table->code[i]
+    };
+}
+
+// Returns the mnemonic for a decoded instruction, or NULL if it isn't
+//   one the machine runs.
+mips241_EXPORT const char *instruction_name(Instruction ins);
+
+// Registers numbered past the general purpose ones
+#define REG_HI 32
+#define REG_LO 33
+#define REG_NONE 0xFF
+
+// Sets dest to the registers an instruction writes, REG_NONE for none.
+//   Writes to $0 count, though they're dropped.
+void instruction_destinations(Instruction ins, uint8_t dest[2]);
+
 #endif
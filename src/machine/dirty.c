@@ -0,0 +1,174 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/block.h"
+#include "machine/machine.h"
+
+// What reset_machine puts a machine back to
+struct MachineBaseline {
+    uint32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    uint32_t hi;
+    uint32_t lo;
+    uint32_t *mem;      // the pages that weren't zero, the rest unbacked
+    uint8_t *stored;    // a byte per page, set if it's in mem
+};
+
+
+uint32_t m_num_pages(const Machine *machine) {
+    return (uint32_t)(((uint64_t)machine->mem_size + DIRTY_PAGE_WORDS - 1) / DIRTY_PAGE_WORDS);
+}
+
+// Words of memory in a page, which is short at the end of memory
+static uint32_t page_words(const Machine *machine, uint32_t page) {
+    const uint32_t left = machine->mem_size - page * DIRTY_PAGE_WORDS;
+    return left < DIRTY_PAGE_WORDS ? left : DIRTY_PAGE_WORDS;
+}
+
+static bool all_zero(const uint32_t *words, uint32_t count) {
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        bits |= words[i];
+    return bits == 0;
+}
+
+// Whether a page can differ from the baseline, or from zero without one
+static bool may_differ(const Machine *machine, uint32_t page) {
+    return machine->dirty[page] != 0
+           || (machine->baseline == NULL && !machine->clean_is_zero);
+}
+
+// Whether a page differs from the baseline, or from zero without one
+static bool differs(const Machine *machine, uint32_t page) {
+    const uint32_t *words = machine->mem + (size_t)page * DIRTY_PAGE_WORDS;
+    const uint32_t count = page_words(machine, page);
+    const struct MachineBaseline *baseline = machine->baseline;
+    if (baseline != NULL && baseline->stored[page])
+        return memcmp(words, baseline->mem + (size_t)page * DIRTY_PAGE_WORDS,
+                      sizeof(uint32_t) * count) != 0;
+    return !all_zero(words, count);
+}
+
+
+bool m_page_dirty(const Machine *machine, uint32_t page) {
+    return page < m_num_pages(machine) && machine->dirty[page] != 0;
+}
+
+uint32_t m_dirty_pages(const Machine *machine, uint32_t *pages, uint32_t max) {
+    const uint32_t num_pages = m_num_pages(machine);
+    uint32_t count = 0;
+    for (uint32_t page = 0; page < num_pages; ++page) {
+        if (machine->dirty[page] == 0)
+            continue;
+        if (count < max)
+            pages[count] = page;
+        ++count;
+    }
+    return count;
+}
+
+uint32_t m_changed_pages(const Machine *machine, uint32_t *pages, uint32_t max) {
+    const uint32_t num_pages = m_num_pages(machine);
+    uint32_t count = 0;
+    for (uint32_t page = 0; page < num_pages; ++page) {
+        if (!may_differ(machine, page) || !differs(machine, page))
+            continue;
+        if (count < max)
+            pages[count] = page;
+        ++count;
+    }
+    return count;
+}
+
+
+bool m_set_baseline(Machine *machine) {
+    const uint32_t num_pages = m_num_pages(machine);
+    struct MachineBaseline *baseline = machine->baseline;
+    if (baseline == NULL) {
+        baseline = calloc(1, sizeof(struct MachineBaseline));
+        if (baseline == NULL)
+            return false;
+        baseline->mem = m_alloc_pages(sizeof(uint32_t) * (size_t)machine->mem_size);
+        baseline->stored = m_alloc_pages(num_pages);
+        if (baseline->mem == NULL || baseline->stored == NULL) {
+            m_free_pages(baseline->mem, sizeof(uint32_t) * (size_t)machine->mem_size);
+            m_free_pages(baseline->stored, num_pages);
+            free(baseline);
+            return false;
+        }
+    }
+
+    // pages that can't differ are already right, as zero or from before
+    for (uint32_t page = 0; page < num_pages; ++page) {
+        if (!may_differ(machine, page))
+            continue;
+        const size_t first = (size_t)page * DIRTY_PAGE_WORDS;
+        const uint32_t count = page_words(machine, page);
+        if (!all_zero(machine->mem + first, count)) {
+            memcpy(baseline->mem + first, machine->mem + first, sizeof(uint32_t) * count);
+            baseline->stored[page] = 1;
+        } else if (baseline->stored[page]) {
+            m_zero_pages(baseline->mem + first, sizeof(uint32_t) * count);
+            baseline->stored[page] = 0;
+        }
+        machine->dirty[page] = 0;
+    }
+
+    memcpy(baseline->registers, machine->registers, sizeof(baseline->registers));
+    baseline->pc = machine->pc;
+    baseline->hi = machine->hi;
+    baseline->lo = machine->lo;
+    machine->baseline = baseline;
+    return true;
+}
+
+void m_clear_baseline(Machine *machine) {
+    struct MachineBaseline *baseline = machine->baseline;
+    if (baseline == NULL)
+        return;
+    m_free_pages(baseline->mem, sizeof(uint32_t) * (size_t)machine->mem_size);
+    m_free_pages(baseline->stored, m_num_pages(machine));
+    free(baseline);
+    machine->baseline = NULL;
+    // clean pages are as the baseline had them
+    machine->clean_is_zero = false;
+}
+
+
+void m_restore_baseline(Machine *machine) {
+    const struct MachineBaseline *baseline = machine->baseline;
+    const uint32_t num_pages = m_num_pages(machine);
+    bool flush = false;
+    for (uint32_t page = 0; page < num_pages; ++page) {
+        if (machine->dirty[page] == 0)
+            continue;
+        const size_t first = (size_t)page * DIRTY_PAGE_WORDS;
+        const uint32_t count = page_words(machine, page);
+        // written over rather than given back, as the next run is likely
+        //   to write the same pages
+        if (baseline != NULL && baseline->stored[page])
+            memcpy(machine->mem + first, baseline->mem + first, sizeof(uint32_t) * count);
+        else
+            memset(machine->mem + first, 0, sizeof(uint32_t) * count);
+
+        if (machine->decoded != NULL)
+            memset(machine->decoded + first, 0, sizeof(Instruction) * count);
+        flush = flush || (machine->blocks != NULL
+                          && block_cache_covers_range(machine->blocks, (uint32_t)first, count));
+        machine->dirty[page] = 0;
+    }
+    // blocks elsewhere, such as the baseline's program, can stay
+    if (flush)
+        block_cache_flush(machine->blocks);
+
+    if (baseline != NULL) {
+        memcpy(machine->registers, baseline->registers, sizeof(machine->registers));
+        machine->pc = baseline->pc;
+        machine->hi = baseline->hi;
+        machine->lo = baseline->lo;
+    } else {
+        memset(machine->registers, 0, sizeof(machine->registers));
+        machine->pc = machine->hi = machine->lo = 0;
+    }
+}
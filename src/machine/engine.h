@@ -0,0 +1,27 @@
+/**
+ * Run engines that can back step_machine_loop. These are internal to
+ * the library; everyone else should go through machine/impl.h.
+ */
+#ifndef ENGINE_H__
+#define ENGINE_H__
+
+#include "common/defs.h"
+#include "machine/machine.h"
+
+// Runs until something other than IR_SUCCESS happens, keeping pc and the
+//   registers in locals and dispatching with computed goto where the
+//   compiler supports it. Anything unusual (MMIO, faults, lis at the end
+//   of memory, ...) is handed to step_machine for exactly one instruction,
+//   so the final state and retcode always match step_machine.
+EmulatorStatus run_threaded(Machine *const machine);
+
+// Runs until something other than IR_SUCCESS happens, or budget
+//   instructions have retired, by translating code into basic blocks of
+//   ops (see machine/block.h) and running whole blocks at a time. Like
+//   run_threaded, anything unusual goes through step_machine. The budget
+//   is only checked between blocks; blocks that would overrun it are
+//   single-stepped. Sets *retired to the number of instructions retired.
+EmulatorStatus run_blocks(Machine *const machine, uint64_t budget,
+                          uint64_t *retired);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/decode.h"
+#include "machine/history.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+#include "machine/machine.h"
+
+#define NO_WRITE UINT32_MAX
+
+// What one retired instruction overwrote
+typedef struct UndoEntry {
+    uint32_t pc;            // where it was
+    uint32_t mem_idx;       // the word it stored to, or NO_WRITE
+    uint32_t mem_old;
+    uint32_t reg_old[2];
+    uint8_t reg[2];         // as from instruction_destinations
+} UndoEntry;
+
+// The state before the first instruction of an interval
+typedef struct Checkpoint {
+    uint32_t pc;
+    uint32_t hi;
+    uint32_t lo;
+    uint32_t registers[NUM_REGISTERS];
+} Checkpoint;
+
+struct History {
+    UndoEntry *entries;         // entry i is at i % capacity
+    Checkpoint *checkpoints;    // interval k's is at k % num_intervals
+    uint32_t num_intervals;
+    uint64_t capacity;          // num_intervals * HISTORY_INTERVAL
+    uint64_t first;             // oldest entry kept, the start of an interval
+    uint64_t next;              // one past the newest
+};
+
+
+History *history_create(size_t max_bytes) {
+    History *history = calloc(1, sizeof(History));
+    if (history == NULL)
+        return NULL;
+
+    const size_t interval_bytes = HISTORY_INTERVAL * sizeof(UndoEntry) + sizeof(Checkpoint);
+    history->num_intervals = max_bytes / interval_bytes > 2
+        ? (uint32_t)(max_bytes / interval_bytes) : 2;
+    history->capacity = (uint64_t)history->num_intervals * HISTORY_INTERVAL;
+    history->entries = malloc(history->capacity * sizeof(UndoEntry));
+    history->checkpoints = malloc(history->num_intervals * sizeof(Checkpoint));
+    if (history->entries == NULL || history->checkpoints == NULL) {
+        history_destroy(history);
+        return NULL;
+    }
+    return history;
+}
+
+void history_destroy(History *history) {
+    if (history != NULL) {
+        free(history->entries);
+        free(history->checkpoints);
+        free(history);
+    }
+}
+
+
+static inline uint32_t *reg_ptr(Machine *machine, uint8_t reg) {
+    return reg == REG_HI ? &machine->hi
+         : reg == REG_LO ? &machine->lo
+         : &machine->registers[reg];
+}
+
+// Starts the entry for the instruction about to run
+static inline void begin_entry(History *history, Machine *machine) {
+    if (history->next % HISTORY_INTERVAL == 0) {
+        if (history->next - history->first == history->capacity)
+            history->first += HISTORY_INTERVAL;
+        Checkpoint *c =
+            &history->checkpoints[(history->next / HISTORY_INTERVAL) % history->num_intervals];
+        c->pc = machine->pc;
+        c->hi = machine->hi;
+        c->lo = machine->lo;
+        memcpy(c->registers, machine->registers, sizeof(c->registers));
+    }
+
+    UndoEntry *e = &history->entries[history->next % history->capacity];
+    const uint32_t pc = machine->pc;
+    Instruction ins = { TYPE_INVALID };
+    if (pc % 4 == 0 && pc / 4 < machine->mem_size)
+        ins = decode_instruction(machine->mem[pc / 4]);
+
+    e->pc = pc;
+    instruction_destinations(ins, e->reg);
+    for (int i = 0; i < 2; ++i)
+        if (e->reg[i] != REG_NONE)
+            e->reg_old[i] = *reg_ptr(machine, e->reg[i]);
+
+    e->mem_idx = NO_WRITE;
+    if (ins.type == TYPE_I && ins.code == OP_SW) {
+        const uint32_t byte_addr = machine->registers[ins.decoded.i.s] + ins.decoded.i.imm;
+        if (byte_addr % 4 == 0 && byte_addr / 4 < machine->mem_size) {
+            e->mem_idx = byte_addr / 4;
+            e->mem_old = machine->mem[byte_addr / 4];
+        }
+    }
+}
+
+EmulatorStatus step_machine_recorded(Machine *const machine, History *history,
+                                     uint64_t budget, uint64_t *retired) {
+    const uint64_t start = m_now_ns();
+    EmulatorStatus status;
+    uint64_t count = 0;
+    for (;; ++count) {
+        if (count == budget) {
+            status = (EmulatorStatus) {IR_BUDGET_EXHAUSTED, machine->pc};
+            break;
+        }
+
+        begin_entry(history, machine);
+        status = step_machine(machine);
+        if (status.retcode != IR_SUCCESS)
+            break;
+        history->next++;
+    }
+
+    *retired = count;
+    m_flush_output(machine);
+    machine->stats.wall_ns += m_now_ns() - start;
+    return status;
+}
+
+
+uint64_t history_length(const History *history) {
+    return history->next - history->first;
+}
+
+static void undo_memory(Machine *machine, const UndoEntry *e) {
+    if (e->mem_idx != NO_WRITE)
+        m_write_word(machine, e->mem_idx, e->mem_old);
+}
+
+bool history_step_back(Machine *machine, History *history) {
+    if (history->next == history->first)
+        return false;
+
+    const UndoEntry *e = &history->entries[--history->next % history->capacity];
+    undo_memory(machine, e);
+    for (int i = 1; i >= 0; --i)
+        if (e->reg[i] != REG_NONE)
+            *reg_ptr(machine, e->reg[i]) = e->reg_old[i];
+    machine->pc = e->pc;
+    return true;
+}
+
+uint64_t history_rewind(Machine *machine, History *history, uint64_t count) {
+    uint64_t undone = 0;
+    while (undone < count && history->next != history->first) {
+        // the interval the newest entry is in, which is kept whole
+        const uint64_t start = (history->next - 1) / HISTORY_INTERVAL * HISTORY_INTERVAL;
+        if (history->next - start > count - undone) {
+            history_step_back(machine, history);
+            ++undone;
+            continue;
+        }
+
+        // back to its checkpoint: only memory needs undoing entry by entry
+        for (uint64_t i = history->next; i-- > start; )
+            undo_memory(machine, &history->entries[i % history->capacity]);
+        const Checkpoint *c =
+            &history->checkpoints[(start / HISTORY_INTERVAL) % history->num_intervals];
+        machine->pc = c->pc;
+        machine->hi = c->hi;
+        machine->lo = c->lo;
+        memcpy(machine->registers, c->registers, sizeof(machine->registers));
+        undone += history->next - start;
+        history->next = start;
+    }
+    return undone;
+}
+
+bool history_reverse_to_write(Machine *machine, History *history, uint32_t addr) {
+    for (uint64_t i = history->next; i-- > history->first; ) {
+        if (history->entries[i % history->capacity].mem_idx == addr / 4) {
+            history_rewind(machine, history, history->next - i);
+            return true;
+        }
+    }
+    history_rewind(machine, history, history->next - history->first);
+    return false;
+}
@@ -0,0 +1,62 @@
+/**
+ * Reverse execution: stepping a machine back through what it ran.
+ *
+ * step_machine_recorded runs a machine like step_machine_n, logging what
+ * each retired instruction overwrote: the registers, hi/lo or memory word
+ * it wrote, and where it was. Every HISTORY_INTERVAL instructions it also
+ * checkpoints pc, hi, lo and the registers. Going back undoes entries
+ * newest first; whole intervals are undone by putting back their memory
+ * and loading the checkpoint before them.
+ *
+ * The log holds a bounded number of intervals. Once it's full, recording
+ * drops the oldest interval. Running forward again after going back
+ * drops what was undone.
+ *
+ * Only what recorded runs did to memory is undone; changes made to it
+ * between runs are left alone. Input read and output written stay read
+ * and written.
+ */
+#ifndef HISTORY_H__
+#define HISTORY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+#define HISTORY_INTERVAL 4096    // instructions between checkpoints
+
+typedef struct History History;
+
+// Returns an empty history using about max_bytes (at least enough for 2
+//   intervals), or NULL.
+mips241_EXPORT History *history_create(size_t max_bytes);
+
+mips241_EXPORT void history_destroy(History *history);
+
+// Runs until the program stops or budget instructions have retired,
+//   recording them in history. Sets *retired to the number that did.
+mips241_EXPORT EmulatorStatus step_machine_recorded(Machine *const machine,
+                                                    History *history,
+                                                    uint64_t budget,
+                                                    uint64_t *retired);
+
+// Returns how many instructions can be stepped back.
+mips241_EXPORT uint64_t history_length(const History *history);
+
+// Undoes the last recorded instruction. Returns false if there is none.
+mips241_EXPORT bool history_step_back(Machine *machine, History *history);
+
+// Undoes the last count recorded instructions, or as many as there are.
+//   Returns how many were undone.
+mips241_EXPORT uint64_t history_rewind(Machine *machine, History *history,
+                                       uint64_t count);
+
+// Goes back to just before the last recorded sw to the word holding
+//   addr, so that the pc is at that sw. Returns false, going back to the
+//   oldest recorded state, if there is none.
+mips241_EXPORT bool history_reverse_to_write(Machine *machine, History *history,
+                                             uint32_t addr);
+
+#endif
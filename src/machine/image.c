@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L // fileno, fseeko
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/image.h"
+#include "machine/machine.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define process_id() _getpid()
+#define seek_to(FILE, OFFSET) _fseeki64(FILE, (__int64)(OFFSET), SEEK_SET)
+#else
+#include <unistd.h>
+#define process_id() getpid()
+#define seek_to(FILE, OFFSET) fseeko(FILE, (off_t)(OFFSET), SEEK_SET)
+#endif
+
+// the same test machine.c uses for memory from m_alloc_pages being mmap'd
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define MIPS241_MMAP
+#endif
+
+#define IMAGE_MAGIC "MIPS241I"
+#define HEADER_BYTES 184
+#define PAGE_WORDS (IMAGE_PAGE_BYTES / 4)
+#define MAX_PATH_BYTES 4096
+
+static const uint32_t one = 1;
+
+static bool host_little_endian(void) {
+    return *(const uint8_t *)&one == 1;
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+        p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+           | (uint32_t)p[3] << 24;
+}
+
+static void put64(uint8_t *p, uint64_t value) {
+    put32(p, (uint32_t)value);
+    put32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+// Swaps count words between little-endian and host order in place
+static void words_to_host(uint32_t *words, size_t count) {
+    if (host_little_endian())
+        return;
+    for (size_t i = 0; i < count; ++i)
+        words[i] = get32((const uint8_t *)&words[i]);
+}
+
+static uint32_t num_pages(uint32_t mem_size) {
+    return (uint32_t)(((uint64_t)mem_size + PAGE_WORDS - 1) / PAGE_WORDS);
+}
+
+// Words of memory in a page, which is short at the end of memory
+static uint32_t page_words(uint32_t mem_size, uint32_t page) {
+    const uint32_t left = mem_size - page * PAGE_WORDS;
+    return left < PAGE_WORDS ? left : PAGE_WORDS;
+}
+
+// Where stored pages start, after the header and an index of count pages
+static uint64_t pages_offset(uint32_t count) {
+    const uint64_t end = HEADER_BYTES + 4 * (uint64_t)count;
+    return (end + IMAGE_PAGE_BYTES - 1) / IMAGE_PAGE_BYTES * IMAGE_PAGE_BYTES;
+}
+
+
+bool m_is_image(const uint8_t *start, size_t len) {
+    return len >= 8 && memcmp(start, IMAGE_MAGIC, 8) == 0;
+}
+
+
+// Writes the header and page index, and pads up to the first page
+static bool write_head(FILE *f, const Machine *machine, const ImageInfo *info,
+                       const uint32_t *index, uint32_t count) {
+    uint8_t header[HEADER_BYTES] = { 0 };
+    memcpy(header, IMAGE_MAGIC, 8);
+    put32(header + 8, IMAGE_VERSION);
+    put32(header + 16, machine->mem_size);
+    put32(header + 20, info != NULL ? info->entry : 0);
+    put32(header + 24, info != NULL ? info->load_offset : 0);
+    put32(header + 28, machine->pc);
+    put32(header + 32, machine->hi);
+    put32(header + 36, machine->lo);
+    for (int r = 0; r < NUM_REGISTERS; ++r)
+        put32(header + 40 + 4 * r, machine->registers[r]);
+    put32(header + 168, count);
+    put64(header + 176, pages_offset(count));
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header))
+        return false;
+
+    uint8_t word[4];
+    for (uint32_t i = 0; i < count; ++i) {
+        put32(word, index[i]);
+        if (fwrite(word, 1, 4, f) != 4)
+            return false;
+    }
+    for (uint64_t at = HEADER_BYTES + 4 * (uint64_t)count; at < pages_offset(count); ++at)
+        if (fputc(0, f) == EOF)
+            return false;
+    return true;
+}
+
+static bool write_page(FILE *f, const Machine *machine, uint32_t page) {
+    uint8_t bytes[IMAGE_PAGE_BYTES] = { 0 };
+    const uint32_t *words = machine->mem + (size_t)page * PAGE_WORDS;
+    const uint32_t count = page_words(machine->mem_size, page);
+    if (host_little_endian()) {
+        memcpy(bytes, words, 4 * (size_t)count);
+    } else {
+        for (uint32_t i = 0; i < count; ++i)
+            put32(bytes + 4 * i, words[i]);
+    }
+    return fwrite(bytes, 1, sizeof(bytes), f) == sizeof(bytes);
+}
+
+enum image_error m_save_image(const Machine *machine, const char *path,
+                              const ImageInfo *info) {
+    // only pages with something in them are stored
+    const uint32_t total = num_pages(machine->mem_size);
+    uint32_t *index = malloc(sizeof(uint32_t) * ((size_t)total + 1));
+    if (index == NULL)
+        return IMAGE_NO_MEMORY;
+    uint32_t count = 0;
+    for (uint32_t page = 0; page < total; ++page) {
+        const uint32_t *words = machine->mem + (size_t)page * PAGE_WORDS;
+        uint32_t bits = 0;
+        for (uint32_t i = 0; i < page_words(machine->mem_size, page); ++i)
+            bits |= words[i];
+        if (bits != 0)
+            index[count++] = page;
+    }
+
+    char temp[MAX_PATH_BYTES];
+    const int n = snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)process_id());
+    FILE *f = n > 0 && n < (int)sizeof(temp) ? fopen(temp, "wb") : NULL;
+    if (f == NULL) {
+        free(index);
+        return IMAGE_CANT_WRITE;
+    }
+
+    bool ok = write_head(f, machine, info, index, count);
+    for (uint32_t i = 0; ok && i < count; ++i)
+        ok = write_page(f, machine, index[i]);
+    ok = fclose(f) == 0 && ok;
+    free(index);
+
+    // a checkpoint being replaced is never left half written
+    if (!ok || rename(temp, path) != 0) {
+        remove(temp);
+        return IMAGE_CANT_WRITE;
+    }
+    return IMAGE_OK;
+}
+
+
+#ifdef MIPS241_MMAP
+// Maps the stored pages over mem copy-on-write, a run of consecutive
+//   pages at a time. Returns false if this host can't.
+static bool map_pages(FILE *f, uint32_t *mem, const uint32_t *index, uint32_t count,
+                      uint64_t offset) {
+    if (!host_little_endian() || sysconf(_SC_PAGESIZE) != IMAGE_PAGE_BYTES)
+        return false;
+    const int fd = fileno(f);
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t run = 1;
+        while (i + run < count && index[i + run] == index[i] + run)
+            ++run;
+        void *at = mem + (size_t)index[i] * PAGE_WORDS;
+        if (mmap(at, (size_t)run * IMAGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd,
+                 (off_t)(offset + (uint64_t)i * IMAGE_PAGE_BYTES)) == MAP_FAILED)
+            return false;
+        i += run;
+    }
+    return true;
+}
+#endif
+
+// Reads the stored pages into mem
+static bool read_pages(FILE *f, uint32_t *mem, uint32_t mem_size,
+                       const uint32_t *index, uint32_t count, uint64_t offset) {
+    uint32_t page_buf[PAGE_WORDS];
+    if (seek_to(f, offset) != 0)
+        return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (fread(page_buf, 1, sizeof(page_buf), f) != sizeof(page_buf))
+            return false;
+        words_to_host(page_buf, PAGE_WORDS);
+        memcpy(mem + (size_t)index[i] * PAGE_WORDS, page_buf,
+               4 * (size_t)page_words(mem_size, index[i]));
+    }
+    return true;
+}
+
+// Reads and checks the page index after the header
+static enum image_error read_index(FILE *f, uint32_t *index, uint32_t count,
+                                   uint32_t total) {
+    if (fread(index, 4, count, f) != count)
+        return IMAGE_CORRUPT;
+    words_to_host(index, count);
+    for (uint32_t i = 0; i < count; ++i)
+        if (index[i] >= total || (i != 0 && index[i] <= index[i - 1]))
+            return IMAGE_CORRUPT;
+    return IMAGE_OK;
+}
+
+Machine *m_load_image(const char *path, ImageInfo *info, enum image_error *error) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        *error = IMAGE_CANT_OPEN;
+        return NULL;
+    }
+
+    uint8_t header[HEADER_BYTES];
+    uint32_t *index = NULL, *mem = NULL;
+    size_t mem_bytes = 0;
+    const size_t got = fread(header, 1, sizeof(header), f);
+    if (!m_is_image(header, got)) {
+        *error = IMAGE_NOT_AN_IMAGE;
+        goto fail;
+    }
+    if (got != sizeof(header)) {
+        *error = IMAGE_CORRUPT;
+        goto fail;
+    }
+    if (get32(header + 8) != IMAGE_VERSION || get32(header + 12) != 0) {
+        *error = IMAGE_BAD_VERSION;
+        goto fail;
+    }
+
+    const uint32_t mem_size = get32(header + 16);
+    const uint32_t count = get32(header + 168);
+    const uint64_t offset = get64(header + 176);
+    if (mem_size == 0 || count > num_pages(mem_size) || offset != pages_offset(count)) {
+        *error = IMAGE_CORRUPT;
+        goto fail;
+    }
+
+    index = malloc(sizeof(uint32_t) * ((size_t)count + 1));
+    mem_bytes = sizeof(uint32_t) * (size_t)mem_size;
+    mem = m_alloc_pages(mem_bytes);
+    if (index == NULL || mem == NULL) {
+        *error = IMAGE_NO_MEMORY;
+        goto fail;
+    }
+    if ((*error = read_index(f, index, count, num_pages(mem_size))) != IMAGE_OK)
+        goto fail;
+
+    // a file cut short would fault when its mapped pages are touched
+    if (seek_to(f, offset + (uint64_t)count * IMAGE_PAGE_BYTES - (count != 0)) != 0
+        || (count != 0 && fgetc(f) == EOF)) {
+        *error = IMAGE_CORRUPT;
+        goto fail;
+    }
+    bool loaded = false;
+#ifdef MIPS241_MMAP
+    loaded = map_pages(f, mem, index, count, offset);
+#endif
+    if (!loaded && !read_pages(f, mem, mem_size, index, count, offset)) {
+        *error = IMAGE_CORRUPT;
+        goto fail;
+    }
+    free(index);
+    fclose(f);
+
+    Machine *m = m_create(mem_size, mem);
+    m->pc = get32(header + 28);
+    m->hi = get32(header + 32);
+    m->lo = get32(header + 36);
+    for (int r = 0; r < NUM_REGISTERS; ++r)
+        m->registers[r] = get32(header + 40 + 4 * r);
+    if (info != NULL)
+        *info = (ImageInfo) { get32(header + 20), get32(header + 24) };
+    *error = IMAGE_OK;
+    return m;
+
+fail:
+    m_free_pages(mem, mem_bytes);
+    free(index);
+    fclose(f);
+    return NULL;
+}
+
+
+const char *image_error_string(enum image_error error) {
+    switch (error) {
+        case IMAGE_OK: return "No error.";
+        case IMAGE_CANT_OPEN: return "Can't open the image.";
+        case IMAGE_CANT_WRITE: return "Can't write the image.";
+        case IMAGE_NOT_AN_IMAGE: return "Not a machine image.";
+        case IMAGE_BAD_VERSION: return "The image is from another version of mips241.";
+        case IMAGE_CORRUPT: return "The image is corrupt.";
+        case IMAGE_NO_MEMORY: return "Not enough memory for the image.";
+    }
+    return "Unknown image error.";
+}
@@ -0,0 +1,71 @@
+/**
+ * Machine images: a machine's registers, pc, hi, lo and memory in a file,
+ * to start from instead of loading a program, or to carry on a run from
+ * where it was saved, here or on another host.
+ *
+ * An image is little-endian throughout. It starts with a header
+ *     0    "MIPS241I"
+ *     8    version, IMAGE_VERSION
+ *     12   flags, 0 for now
+ *     16   memory size in words
+ *     20   entry point, where the program was first started
+ *     24   load offset, where the program was loaded
+ *     28   pc, hi, lo, then the 32 registers
+ *     168  the number of memory pages stored
+ *     172  0
+ *     176  the offset in the file of the first stored page, 64 bits
+ * followed by the index of each stored page, ascending, as 32 bit words.
+ * The pages themselves follow at their offset, each IMAGE_PAGE_BYTES
+ * long and aligned to it, in the same order. Pages that aren't stored
+ * are zero.
+ *
+ * Where the host allows, loading maps the stored pages copy-on-write
+ * rather than reading them, so it takes about as long for a big image as
+ * for a small one, and the machine only pays for the pages it writes.
+ * I/O channels aren't part of an image: a loaded machine reads standard
+ * input and writes standard output, like a new one.
+ */
+#ifndef IMAGE_H__
+#define IMAGE_H__
+
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+#define IMAGE_VERSION 1
+#define IMAGE_PAGE_BYTES 4096
+
+enum image_error {
+    IMAGE_OK,
+    IMAGE_CANT_OPEN,
+    IMAGE_CANT_WRITE,
+    IMAGE_NOT_AN_IMAGE,
+    IMAGE_BAD_VERSION,
+    IMAGE_CORRUPT,          // cut short or inconsistent
+    IMAGE_NO_MEMORY
+};
+
+// What an image says about the program in it, besides the machine state
+typedef struct ImageInfo {
+    uint32_t entry;
+    uint32_t load_offset;
+} ImageInfo;
+
+// Writes the machine's state to an image at path, replacing any file
+//   there only once the image is complete. info may be NULL, for zeros.
+//   Output the machine has buffered isn't part of it, so flush that first.
+mips241_EXPORT enum image_error m_save_image(const Machine *machine, const char *path,
+                                             const ImageInfo *info);
+
+// Returns a new machine in the state an image at path holds, filling in
+//   info unless it's NULL, or returns NULL and sets *error.
+//   Free it with destroy_machine.
+mips241_EXPORT Machine *m_load_image(const char *path, ImageInfo *info,
+                                     enum image_error *error);
+
+// Returns whether the len bytes at start look like the start of an image.
+mips241_EXPORT bool m_is_image(const uint8_t *start, size_t len);
+
+mips241_EXPORT const char *image_error_string(enum image_error error);
+
+#endif
@@ -4,9 +4,14 @@
 #include "common/defs.h"
 #include "machine/impl.h"
 #include "machine/machine.h"
+#include "machine/debug.h"
 #include "machine/decode.h"
+#include "machine/engine.h"
+#include "machine/io.h"
 #include "util/util.h"
 
+#define PREDECODE_GROUP 64 // words decoded together on a miss
+
 // Macros
 #define R_REG(REGISTER) machine->registers[ins.decoded.r.REGISTER]
 #define I_REG(REGISTER) machine->registers[ins.decoded.i.REGISTER]
@@ -16,10 +21,6 @@
 #define make_signed(X) \
        (int32_t)( (X > INT32_MAX) ? X - UINT32_MAX - 1 : X )
 
-// Constants
-static const uint32_t MAPPED_INPUT_ADDR = 0xFFFF000C;
-static const uint32_t MAPPED_OUTPUT_ADDR = 0xFFFF0004;
-
 // Execute one instruction as pointed to by pc.
 // Effects: machine state is modified
 EmulatorStatus step_machine(Machine *const machine) {
@@ -33,8 +34,37 @@ EmulatorStatus step_machine(Machine *const machine) {
     if (machine->pc == RETURN_ADDRESS)
         return (EmulatorStatus) {IR_DONE, machine->pc};
 
-    // Fetch and decode
-    const Instruction ins = decode_instruction(machine->mem[machine->pc / 4]);
+    if (machine->pc / 4 >= machine->mem_size)
+        return (EmulatorStatus) {IR_OUT_OF_RANGE_INSTRUCTION_FETCH, machine->pc};
+
+    // Fetch and decode, going through the predecode cache if we have one
+    const uint32_t word_idx = machine->pc / 4;
+    //   Breakpoints are marked in it, and only ever stop us here.
+    Instruction ins;
+    if (machine->decoded == NULL) {
+        ins = decode_instruction(machine->mem[word_idx]);
+        if (debug_breakpoint_at(machine->debug, word_idx))
+            ins.type = TYPE_BREAK;
+    } else {
+        ins = machine->decoded[word_idx];
+        if (ins.type == TYPE_INVALID) {
+            // code tends to run on, so decode its neighbours with it
+            const uint32_t group = word_idx & ~(uint32_t)(PREDECODE_GROUP - 1);
+            m_predecode_range(machine, group,
+                              machine->mem_size - group < PREDECODE_GROUP
+                                  ? machine->mem_size - group : PREDECODE_GROUP);
+            ins = machine->decoded[word_idx];
+        }
+    }
+
+    // running again from a stop runs what we stopped before
+    bool resumed = false;
+    if (ins.type == TYPE_BREAK) {
+        if (!debug_resume(machine->debug, machine->pc))
+            return debug_stop(machine, machine->pc, false, 0);
+        resumed = true;
+        ins = decode_instruction(machine->mem[word_idx]);
+    }
     machine->pc += 4;
 
     // because I don't want to indent more
@@ -64,7 +94,7 @@ DO_RTYPE:;
 
         case FUNC_MULTU:
         {
-            const uint64_t result = (int64_t)R_REG(s) * R_REG(t);
+            const uint64_t result = (uint64_t)R_REG(s) * R_REG(t);
             machine->hi = result >> 32;
             machine->lo = result & 0xFFFFFFFF;
             break;
@@ -80,15 +110,13 @@ DO_RTYPE:;
 
         case FUNC_DIV:
         {
-            machine->lo = make_signed(R_REG(s)) / make_signed(R_REG(t));
-            machine->hi = make_signed(R_REG(s)) % make_signed(R_REG(t));
+            m_div(R_REG(s), R_REG(t), &machine->hi, &machine->lo);
             break;
         }
 
         case FUNC_DIVU:
         {
-            machine->lo = R_REG(s) / R_REG(t);
-            machine->hi = R_REG(s) % R_REG(t);
+            m_divu(R_REG(s), R_REG(t), &machine->hi, &machine->lo);
             break;
         }
 
@@ -106,6 +134,8 @@ DO_RTYPE:;
 
         case FUNC_LIS:
         {
+            if (machine->pc / 4 >= machine->mem_size)
+                return (EmulatorStatus) {IR_OUT_OF_RANGE_INSTRUCTION_FETCH, machine->pc};
             R_REG(d) = machine->mem[machine->pc / 4];
             machine->pc += 4;
             break;
@@ -134,60 +164,117 @@ DO_RTYPE:;
             const uint32_t temp = R_REG(s);
             M_REG(31) = machine->pc;
             machine->pc = temp;
+            machine->stats.calls++;
             break;
         }
+
+        default:
+            return (EmulatorStatus) {IR_INVALID_INSTRUCTION, machine->pc - 4};
     }
     goto FINISH;
 
 DO_ITYPE:;
     const int16_t immediate = ins.decoded.i.imm;
-    const int64_t byte_addr = (I_REG(s) + immediate);
-    const int64_t word_addr = byte_addr / 4;
+    const uint32_t byte_addr = I_REG(s) + immediate;
+    const uint32_t word_addr = byte_addr / 4;
 
     // check for bad memory access and return accordingly
     if (ins.code == OP_LW || ins.code == OP_SW) {
-        if (word_addr < 0 || word_addr >= machine->mem_size) {
+        const bool mapped =
+            (ins.code == OP_LW && byte_addr == MAPPED_INPUT_ADDR)
+            || (ins.code == OP_SW && byte_addr == MAPPED_OUTPUT_ADDR);
+        if (!mapped && word_addr >= machine->mem_size) {
             return (EmulatorStatus) {IR_OUT_OF_RANGE_MEMORY_ACCESS, byte_addr};
         }
-        if (byte_addr % 4 == 0) {
+        if (byte_addr % 4 != 0) {
             return (EmulatorStatus) {IR_UNALIGNED_MEMORY_ACCESS, byte_addr};
         }
+        if (machine->debug != NULL && !mapped && !resumed
+            && machine->debug->num_watchpoints != 0
+            && debug_watch_hit(machine->debug, byte_addr,
+                               ins.code == OP_LW ? WATCH_READ : WATCH_WRITE)
+            && !debug_resume(machine->debug, machine->pc - 4))
+            return debug_stop(machine, machine->pc - 4, true, byte_addr);
     }
 
     switch (ins.code) {
         case OP_LW:
             if (byte_addr == MAPPED_INPUT_ADDR) {
                 // TODO: does the reference emulator do this?
-                int c = getchar();
-                if (c != EOF)
+                int c = m_io_getc(machine);
+                // try again once there's more to read
+                if (c == IO_WOULD_BLOCK) {
+                    machine->pc -= 4;
+                    // without stopping at its breakpoint again
+                    if (resumed) {
+                        machine->debug->resuming = true;
+                        machine->debug->resume_pc = machine->pc;
+                    }
+                    return (EmulatorStatus) {IR_INPUT_WAIT, machine->pc};
+                }
+                if (c != EOF) {
                     machine->registers[ins.decoded.i.t] = c;
+                    machine->stats.input_bytes++;
+                }
             } else {
                 I_REG(t) = machine->mem[word_addr];
             }
+            machine->stats.loads++;
             break;
         case OP_SW:
-            if (byte_addr == MAPPED_OUTPUT_ADDR)
-                printf("%c", (char) (I_REG(t) & 0xFF));
-            else
+            if (byte_addr == MAPPED_OUTPUT_ADDR) {
+                m_io_putc(machine, (uint8_t) (I_REG(t) & 0xFF));
+                machine->stats.output_bytes++;
+            } else {
                 machine->mem[word_addr] = I_REG(t);
-
+                m_invalidate_word(machine, word_addr);
+            }
+            machine->stats.stores++;
             break;
         case OP_BEQ:
-            machine->pc += (immediate * 4 * I_REG(s) == I_REG(t));
-            break;
         case OP_BNE:
-            machine->pc += (immediate * 4 * I_REG(s) != I_REG(t));
+        {
+            const bool taken = (I_REG(s) == I_REG(t)) == (ins.code == OP_BEQ);
+            machine->pc += taken * immediate * 4;
+            machine->stats.branches_taken += taken;
+            machine->stats.branches_not_taken += !taken;
+            break;
+        }
+        default:
+            return (EmulatorStatus) {IR_INVALID_INSTRUCTION, machine->pc - 4};
     }
 
 FINISH:
     machine->registers[0] = 0;
+    machine->stats.retired++;
     return (EmulatorStatus) {IR_SUCCESS, machine->pc};
 }
 
 EmulatorStatus step_machine_loop(Machine *const machine) {
+    const uint64_t start = m_now_ns();
     EmulatorStatus status;
+#if defined(MIPS241_ENGINE_THREADED)
+    status = run_threaded(machine);
+#elif defined(MIPS241_ENGINE_BLOCK)
+    uint64_t retired;
+    status = run_blocks(machine, UINT64_MAX, &retired);
+#else
     do status = step_machine(machine);
     while (status.retcode == IR_SUCCESS);
+#endif
+
+    m_flush_output(machine);
+    machine->stats.wall_ns += m_now_ns() - start;
+    return status;
+}
 
+EmulatorStatus step_machine_n(Machine *const machine, uint64_t budget,
+                              uint64_t *retired) {
+    // only the block engine keeps count, so it runs budgeted code
+    //   whatever MIPS241_ENGINE is
+    const uint64_t start = m_now_ns();
+    const EmulatorStatus status = run_blocks(machine, budget, retired);
+    m_flush_output(machine);
+    machine->stats.wall_ns += m_now_ns() - start;
     return status;
 }
@@ -10,11 +10,39 @@
 
 struct Machine;
 
-// Interpet one instruction and advance the machine state
+// Interpet one instruction and advance the machine state.
+//   Output from the program is buffered, see m_flush_output.
 mips241_EXPORT EmulatorStatus step_machine(struct Machine *const machine);
 
 // Interpet as many instructions as we can until
 //   we are required to stop.
 mips241_EXPORT EmulatorStatus step_machine_loop(struct Machine *const machine);
 
+// Like step_machine_loop, but stops with IR_BUDGET_EXHAUSTED once budget
+//   instructions have retired. Sets *retired to the number that did.
+mips241_EXPORT EmulatorStatus step_machine_n(struct Machine *const machine,
+                                             uint64_t budget, uint64_t *retired);
+
+// div: dividing by zero leaves hi and lo alone, and INT32_MIN / -1 gives
+//   INT32_MIN remainder 0, rather than trapping on the host
+static inline void m_div(uint32_t s, uint32_t t, uint32_t *hi, uint32_t *lo) {
+    if (t == 0)
+        return;
+    if (s == 0x80000000u && t == 0xFFFFFFFFu) {
+        *lo = s;
+        *hi = 0;
+        return;
+    }
+    *lo = (uint32_t)((int32_t)s / (int32_t)t);
+    *hi = (uint32_t)((int32_t)s % (int32_t)t);
+}
+
+// divu: dividing by zero leaves hi and lo alone
+static inline void m_divu(uint32_t s, uint32_t t, uint32_t *hi, uint32_t *lo) {
+    if (t == 0)
+        return;
+    *lo = s / t;
+    *hi = s % t;
+}
+
 #endif
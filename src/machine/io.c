@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "util/util.h"
+#include "machine/io.h"
+
+MachineIO *io_create(void) {
+    MachineIO *io = calloc(1, sizeof(MachineIO));
+    if (io == NULL)
+        return NULL;
+    io->out_buf = malloc(IO_BUFFER_BYTES);
+    io->in_buf = malloc(IO_BUFFER_BYTES);
+    if (io->out_buf == NULL || io->in_buf == NULL) {
+        free(io->out_buf);
+        free(io->in_buf);
+        free(io);
+        return NULL;
+    }
+
+    io->out_kind = IO_OUTPUT_FD;
+    io->out_fd = 1;
+    io->out_cap = IO_BUFFER_BYTES;
+    io->in_kind = IO_INPUT_FD;
+    io->in_fd = 0;
+    io->in_cap = IO_BUFFER_BYTES;
+    return io;
+}
+
+
+// Writes out everything pending, giving up on it if the fd won't take it
+static void flush_fd(MachineIO *io) {
+    size_t done = 0;
+    while (done < io->out_len) {
+        const long n = (long)write(io->out_fd, io->out_buf + done,
+                                   io->out_len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    io->out_len = 0;
+}
+
+static void flush(MachineIO *io) {
+    switch (io->out_kind) {
+        case IO_OUTPUT_FD:
+            flush_fd(io);
+            break;
+        case IO_OUTPUT_CALLBACK:
+            if (io->out_len != 0)
+                io->out_fn(io->out_ctx, io->out_buf, io->out_len);
+            io->out_len = 0;
+            break;
+        case IO_OUTPUT_CAPTURE:
+            break;
+    }
+}
+
+void io_destroy(MachineIO *io) {
+    if (io != NULL) {
+        flush(io);
+        free(io->out_buf);
+        free(io->in_buf);
+        free(io);
+    }
+}
+
+
+void io_output_full(Machine *machine) {
+    MachineIO *const io = machine->io;
+    if (io->out_kind != IO_OUTPUT_CAPTURE) {
+        flush(io);
+        return;
+    }
+
+    const size_t cap = io->out_cap * 2;
+    uint8_t *const buf = realloc(io->out_buf, cap);
+    give_up_unless(buf != NULL, "Can't grow the captured output. Bye.",
+                   EXIT_FAILURE, machine);
+    io->out_buf = buf;
+    io->out_cap = cap;
+}
+
+int io_refill(Machine *machine) {
+    MachineIO *const io = machine->io;
+    long n = 0;
+
+    // the program may be waiting on a prompt it just wrote
+    flush(io);
+    switch (io->in_kind) {
+        case IO_INPUT_FD:
+            do n = (long)read(io->in_fd, io->in_buf, io->in_cap);
+            while (n < 0 && errno == EINTR);
+            break;
+        case IO_INPUT_CALLBACK:
+            n = (long)io->in_fn(io->in_ctx, io->in_buf, io->in_cap);
+            break;
+        case IO_INPUT_BUFFER:
+            return EOF;
+        case IO_INPUT_FEED:
+            return io->in_closed ? EOF : IO_WOULD_BLOCK;
+    }
+    if (n <= 0)
+        return EOF;
+
+    io->in_pos = 1;
+    io->in_len = (size_t)n;
+    return io->in_buf[0];
+}
+
+
+void m_flush_output(Machine *machine) {
+    flush(machine->io);
+}
+
+// Switches to a new kind of output, sending what's pending to the old one
+static void set_output(MachineIO *io, enum io_output_kind kind) {
+    flush(io);
+    io->out_len = 0;
+    io->out_kind = kind;
+}
+
+void m_output_to_fd(Machine *machine, int fd) {
+    set_output(machine->io, IO_OUTPUT_FD);
+    machine->io->out_fd = fd;
+}
+
+void m_output_to_callback(Machine *machine, MachineWriteFn fn, void *ctx) {
+    set_output(machine->io, IO_OUTPUT_CALLBACK);
+    machine->io->out_fn = fn;
+    machine->io->out_ctx = ctx;
+}
+
+void m_output_capture(Machine *machine) {
+    if (machine->io->out_kind != IO_OUTPUT_CAPTURE)
+        set_output(machine->io, IO_OUTPUT_CAPTURE);
+}
+
+const uint8_t *m_captured_output(const Machine *machine, size_t *len) {
+    const MachineIO *const io = machine->io;
+    *len = io->out_kind == IO_OUTPUT_CAPTURE ? io->out_len : 0;
+    return io->out_buf;
+}
+
+void m_clear_captured_output(Machine *machine) {
+    if (machine->io->out_kind == IO_OUTPUT_CAPTURE)
+        machine->io->out_len = 0;
+}
+
+
+// Switches to a new kind of input, dropping anything read ahead
+static void set_input(Machine *machine, enum io_input_kind kind, size_t cap) {
+    MachineIO *const io = machine->io;
+    if (io->in_cap != cap) {
+        uint8_t *const buf = realloc(io->in_buf, cap);
+        give_up_unless(buf != NULL, "Can't allocate the input buffer. Bye.",
+                       EXIT_FAILURE, machine);
+        io->in_buf = buf;
+        io->in_cap = cap;
+    }
+    io->in_kind = kind;
+    io->in_pos = io->in_len = 0;
+    io->in_closed = false;
+}
+
+void m_input_from_fd(Machine *machine, int fd) {
+    set_input(machine, IO_INPUT_FD, IO_BUFFER_BYTES);
+    machine->io->in_fd = fd;
+}
+
+void m_input_from_callback(Machine *machine, MachineReadFn fn, void *ctx) {
+    set_input(machine, IO_INPUT_CALLBACK, IO_BUFFER_BYTES);
+    machine->io->in_fn = fn;
+    machine->io->in_ctx = ctx;
+}
+
+void m_input_from_buffer(Machine *machine, const uint8_t *bytes, size_t len) {
+    // realloc(buf, 0) may free it
+    set_input(machine, IO_INPUT_BUFFER, len != 0 ? len : 1);
+    if (len != 0)
+        memcpy(machine->io->in_buf, bytes, len);
+    machine->io->in_len = len;
+}
+
+void m_input_from_feed(Machine *machine) {
+    set_input(machine, IO_INPUT_FEED, IO_BUFFER_BYTES);
+}
+
+void m_feed_input(Machine *machine, const uint8_t *bytes, size_t len) {
+    MachineIO *const io = machine->io;
+    if (io->in_kind != IO_INPUT_FEED || io->in_closed || len == 0)
+        return;
+
+    // drop what's been read, then grow to fit the rest
+    memmove(io->in_buf, io->in_buf + io->in_pos, io->in_len - io->in_pos);
+    io->in_len -= io->in_pos;
+    io->in_pos = 0;
+    if (len > io->in_cap - io->in_len) {
+        size_t cap = io->in_cap;
+        while (len > cap - io->in_len)
+            cap *= 2;
+        uint8_t *const buf = realloc(io->in_buf, cap);
+        give_up_unless(buf != NULL, "Can't grow the input buffer. Bye.",
+                       EXIT_FAILURE, machine);
+        io->in_buf = buf;
+        io->in_cap = cap;
+    }
+    memcpy(io->in_buf + io->in_len, bytes, len);
+    io->in_len += len;
+}
+
+void m_close_input(Machine *machine) {
+    if (machine->io->in_kind == IO_INPUT_FEED)
+        machine->io->in_closed = true;
+}
@@ -0,0 +1,134 @@
+/**
+ * Per-Machine channels behind the memory mapped I/O addresses.
+ *
+ * A store to MAPPED_OUTPUT_ADDR appends a byte to the machine's output
+ * buffer. By default the buffer is written to stdout in bulk, but it can
+ * go to any fd, be handed to a callback, or be captured in memory for the
+ * caller to read back. A load from MAPPED_INPUT_ADDR takes a byte from the
+ * machine's input, which is stdin by default and can be any fd, a copy of
+ * a byte buffer, or a callback. It can also be a feed the caller adds to
+ * as it goes: a load from it with nothing there stops the run with
+ * IR_INPUT_WAIT before the lw, which runs again once there's more to
+ * read or the feed is closed.
+ *
+ * Buffered output is flushed when the buffer fills, before waiting on
+ * input from an fd or callback, whenever step_machine_loop or
+ * step_machine_n return, and when the machine is destroyed.
+ */
+#ifndef IO_H__
+#define IO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+#define IO_BUFFER_BYTES 65536
+#define IO_WOULD_BLOCK (-2) // from m_io_getc, when a feed is empty
+
+// Reads up to cap bytes into buf, returning how many were read.
+//   Returning 0 means end of input.
+typedef size_t (*MachineReadFn)(void *ctx, uint8_t *buf, size_t cap);
+
+// Takes len bytes of output.
+typedef void (*MachineWriteFn)(void *ctx, const uint8_t *bytes, size_t len);
+
+enum io_output_kind { IO_OUTPUT_FD, IO_OUTPUT_CALLBACK, IO_OUTPUT_CAPTURE };
+enum io_input_kind { IO_INPUT_FD, IO_INPUT_CALLBACK, IO_INPUT_BUFFER, IO_INPUT_FEED };
+
+typedef struct MachineIO {
+    enum io_output_kind out_kind;
+    int out_fd;
+    MachineWriteFn out_fn;
+    void *out_ctx;
+    uint8_t *out_buf;   // pending output, or everything captured so far
+    size_t out_len;
+    size_t out_cap;
+
+    enum io_input_kind in_kind;
+    int in_fd;
+    MachineReadFn in_fn;
+    void *in_ctx;
+    uint8_t *in_buf;    // input read ahead, or the whole input buffer
+    size_t in_pos;
+    size_t in_len;
+    size_t in_cap;
+    bool in_closed;     // for a feed, whether more can come
+} MachineIO;
+
+// Returns channels connected to stdin and stdout.
+MachineIO *io_create(void);
+
+// Flushes and frees the channels.
+void io_destroy(MachineIO *io);
+
+// Slow paths of m_io_putc and m_io_getc.
+void io_output_full(Machine *machine);
+int io_refill(Machine *machine);
+
+
+// Sends all buffered output on its way. Does nothing when capturing.
+mips241_EXPORT void m_flush_output(Machine *machine);
+
+// Sends output to the file descriptor fd.
+mips241_EXPORT void m_output_to_fd(Machine *machine, int fd);
+
+// Hands output to fn in chunks.
+mips241_EXPORT void m_output_to_callback(Machine *machine, MachineWriteFn fn,
+                                         void *ctx);
+
+// Keeps all output in memory, to be read with m_captured_output.
+mips241_EXPORT void m_output_capture(Machine *machine);
+
+// Returns the output captured so far and sets *len to its length.
+//   The pointer is good until the machine runs or its output changes.
+mips241_EXPORT const uint8_t *m_captured_output(const Machine *machine,
+                                                size_t *len);
+
+// Forgets all captured output.
+mips241_EXPORT void m_clear_captured_output(Machine *machine);
+
+// Reads input from the file descriptor fd.
+mips241_EXPORT void m_input_from_fd(Machine *machine, int fd);
+
+// Reads input from fn, which is called for more as needed.
+mips241_EXPORT void m_input_from_callback(Machine *machine, MachineReadFn fn,
+                                          void *ctx);
+
+// Reads input from a copy of the len bytes at bytes, then sees EOF.
+mips241_EXPORT void m_input_from_buffer(Machine *machine, const uint8_t *bytes,
+                                        size_t len);
+
+
+// Reads input fed in with m_feed_input, starting with none.
+mips241_EXPORT void m_input_from_feed(Machine *machine);
+
+// Adds len bytes to the end of a feed's input. Does nothing unless input
+//   is from an open feed.
+mips241_EXPORT void m_feed_input(Machine *machine, const uint8_t *bytes, size_t len);
+
+// Closes a feed, so that once what's in it is read, loads see EOF rather
+//   than waiting.
+mips241_EXPORT void m_close_input(Machine *machine);
+
+
+// Writes a byte of output for the program.
+static inline void m_io_putc(Machine *const machine, uint8_t c) {
+    MachineIO *const io = machine->io;
+    if (io->out_len == io->out_cap)
+        io_output_full(machine);
+    io->out_buf[io->out_len++] = c;
+}
+
+// Reads a byte of input for the program, or returns EOF, or
+//   IO_WOULD_BLOCK if it's from a feed with nothing in it yet.
+static inline int m_io_getc(Machine *const machine) {
+    MachineIO *const io = machine->io;
+    if (io->in_pos < io->in_len)
+        return io->in_buf[io->in_pos++];
+    return io_refill(machine);
+}
+
+#endif
@@ -0,0 +1,634 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/defs.h"
+#include "machine/block.h"
+#include "machine/jit.h"
+#include "machine/machine.h"
+
+#if defined(MIPS241_JIT) && defined(__x86_64__) \
+    && (defined(__unix__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_BYTES (16 * 1024 * 1024)
+// no single block compiles to more than this
+#define JIT_MAX_BLOCK_BYTES (MAX_BLOCK_OPS * 256 + 512)
+
+struct JitBuffer {
+    uint8_t *base;
+    size_t used;
+};
+
+
+JitBuffer *jit_create(void) {
+    JitBuffer *jit = malloc(sizeof(JitBuffer));
+    if (jit == NULL)
+        return NULL;
+
+    void *base = mmap(NULL, JIT_BUFFER_BYTES, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->base = base;
+    jit->used = 0;
+    return jit;
+}
+
+
+void jit_destroy(JitBuffer *jit) {
+    if (jit != NULL) {
+        munmap(jit->base, JIT_BUFFER_BYTES);
+        free(jit);
+    }
+}
+
+
+void jit_reset(JitBuffer *jit) {
+    jit->used = 0;
+}
+
+
+/*
+ * Code emission. Compiled blocks are called as
+ *     uint32_t code(Machine *machine, uint64_t *retired, uint64_t limit)
+ * and keep machine in rbx, machine->mem in r12, limit in r13 and
+ * retired in r14. The other counts in machine->stats are added to
+ * directly on the way out.
+ * eax, ecx and edx are scratch. Guest registers live in machine->registers.
+ */
+
+typedef struct Emitter {
+    uint8_t *p;
+    uint8_t *start;  // of the block, for self loops
+    uint8_t *top;    // first instruction after the prologue
+    const Machine *machine;
+    const BlockCache *cache;
+    const Block *block;
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t byte) {
+    *e->p++ = byte;
+}
+
+static void emit32(Emitter *e, uint32_t word) {
+    memcpy(e->p, &word, sizeof(word));
+    e->p += sizeof(word);
+}
+
+static void emit64(Emitter *e, uint64_t word) {
+    memcpy(e->p, &word, sizeof(word));
+    e->p += sizeof(word);
+}
+
+// Displacements of machine fields from rbx
+#define REG_DISP(R) ((uint32_t)(offsetof(Machine, registers) + 4 * (R)))
+#define PC_DISP ((uint32_t)offsetof(Machine, pc))
+#define HI_DISP ((uint32_t)offsetof(Machine, hi))
+#define LO_DISP ((uint32_t)offsetof(Machine, lo))
+#define STATS_DISP(FIELD) ((uint32_t)(offsetof(Machine, stats) + offsetof(MachineStats, FIELD)))
+
+enum { EAX = 0, ECX = 1, EDX = 2 };
+
+// <opcode> reg32, [rbx + disp32]
+static void emit_rbx_op(Emitter *e, uint8_t opcode, int reg, uint32_t disp) {
+    emit8(e, opcode);
+    emit8(e, 0x83 | (reg << 3));
+    emit32(e, disp);
+}
+
+#define LOAD(E, REG, DISP) emit_rbx_op(E, 0x8B, REG, DISP)
+#define STORE(E, REG, DISP) emit_rbx_op(E, 0x89, REG, DISP)
+#define ADD_EAX(E, DISP) emit_rbx_op(E, 0x03, EAX, DISP)
+#define SUB_EAX(E, DISP) emit_rbx_op(E, 0x2B, EAX, DISP)
+#define CMP_EAX(E, DISP) emit_rbx_op(E, 0x3B, EAX, DISP)
+
+// mov dword [rbx + disp32], imm32
+static void emit_store_imm(Emitter *e, uint32_t disp, uint32_t imm) {
+    emit8(e, 0xC7);
+    emit8(e, 0x83);
+    emit32(e, disp);
+    emit32(e, imm);
+}
+
+// Stores eax into guest register r, dropping writes to $0
+static void emit_set_reg(Emitter *e, uint8_t r) {
+    if (r != 0)
+        STORE(e, EAX, REG_DISP(r));
+}
+
+static void emit_set_reg_imm(Emitter *e, uint8_t r, uint32_t imm) {
+    if (r != 0)
+        emit_store_imm(e, REG_DISP(r), imm);
+}
+
+// What the block has done by some point in it, to be counted on leaving
+typedef struct Ran {
+    uint32_t retired;
+    uint32_t loads;
+    uint32_t stores;
+    uint32_t taken;
+    uint32_t not_taken;
+    uint32_t calls;
+} Ran;
+
+// ran, and then all of op
+static Ran ran_after(Ran ran, const Op *op) {
+    ran.retired += op->count;
+    ran.loads += op_loads(op);
+    ran.stores += op_stores(op);
+    return ran;
+}
+
+// ran, and then just the store of op
+static Ran ran_store(Ran ran) {
+    ran.retired++;
+    ran.stores++;
+    return ran;
+}
+
+// add qword [rbx + disp32], imm32
+static void emit_count(Emitter *e, uint32_t disp, uint32_t count) {
+    if (count != 0) {
+        emit8(e, 0x48); emit8(e, 0x81); emit8(e, 0x83);
+        emit32(e, disp);
+        emit32(e, count);
+    }
+}
+
+// Adds everything but what retired to machine->stats
+static void emit_stats(Emitter *e, Ran ran) {
+    emit_count(e, STATS_DISP(loads), ran.loads);
+    emit_count(e, STATS_DISP(stores), ran.stores);
+    emit_count(e, STATS_DISP(branches_taken), ran.taken);
+    emit_count(e, STATS_DISP(branches_not_taken), ran.not_taken);
+    emit_count(e, STATS_DISP(calls), ran.calls);
+}
+
+// Leaves the block: sets pc unless pc_known is false, counts what
+//   ran and returns kind.
+static void emit_exit(Emitter *e, enum jit_exit kind, bool pc_known,
+                      uint32_t pc, Ran ran) {
+    if (pc_known)
+        emit_store_imm(e, PC_DISP, pc);
+    if (ran.retired != 0) {
+        emit8(e, 0x49); emit8(e, 0x81); emit8(e, 0x06); // add qword [r14], imm32
+        emit32(e, ran.retired);
+    }
+    emit_stats(e, ran);
+    emit8(e, 0xB8); emit32(e, kind);                    // mov eax, kind
+    emit8(e, 0x41); emit8(e, 0x5E);                     // pop r14
+    emit8(e, 0x41); emit8(e, 0x5D);                     // pop r13
+    emit8(e, 0x41); emit8(e, 0x5C);                     // pop r12
+    emit8(e, 0x5B);                                     // pop rbx
+    emit8(e, 0xC3);                                     // ret
+}
+
+// Emits a short conditional jump to be patched by emit_patch
+static uint8_t *emit_jcc8(Emitter *e, uint8_t cc) {
+    emit8(e, 0x70 | cc);
+    emit8(e, 0);
+    return e->p - 1;
+}
+
+static void emit_patch(Emitter *e, uint8_t *rel) {
+    *rel = (uint8_t)(e->p - (rel + 1));
+}
+
+// Short unconditional jump, patched by emit_patch
+static uint8_t *emit_jmp8(Emitter *e) {
+    emit8(e, 0xEB);
+    emit8(e, 0);
+    return e->p - 1;
+}
+
+// Near conditional jump, patched by emit_patch32
+static uint8_t *emit_jcc32(Emitter *e, uint8_t cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    emit32(e, 0);
+    return e->p - 4;
+}
+
+static void emit_patch32(Emitter *e, uint8_t *rel) {
+    const uint32_t distance = (uint32_t)(e->p - (rel + 4));
+    memcpy(rel, &distance, sizeof(distance));
+}
+
+// condition codes
+enum { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_S = 0x8 };
+
+// With the byte address in eax, bail out unless it is an aligned word in
+//   memory and not mapped_addr. Leaves the word index in rcx.
+static void emit_check_access(Emitter *e, uint32_t mapped_addr,
+                              uint32_t bail_pc, Ran ran) {
+    uint8_t *fail[3];
+    int num_fail = 0;
+
+    emit8(e, 0xA8); emit8(e, 0x03);                     // test al, 3
+    fail[num_fail++] = emit_jcc8(e, CC_NE);
+    if ((uint64_t)e->machine->mem_size * 4 > mapped_addr) {
+        emit8(e, 0x3D); emit32(e, mapped_addr);         // cmp eax, mapped_addr
+        fail[num_fail++] = emit_jcc8(e, CC_E);
+    }
+    emit8(e, 0x89); emit8(e, 0xC1);                     // mov ecx, eax
+    emit8(e, 0xC1); emit8(e, 0xE9); emit8(e, 0x02);     // shr ecx, 2
+    emit8(e, 0x81); emit8(e, 0xF9);                     // cmp ecx, mem_size
+    emit32(e, e->machine->mem_size);
+    fail[num_fail++] = emit_jcc8(e, CC_AE);
+
+    // jump over the bail out
+    uint8_t *ok = emit_jmp8(e);
+    for (int i = 0; i < num_fail; ++i)
+        emit_patch(e, fail[i]);
+    emit_exit(e, JIT_BAIL, true, bail_pc, ran);
+    emit_patch(e, ok);
+}
+
+// With the byte address in eax of an access verify_block proved safe,
+//   leaves the word index in rcx
+static void emit_word_index(Emitter *e) {
+    emit8(e, 0x89); emit8(e, 0xC1);                     // mov ecx, eax
+    emit8(e, 0xC1); emit8(e, 0xE9); emit8(e, 0x02);     // shr ecx, 2
+}
+
+// Checks the block's guard, bailing out to step its first instruction
+//   if it doesn't hold. It goes at top, as self loops skip run_blocks.
+static void emit_guard(Emitter *e) {
+    const BlockGuard *guard = &e->block->guard;
+    uint8_t *fail[MAX_GUARD_ASSUMED + 3];
+    int num_fail = 0;
+
+    LOAD(e, EAX, REG_DISP(30));
+    emit8(e, 0xA8); emit8(e, 0x03);                     // test al, 3
+    fail[num_fail++] = emit_jcc8(e, CC_NE);
+    for (uint8_t i = 0; i < guard->num_assumed; ++i) {
+        emit8(e, 0x81); emit8(e, 0xBB);                 // cmp dword [rbx + disp32], imm32
+        emit32(e, REG_DISP(guard->assumed_regs[i]));
+        emit32(e, guard->assumed_values[i]);
+        fail[num_fail++] = emit_jcc8(e, CC_NE);
+    }
+    emit8(e, 0x48); emit8(e, 0x8D); emit8(e, 0x88);     // lea rcx, [rax + lo]
+    emit32(e, (uint32_t)guard->lo);
+    emit8(e, 0x48); emit8(e, 0x85); emit8(e, 0xC9);     // test rcx, rcx
+    fail[num_fail++] = emit_jcc8(e, CC_S);
+    emit8(e, 0x48); emit8(e, 0x8D); emit8(e, 0x88);     // lea rcx, [rax + hi + 4]
+    emit32(e, (uint32_t)(guard->hi + 4));
+    emit8(e, 0x48); emit8(e, 0xBA);                     // mov rdx, limit
+    emit64(e, guard->limit);
+    emit8(e, 0x48); emit8(e, 0x39); emit8(e, 0xD1);     // cmp rcx, rdx
+    fail[num_fail++] = emit_jcc8(e, CC_A);
+
+    uint8_t *ok = emit_jmp8(e);
+    for (int i = 0; i < num_fail; ++i)
+        emit_patch(e, fail[i]);
+    emit_exit(e, JIT_BAIL, true, e->block->start, (Ran) { 0 });
+    emit_patch(e, ok);
+}
+
+// The store below takes predecoded entries to be 12 bytes with a 4 byte
+//   type first; this fails to compile if Instruction stops being that
+typedef char instruction_layout_check[sizeof(Instruction) == 12
+                                      && offsetof(Instruction, type) == 0
+                                      && sizeof(((Instruction *)0)->type) == 4 ? 1 : -1];
+
+// After a store to word rcx, mark its page dirty, drop its predecoded
+//   entry and leave if it was translated code.
+static void emit_store_done(Emitter *e, uint32_t next_pc, Ran ran) {
+    emit8(e, 0x48); emit8(e, 0xB8);                     // mov rax, dirty
+    emit64(e, (uint64_t)(uintptr_t)e->machine->dirty);
+    emit8(e, 0x89); emit8(e, 0xCA);                     // mov edx, ecx
+    emit8(e, 0xC1); emit8(e, 0xEA); emit8(e, DIRTY_PAGE_SHIFT); // shr edx, shift
+    emit8(e, 0xC6); emit8(e, 0x04); emit8(e, 0x10); emit8(e, 0x01); // mov byte [rax+rdx], 1
+    if (e->machine->decoded != NULL) {
+        emit8(e, 0x48); emit8(e, 0xB8);                 // mov rax, decoded
+        emit64(e, (uint64_t)(uintptr_t)e->machine->decoded);
+        emit8(e, 0x48); emit8(e, 0x8D); emit8(e, 0x14); emit8(e, 0x49); // lea rdx, [rcx+rcx*2]
+        emit8(e, 0xC7); emit8(e, 0x04); emit8(e, 0x90); emit32(e, TYPE_INVALID); // mov [rax+rdx*4]
+    }
+    emit8(e, 0x48); emit8(e, 0xB8);                     // mov rax, code bitmap
+    emit64(e, (uint64_t)(uintptr_t)e->cache->code);
+    emit8(e, 0x48); emit8(e, 0x0F); emit8(e, 0xA3); emit8(e, 0x08); // bt [rax], rcx
+    uint8_t *clean = emit_jcc8(e, CC_AE);               // jnc
+    emit_exit(e, JIT_FLUSH, true, next_pc, ran);
+    emit_patch(e, clean);
+}
+
+// mov eax, [r12 + rcx*4]
+static void emit_load_mem(Emitter *e) {
+    emit8(e, 0x41); emit8(e, 0x8B); emit8(e, 0x04); emit8(e, 0x8C);
+}
+
+// mov [r12 + rcx*4], edx
+static void emit_store_mem(Emitter *e) {
+    emit8(e, 0x41); emit8(e, 0x89); emit8(e, 0x14); emit8(e, 0x8C);
+}
+
+// hi:lo = rax * rcx, both already extended to 64 bits
+static void emit_mult_tail(Emitter *e) {
+    emit8(e, 0x48); emit8(e, 0x0F); emit8(e, 0xAF); emit8(e, 0xC1); // imul rax, rcx
+    STORE(e, EAX, LO_DISP);
+    emit8(e, 0x48); emit8(e, 0xC1); emit8(e, 0xE8); emit8(e, 0x20); // shr rax, 32
+    STORE(e, EAX, HI_DISP);
+}
+
+// eax = compare(s, t) as 0 or 1
+static void emit_set_compare(Emitter *e, const Op *op, uint8_t setcc) {
+    LOAD(e, EAX, REG_DISP(op->r[1]));
+    CMP_EAX(e, REG_DISP(op->r[2]));
+    emit8(e, 0x0F); emit8(e, setcc); emit8(e, 0xC0);    // setcc al
+    emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xC0);     // movzx eax, al
+    emit_set_reg(e, op->r[0]);
+}
+
+// Leaves for the branch target, looping in place if it's this block
+//   and the budget allows another full run.
+static void emit_goto(Emitter *e, uint32_t target, Ran ran) {
+    if (target == e->block->start) {
+        emit8(e, 0x49); emit8(e, 0x81); emit8(e, 0x06); // add qword [r14], imm32
+        emit32(e, ran.retired);
+        emit_stats(e, ran);
+        emit8(e, 0x49); emit8(e, 0x8B); emit8(e, 0x06); // mov rax, [r14]
+        emit8(e, 0x4C); emit8(e, 0x39); emit8(e, 0xE8); // cmp rax, r13
+        uint8_t *over_budget = emit_jcc32(e, CC_A);
+        emit8(e, 0xE9);                                 // jmp top
+        emit32(e, (uint32_t)(e->top - (e->p + 4)));
+        emit_patch32(e, over_budget);
+        emit_exit(e, JIT_NEXT, true, target, (Ran) { 0 });
+    } else {
+        emit_exit(e, JIT_NEXT, true, target, ran);
+    }
+}
+
+// Emits one op. Returns false if the op always leaves the block.
+static bool emit_op(Emitter *e, const Op *op, Ran ran) {
+    const Block *block = e->block;
+
+    switch ((OpKind)op->kind) {
+        case OPK_ADD:
+        case OPK_SUB:
+            LOAD(e, EAX, REG_DISP(op->r[1]));
+            if (op->kind == OPK_ADD)
+                ADD_EAX(e, REG_DISP(op->r[2]));
+            else
+                SUB_EAX(e, REG_DISP(op->r[2]));
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_MULT:
+            emit8(e, 0x48); emit_rbx_op(e, 0x63, EAX, REG_DISP(op->r[1])); // movsxd rax
+            emit8(e, 0x48); emit_rbx_op(e, 0x63, ECX, REG_DISP(op->r[2])); // movsxd rcx
+            emit_mult_tail(e);
+            return true;
+
+        case OPK_MULTU:
+            LOAD(e, EAX, REG_DISP(op->r[1]));
+            LOAD(e, ECX, REG_DISP(op->r[2]));
+            emit_mult_tail(e);
+            return true;
+
+        case OPK_DIV:
+        case OPK_DIVU:
+            // rare, and step_machine knows all about dividing
+            emit_exit(e, JIT_BAIL, true, op->pc, ran);
+            return false;
+
+        case OPK_MFHI:
+            LOAD(e, EAX, HI_DISP);
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_MFLO:
+            LOAD(e, EAX, LO_DISP);
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_LIS:
+            emit_set_reg_imm(e, op->r[0], op->imm);
+            return true;
+
+        case OPK_SLT:
+            emit_set_compare(e, op, 0x9C);                  // setl
+            return true;
+
+        case OPK_SLTU:
+            emit_set_compare(e, op, 0x92);                  // setb
+            return true;
+
+        case OPK_LW:
+            LOAD(e, EAX, REG_DISP(op->r[1]));
+            emit8(e, 0x05); emit32(e, op->imm);             // add eax, imm
+            emit_check_access(e, MAPPED_INPUT_ADDR, op->pc, ran);
+            emit_load_mem(e);
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_SW:
+            LOAD(e, EAX, REG_DISP(op->r[1]));
+            emit8(e, 0x05); emit32(e, op->imm);
+            emit_check_access(e, MAPPED_OUTPUT_ADDR, op->pc, ran);
+            LOAD(e, EDX, REG_DISP(op->r[0]));
+            emit_store_mem(e);
+            emit_store_done(e, op->pc + 4, ran_store(ran));
+            return true;
+
+        case OPK_LW_SAFE:
+            LOAD(e, EAX, REG_DISP(op->r[1]));
+            emit8(e, 0x05); emit32(e, op->imm);
+            emit_word_index(e);
+            emit_load_mem(e);
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_SW_SAFE:
+            LOAD(e, EAX, REG_DISP(op->r[1]));
+            emit8(e, 0x05); emit32(e, op->imm);
+            emit_word_index(e);
+            LOAD(e, EDX, REG_DISP(op->r[0]));
+            emit_store_mem(e);
+            emit_store_done(e, op->pc + 4, ran_store(ran));
+            return true;
+
+        case OPK_LIS_ADD:
+        case OPK_LIS_SUB:
+            emit_set_reg_imm(e, op->r[0], op->imm);
+            LOAD(e, EAX, REG_DISP(op->r[2]));
+            if (op->kind == OPK_LIS_ADD)
+                ADD_EAX(e, REG_DISP(op->r[3]));
+            else
+                SUB_EAX(e, REG_DISP(op->r[3]));
+            emit_set_reg(e, op->r[1]);
+            return true;
+
+        case OPK_PUSH:
+            LOAD(e, EAX, REG_DISP(30));
+            emit8(e, 0x05); emit32(e, (uint32_t)-4);
+            emit_check_access(e, MAPPED_OUTPUT_ADDR, op->pc, ran);
+            LOAD(e, EDX, REG_DISP(op->r[0]));
+            emit_store_mem(e);
+            // the store may have replaced the sub
+            emit_store_done(e, op->pc + 4, ran_store(ran));
+            LOAD(e, EAX, REG_DISP(30));
+            SUB_EAX(e, REG_DISP(op->r[1]));
+            STORE(e, EAX, REG_DISP(30));
+            return true;
+
+        case OPK_POP:
+            LOAD(e, EAX, REG_DISP(30));
+            ADD_EAX(e, REG_DISP(op->r[1]));
+            STORE(e, EAX, REG_DISP(30));
+            emit8(e, 0x05); emit32(e, (uint32_t)-4);
+            // the add has retired, the load goes the slow way
+            ran.retired++;
+            emit_check_access(e, MAPPED_INPUT_ADDR, op->pc + 4, ran);
+            emit_load_mem(e);
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_PUSH_SAFE:
+            LOAD(e, EAX, REG_DISP(30));
+            emit8(e, 0x05); emit32(e, (uint32_t)-4);
+            emit_word_index(e);
+            LOAD(e, EDX, REG_DISP(op->r[0]));
+            emit_store_mem(e);
+            emit_store_done(e, op->pc + 4, ran_store(ran));
+            LOAD(e, EAX, REG_DISP(30));
+            SUB_EAX(e, REG_DISP(op->r[1]));
+            STORE(e, EAX, REG_DISP(30));
+            return true;
+
+        case OPK_POP_SAFE:
+            LOAD(e, EAX, REG_DISP(30));
+            ADD_EAX(e, REG_DISP(op->r[1]));
+            STORE(e, EAX, REG_DISP(30));
+            emit8(e, 0x05); emit32(e, (uint32_t)-4);
+            emit_word_index(e);
+            emit_load_mem(e);
+            emit_set_reg(e, op->r[0]);
+            return true;
+
+        case OPK_BEQ:
+        case OPK_BNE:
+        {
+            LOAD(e, EAX, REG_DISP(op->r[0]));
+            CMP_EAX(e, REG_DISP(op->r[1]));
+            uint8_t *not_taken = emit_jcc32(e, op->kind == OPK_BEQ ? CC_NE : CC_E);
+            ran = ran_after(ran, op);
+            ran.taken++;
+            emit_goto(e, op->imm, ran);
+            emit_patch32(e, not_taken);
+            ran.taken--;
+            ran.not_taken++;
+            emit_goto(e, block->end, ran);
+            return false;
+        }
+
+        case OPK_JR:
+            LOAD(e, EAX, REG_DISP(op->r[0]));
+            STORE(e, EAX, PC_DISP);
+            emit_exit(e, JIT_NEXT, false, 0, ran_after(ran, op));
+            return false;
+
+        case OPK_JALR:
+            LOAD(e, EAX, REG_DISP(op->r[0]));
+            emit_store_imm(e, REG_DISP(31), block->end);
+            STORE(e, EAX, PC_DISP);
+            ran = ran_after(ran, op);
+            ran.calls++;
+            emit_exit(e, JIT_NEXT, false, 0, ran);
+            return false;
+
+        case OPK_LIS_JR:
+            emit_set_reg_imm(e, op->r[0], op->imm);
+            emit_exit(e, JIT_NEXT, true, op->imm, ran_after(ran, op));
+            return false;
+
+        case OPK_LIS_JALR:
+            emit_set_reg_imm(e, op->r[0], op->imm);
+            emit_store_imm(e, REG_DISP(31), block->end);
+            ran = ran_after(ran, op);
+            ran.calls++;
+            emit_exit(e, JIT_NEXT, true, op->imm, ran);
+            return false;
+
+        case OPK_FALL:
+            emit_goto(e, block->end, ran);
+            return false;
+    }
+    return false;
+}
+
+
+void jit_compile(JitBuffer *jit, Machine *machine,
+                 const BlockCache *cache, Block *block) {
+    if (jit->used + JIT_MAX_BLOCK_BYTES > JIT_BUFFER_BYTES)
+        return;
+    if (mprotect(jit->base, JIT_BUFFER_BYTES, PROT_READ | PROT_WRITE) != 0)
+        return;
+
+    Emitter e = {
+        .p = jit->base + jit->used,
+        .start = jit->base + jit->used,
+        .machine = machine,
+        .cache = cache,
+        .block = block
+    };
+
+    emit8(&e, 0x53);                                    // push rbx
+    emit8(&e, 0x41); emit8(&e, 0x54);                   // push r12
+    emit8(&e, 0x41); emit8(&e, 0x55);                   // push r13
+    emit8(&e, 0x41); emit8(&e, 0x56);                   // push r14
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB);  // mov rbx, rdi
+    emit8(&e, 0x49); emit8(&e, 0x89); emit8(&e, 0xF6);  // mov r14, rsi
+    emit8(&e, 0x49); emit8(&e, 0x89); emit8(&e, 0xD5);  // mov r13, rdx
+    emit8(&e, 0x4C); emit8(&e, 0x8B); emit8(&e, 0xA3);  // mov r12, [rbx + mem]
+    emit32(&e, (uint32_t)offsetof(Machine, mem));
+    e.top = e.p;
+    if (block->guard.on)
+        emit_guard(&e);
+
+    Ran ran = { 0 };
+    for (uint32_t i = 0; i < block->num_ops; ++i) {
+        if (!emit_op(&e, &block->ops[i], ran))
+            break;
+        ran = ran_after(ran, &block->ops[i]);
+    }
+
+    const size_t size = (size_t)(e.p - e.start);
+    // keep entry points aligned
+    jit->used += (size + 15) & ~(size_t)15;
+
+    if (mprotect(jit->base, JIT_BUFFER_BYTES, PROT_READ | PROT_EXEC) != 0)
+        return;
+
+    // ISO C has no way to turn data into a function, so copy the bits
+    const void *entry = e.start;
+    memcpy(&block->native, &entry, sizeof(block->native));
+}
+
+#else // no JIT on this host
+
+JitBuffer *jit_create(void) {
+    return NULL;
+}
+
+void jit_destroy(JitBuffer *jit) {
+    (void)jit;
+}
+
+void jit_reset(JitBuffer *jit) {
+    (void)jit;
+}
+
+void jit_compile(JitBuffer *jit, Machine *machine,
+                 const struct BlockCache *cache, struct Block *block) {
+    (void)jit; (void)machine; (void)cache; (void)block;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * An optional x86-64 JIT tier for hot translated blocks. Compiled code
+ * works directly on Machine.registers and Machine.mem, keeps every check
+ * step_machine does but the ones verify_block proved needless, and hands
+ * anything unusual (MMIO, faults, div) back to the interpreter before
+ * touching any state.
+ */
+#ifndef JIT_H__
+#define JIT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "machine/machine.h"
+
+struct Block;
+struct BlockCache;
+
+// how many times a block runs before it is compiled
+#define JIT_HOT_THRESHOLD 64
+
+// How compiled code left. In every case machine->pc is up to date
+//   and *retired has been increased by what was retired.
+enum jit_exit {
+    JIT_NEXT = 0,    // carry on at machine->pc
+    JIT_BAIL = 1,    // step_machine the instruction at machine->pc
+    JIT_FLUSH = 2    // a store hit translated code, flush the cache
+};
+
+// Compiled code loops back into its own block only while *retired is
+//   at most limit, so it can't run past an instruction budget.
+typedef uint32_t (*JitCode)(Machine *machine, uint64_t *retired, uint64_t limit);
+
+typedef struct JitBuffer JitBuffer;
+
+// Returns a new code buffer, or NULL if there is no JIT on this host
+//   or executable memory can't be had.
+JitBuffer *jit_create(void);
+
+void jit_destroy(JitBuffer *jit);
+
+// Forgets all compiled code. Blocks pointing into it must be gone.
+void jit_reset(JitBuffer *jit);
+
+// Compiles a block, setting block->native on success. Failing
+//   (the buffer is full) is harmless, the block stays interpreted.
+void jit_compile(JitBuffer *jit, Machine *machine,
+                 const struct BlockCache *cache, struct Block *block);
+
+#endif
@@ -1,11 +1,49 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "util/util.h"
 #include "machine/machine.h"
+#include "machine/block.h"
+#include "machine/byteorder.h"
+#include "machine/debug.h"
+#include "machine/decode.h"
+#include "machine/io.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MIPS241_MMAP
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
 
 // assign this to any machine that needs zeroing
 static const Machine zeroed_machine = { 0 };
 
+Machine *m_create(uint32_t num_words, uint32_t *mem) {
+    Machine *m = malloc(sizeof(Machine));
+    give_up_unless(m != NULL, "Bye bye memory", EXIT_FAILURE, m);
+    *m = zeroed_machine;
+
+    m->mem = mem != NULL ? mem : m_alloc_pages(sizeof(uint32_t) * (size_t)num_words);
+    give_up_unless(m->mem != NULL, "Can't even malloc. Bye.", EXIT_FAILURE, m);
+    m->mem_size = num_words;
+    m->clean_is_zero = mem == NULL;
+
+    m->dirty = m_alloc_pages(m_num_pages(m));
+    give_up_unless(m->dirty != NULL, "Can't even malloc. Bye.", EXIT_FAILURE, m);
+
+    m->io = io_create();
+    give_up_unless(m->io != NULL, "Can't set up I/O. Bye.", EXIT_FAILURE, m);
+
+    m_set_predecode(m, true);
+
+    return m;
+}
+
 Machine *init_machine(uint32_t max_memory_bytes) {
     give_up_unless(max_memory_bytes % 4 == 0,
                    "max_memory_bytes must be divisible by 4",
@@ -13,31 +51,200 @@ Machine *init_machine(uint32_t max_memory_bytes) {
                    NULL
                   );
 
-    Machine *m = malloc(sizeof(Machine));
-    give_up_unless(m != NULL, "Bye bye memory", EXIT_FAILURE, m);
-    *m = zeroed_machine;
-
     // avoiding branching because I wouldn't write C otherwise
     const uint32_t num_words =
         (max_memory_bytes == 0) * NUM_WORDS_MEMORY
         + (max_memory_bytes != 0) * (max_memory_bytes / 4);
 
-    m->mem = malloc(sizeof(uint32_t) * num_words);
-    give_up_unless(m->mem != NULL, "Can't even malloc. Bye.", EXIT_FAILURE, m);
-    m->mem_size = num_words;
+    return m_create(num_words, NULL);
+}
 
-    return m;
+Machine *init_machine_full(void) {
+    give_up_unless(sizeof(size_t) > sizeof(uint32_t),
+                   "The full address space needs a 64-bit host",
+                   EXIT_FAILURE,
+                   NULL
+                  );
+    return m_create(NUM_WORDS_FULL, NULL);
 }
 
 
 void destroy_machine(Machine *machine) {
     if (machine != NULL) {
-        free(machine->mem);
+        block_cache_destroy(machine->blocks);
+        io_destroy(machine->io);
+        debug_destroy(machine->debug, machine->mem_size);
+        m_clear_baseline(machine);
+        m_free_pages(machine->dirty, m_num_pages(machine));
+        m_free_pages(machine->decoded,
+                     sizeof(Instruction) * (size_t)machine->mem_size);
+        m_free_pages(machine->mem, sizeof(uint32_t) * (size_t)machine->mem_size);
         free(machine);
     }
 }
 
 
+void reset_machine(Machine *machine) {
+    if (machine->baseline != NULL || machine->clean_is_zero) {
+        m_restore_baseline(machine);
+    } else {
+        const size_t bytes = sizeof(uint32_t) * (size_t)machine->mem_size;
+
+        // any page may not be zero, so fresh pages rather than zeroing
+        //   these, which may be a clone's copy-on-write view of a snapshot
+        m_free_pages(machine->mem, bytes);
+        machine->mem = m_alloc_pages(bytes);
+        give_up_unless(machine->mem != NULL, "Can't even malloc. Bye.",
+                       EXIT_FAILURE, machine);
+        m_zero_pages(machine->dirty, m_num_pages(machine));
+        machine->clean_is_zero = true;
+
+        if (machine->blocks != NULL)
+            block_cache_flush(machine->blocks);
+        if (machine->decoded != NULL)
+            m_zero_pages(machine->decoded,
+                         sizeof(Instruction) * (size_t)machine->mem_size);
+
+        memset(machine->registers, 0, sizeof(machine->registers));
+        machine->pc = machine->hi = machine->lo = 0;
+    }
+    m_reset_stats(machine);
+    if (machine->debug != NULL)
+        machine->debug->resuming = false;
+}
+
+
+void m_set_predecode(Machine *machine, bool enabled) {
+    // compiled code knows where the cache is
+    if (machine->blocks != NULL)
+        block_cache_flush(machine->blocks);
+
+    if (enabled && machine->decoded == NULL) {
+        // zeroed memory is all TYPE_INVALID, meaning "not decoded yet"
+        machine->decoded =
+            m_alloc_pages(sizeof(Instruction) * (size_t)machine->mem_size);
+        give_up_unless(machine->decoded != NULL,
+                       "Can't allocate the predecode cache. Bye.",
+                       EXIT_FAILURE, machine);
+    } else if (!enabled) {
+        block_cache_destroy(machine->blocks);
+        machine->blocks = NULL;
+        m_free_pages(machine->decoded,
+                     sizeof(Instruction) * (size_t)machine->mem_size);
+        machine->decoded = NULL;
+    }
+}
+
+
+void *m_alloc_pages(size_t bytes) {
+#ifdef MIPS241_MMAP
+    // anonymous mappings are demand-zero
+    void *pages = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return pages == MAP_FAILED ? NULL : pages;
+#else
+    return calloc(bytes, 1);
+#endif
+}
+
+void m_free_pages(void *pages, size_t bytes) {
+    if (pages == NULL)
+        return;
+#ifdef MIPS241_MMAP
+    munmap(pages, bytes);
+#else
+    (void) bytes;
+    free(pages);
+#endif
+}
+
+
+void m_write_word(Machine *machine, uint32_t idx, uint32_t word) {
+    machine->mem[idx] = word;
+    m_invalidate_word(machine, idx);
+}
+
+
+bool m_write_words(Machine *machine, uint32_t idx, const void *bytes,
+                   size_t len, bool big_endian) {
+    const size_t num_words = len / 4;
+    if (idx > machine->mem_size || num_words > machine->mem_size - idx)
+        return false;
+    if (big_endian)
+        copy_words_be(machine->mem + idx, bytes, num_words);
+    else
+        memcpy(machine->mem + idx, bytes, num_words * 4);
+    m_invalidate_range(machine, idx, (uint32_t)num_words);
+    return true;
+}
+
+bool m_read_words(const Machine *machine, uint32_t idx, void *bytes,
+                  size_t len, bool big_endian) {
+    const size_t num_words = len / 4;
+    if (idx > machine->mem_size || num_words > machine->mem_size - idx)
+        return false;
+    if (big_endian)
+        copy_words_be(bytes, machine->mem + idx, num_words);
+    else
+        memcpy(bytes, machine->mem + idx, num_words * 4);
+    return true;
+}
+
+const uint32_t *m_memory_view(const Machine *machine, uint32_t *num_words) {
+    *num_words = machine->mem_size;
+    return machine->mem;
+}
+
+
+void m_zero_pages(void *pages, size_t bytes) {
+#if defined(MIPS241_MMAP) && defined(__linux__)
+    // whole pages can be dropped, and come back as zero when touched
+    const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    const uintptr_t start = (uintptr_t)pages;
+    const uintptr_t first = (start + page_size - 1) & ~(page_size - 1);
+    const uintptr_t last = (start + bytes) & ~(page_size - 1);
+    if (first < last && madvise((void *)first, last - first, MADV_DONTNEED) == 0) {
+        memset(pages, 0, first - start);
+        memset((void *)last, 0, start + bytes - last);
+        return;
+    }
+#endif
+    memset(pages, 0, bytes);
+}
+
+
+void m_invalidate_range(Machine *machine, uint32_t idx, uint32_t count) {
+    if (count != 0)
+        memset(machine->dirty + idx / DIRTY_PAGE_WORDS, 1,
+               (idx + count - 1) / DIRTY_PAGE_WORDS - idx / DIRTY_PAGE_WORDS + 1);
+    if (machine->decoded != NULL)
+        m_zero_pages(machine->decoded + idx, sizeof(Instruction) * (size_t)count);
+    // blocks elsewhere, like those of a program its input is copied
+    //   past, are still good
+    if (machine->blocks != NULL && block_cache_covers_range(machine->blocks, idx, count))
+        block_cache_flush(machine->blocks);
+}
+
+
+void m_predecode_range(Machine *machine, uint32_t idx, uint32_t count) {
+    enum { BATCH = 256 };
+    uint8_t type[BATCH], code[BATCH], s[BATCH], t[BATCH], d[BATCH];
+    int16_t imm[BATCH];
+    const DecodedTable table = { type, code, s, t, d, imm };
+    for (uint32_t done = 0; done < count; ) {
+        const uint32_t n = count - done < BATCH ? count - done : BATCH;
+        decode_instructions(machine->mem + idx + done, n, &table);
+        for (uint32_t i = 0; i < n; ++i) {
+            Instruction ins = decoded_table_get(&table, i);
+            if (debug_breakpoint_at(machine->debug, idx + done + i))
+                ins.type = TYPE_BREAK;
+            machine->decoded[idx + done + i] = ins;
+        }
+        done += n;
+    }
+}
+
+
 void m_print_registers(const Machine *const machine) {
     for (uint8_t i = 0; i < NUM_REGISTERS; ++i) {
         fprintf(stderr, "register %2d: 0x%08x\n", i, machine->registers[i]);
@@ -6,12 +6,39 @@
 #ifndef MACHINE_H__
 #define MACHINE_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include "common/defs.h"
 
 #define NUM_WORDS_MEMORY 4194304 // 16 MB of RAM by default
+#define NUM_WORDS_FULL 1073741824 // the whole 4 GB address space
 #define NUM_REGISTERS 32         // does not include pc, ir, lo, hi
 
+struct BlockCache;
+struct MachineIO;
+struct MachineDebug;
+struct MachineBaseline;
+
+// Writes to memory are tracked a page of 4 KB at a time
+#define DIRTY_PAGE_SHIFT 10
+#define DIRTY_PAGE_WORDS (1u << DIRTY_PAGE_SHIFT)
+
+// What a machine has done since it was made or reset. Every engine keeps
+//   these up to date, adding them up a block at a time where it can.
+typedef struct MachineStats {
+    uint64_t retired;
+    uint64_t loads;             // lw, including from mapped input
+    uint64_t stores;            // sw, including to mapped output
+    uint64_t branches_taken;    // beq and bne
+    uint64_t branches_not_taken;
+    uint64_t calls;             // jalr
+    uint64_t input_bytes;       // read from mapped input
+    uint64_t output_bytes;      // written to mapped output
+    uint64_t wall_ns;           // spent running, see m_now_ns
+} MachineStats;
+
 typedef struct Machine {
     uint32_t *mem;      // array of words of memory
     uint32_t mem_size;  // size of the above
@@ -19,6 +46,14 @@ typedef struct Machine {
     uint32_t pc;        // need to divide by 4 if we want to index registers
     uint32_t hi;
     uint32_t lo;
+    Instruction *decoded; // predecoded shadow of mem, NULL when disabled
+    struct BlockCache *blocks; // translated basic blocks, NULL until used
+    struct MachineIO *io; // channels behind the mapped I/O addresses
+    struct MachineDebug *debug; // breakpoints and watchpoints, NULL if none
+    uint8_t *dirty;     // a byte per page of memory, set once it's written
+    struct MachineBaseline *baseline; // what reset_machine restores, or NULL
+    MachineStats stats;
+    bool clean_is_zero; // pages that aren't dirty are zero
 } Machine;
 
 // Returns a pointer to a ready-to-use struct representing
@@ -27,15 +62,161 @@ typedef struct Machine {
 //   is given to the machine in bytes. Otherwise,
 //   the default amount of memory is used.
 // Requires: max_memory_bytes is divisible by 4
+//   Memory is zeroed, and only takes up space as pages of it are touched.
 mips241_EXPORT Machine *init_machine(uint32_t max_memory_bytes);
 
 
+// Like init_machine, but every address is backed by memory. Addresses
+//   the emulator treats specially (RETURN_ADDRESS, mapped I/O) still are.
+// Requires: a 64-bit host
+mips241_EXPORT Machine *init_machine_full(void);
+
+
 // Frees all memory associated with a Machine.
 // Requires: machine allocated with init_machine
 // Effects: memory freed
 mips241_EXPORT void destroy_machine(Machine *machine);
 
 
+// Puts a machine back the way init_machine left it: registers, pc, hi,
+//   lo and stats are zero, and so is all of memory. With a baseline (see
+//   m_set_baseline) it goes back to that instead. Only dirty pages are
+//   rewritten, and they stay backed to be written again. I/O channels,
+//   breakpoints and watchpoints are left as they are.
+mips241_EXPORT void reset_machine(Machine *machine);
+
+
+// Makes the machine's registers, pc, hi, lo and memory what reset_machine
+//   restores, and marks every page clean. Returns false if it can't.
+mips241_EXPORT bool m_set_baseline(Machine *machine);
+
+// Forgets the baseline, so reset_machine zeroes everything again.
+mips241_EXPORT void m_clear_baseline(Machine *machine);
+
+// The number of pages of memory. Page p is DIRTY_PAGE_WORDS words from
+//   word p * DIRTY_PAGE_WORDS, or fewer at the end.
+mips241_EXPORT uint32_t m_num_pages(const Machine *machine);
+
+// Returns whether anything wrote to a page since the machine was made,
+//   reset or given a baseline.
+mips241_EXPORT bool m_page_dirty(const Machine *machine, uint32_t page);
+
+// Returns how many pages are dirty, putting the first max of them in
+//   pages in ascending order.
+mips241_EXPORT uint32_t m_dirty_pages(const Machine *machine, uint32_t *pages, uint32_t max);
+
+// Like m_dirty_pages, but only pages that now differ from the baseline,
+//   or from zero without one.
+mips241_EXPORT uint32_t m_changed_pages(const Machine *machine, uint32_t *pages,
+                                        uint32_t max);
+
+
+// Turns the predecoded instruction cache on or off. It is on by default.
+//   Entries are filled lazily as instructions are fetched, and a store
+//   into a word drops its entry, so self-modifying programs still work.
+// Effects: allocates or frees the cache
+mips241_EXPORT void m_set_predecode(Machine *machine, bool enabled);
+
+
+// Writes a word of memory from outside of the emulator, keeping the
+//   predecoded instruction cache coherent. Anything that pokes at
+//   machine->mem directly must go through here or m_invalidate_word.
+// Requires: idx < machine->mem_size
+mips241_EXPORT void m_write_word(Machine *machine, uint32_t idx, uint32_t word);
+
+
+// Copies len / 4 words from bytes into memory from word idx, keeping the
+//   predecoded instruction cache coherent. The words in bytes are
+//   big-endian, like programs, if big_endian is set, or in host order.
+//   Anything past the last whole word is ignored. Returns false, copying
+//   nothing, if the words don't fit.
+mips241_EXPORT bool m_write_words(Machine *machine, uint32_t idx, const void *bytes,
+                                  size_t len, bool big_endian);
+
+// Copies len / 4 words of memory from word idx out to bytes, big-endian
+//   if big_endian is set or in host order. Returns false, copying
+//   nothing, if there aren't that many words.
+mips241_EXPORT bool m_read_words(const Machine *machine, uint32_t idx, void *bytes,
+                                 size_t len, bool big_endian);
+
+// Returns the machine's memory, in host order, to read without copying,
+//   and sets *num_words to its size. The view lasts until the machine is
+//   reset or destroyed. Write through m_write_word or m_write_words.
+mips241_EXPORT const uint32_t *m_memory_view(const Machine *machine, uint32_t *num_words);
+
+
+// Copies out the machine's stats.
+mips241_EXPORT void m_get_stats(const Machine *machine, MachineStats *stats);
+
+// Zeroes the machine's stats.
+mips241_EXPORT void m_reset_stats(Machine *machine);
+
+// Writes the stats to out, one per line or as a JSON object if json is
+//   set, along with emulated millions of instructions per second.
+//   Returns false if it can't.
+mips241_EXPORT bool m_write_stats(const Machine *machine, FILE *out, bool json);
+
+// A monotonic clock in nanoseconds, for stats.wall_ns. Where there's no
+//   such clock it's processor time.
+uint64_t m_now_ns(void);
+
+
+// Sets up a machine with num_words of memory at mem, which it takes over
+//   and frees with m_free_pages. If mem is NULL, the memory is new and
+//   zeroed.
+Machine *m_create(uint32_t num_words, uint32_t *mem);
+
+
+// Puts dirty pages and the registers back the way the baseline has them,
+//   or zeroes them without one, and marks every page clean.
+// Requires: there is a baseline, or clean_is_zero
+void m_restore_baseline(Machine *machine);
+
+
+// Returns bytes of zeroed memory that is only backed once it's touched,
+//   or NULL. Free with m_free_pages.
+void *m_alloc_pages(size_t bytes);
+
+// Frees memory from m_alloc_pages, given the same size.
+void m_free_pages(void *pages, size_t bytes);
+
+
+// Zeroes memory from m_alloc_pages, giving back whole pages where it can.
+void m_zero_pages(void *pages, size_t bytes);
+
+
+// Throws away translated blocks if any of them cover the word at idx.
+void m_invalidate_code(Machine *machine, uint32_t idx);
+
+
+// Marks the page holding the word at idx as written.
+static inline void m_mark_dirty(Machine *const machine, uint32_t idx) {
+    machine->dirty[idx >> DIRTY_PAGE_SHIFT] = 1;
+}
+
+
+// Drops any cached decoding or translation of the word at idx, after it
+//   was written.
+static inline void m_invalidate_word(Machine *const machine, uint32_t idx) {
+    m_mark_dirty(machine, idx);
+    if (machine->decoded != NULL)
+        machine->decoded[idx].type = TYPE_INVALID;
+    if (machine->blocks != NULL)
+        m_invalidate_code(machine, idx);
+}
+
+
+// Drops any cached decoding or translation of count words from idx,
+//   after they were written in bulk.
+void m_invalidate_range(Machine *machine, uint32_t idx, uint32_t count);
+
+
+// Fills the predecoded instruction cache for count words from idx,
+//   decoding them together. Entries already there are decoded again.
+// Requires: the cache is on
+void m_predecode_range(Machine *machine, uint32_t idx, uint32_t count);
+
+
 // Prints all registers to stderr.
 // Effects: output
 mips241_EXPORT void m_print_registers(const Machine *const machine);
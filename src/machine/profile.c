@@ -0,0 +1,278 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/decode.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+#include "machine/machine.h"
+#include "machine/profile.h"
+
+#define MAX_DEPTH 256    // deeper calls are counted in the deepest frame
+#define NUM_OPCODES 128  // R-type funcs, then I-type opcodes
+
+// A function as reached through one particular chain of calls
+typedef struct CallNode {
+    uint32_t func;       // entry address
+    uint32_t parent;     // index of the caller's node
+    uint64_t self;       // instructions retired in this function itself
+} CallNode;
+
+struct Profile {
+    uint32_t mem_size;
+    uint64_t *pc_counts;            // per word of memory
+    uint64_t op_counts[NUM_OPCODES];
+    uint64_t total;
+
+    CallNode *nodes;                // nodes[0] is the entry point
+    uint32_t num_nodes;
+    uint32_t max_nodes;
+    uint32_t *children;             // hash of (parent, func) to node + 1
+    uint32_t children_cap;          // a power of two
+
+    uint32_t stack[MAX_DEPTH];      // node of each active call
+    uint32_t depth;
+    uint64_t too_deep;              // active calls that didn't fit
+};
+
+
+Profile *profile_create(const Machine *machine) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    if (profile == NULL)
+        return NULL;
+
+    profile->mem_size = machine->mem_size;
+    profile->pc_counts = m_alloc_pages(sizeof(uint64_t) * (size_t)machine->mem_size);
+    profile->max_nodes = 64;
+    profile->nodes = malloc(sizeof(CallNode) * profile->max_nodes);
+    profile->children_cap = 128;
+    profile->children = calloc(profile->children_cap, sizeof(uint32_t));
+    if (profile->pc_counts == NULL || profile->nodes == NULL
+        || profile->children == NULL) {
+        profile_destroy(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+void profile_destroy(Profile *profile) {
+    if (profile != NULL) {
+        m_free_pages(profile->pc_counts, sizeof(uint64_t) * (size_t)profile->mem_size);
+        free(profile->nodes);
+        free(profile->children);
+        free(profile);
+    }
+}
+
+
+static uint32_t hash_call(uint32_t parent, uint32_t func) {
+    return (parent * 2654435761u) ^ (func * 40503u) ^ (func >> 7);
+}
+
+// Returns the slot for (parent, func) in the children table
+static uint32_t *find_child(Profile *profile, uint32_t parent, uint32_t func) {
+    const uint32_t mask = profile->children_cap - 1;
+    for (uint32_t i = hash_call(parent, func) & mask; ; i = (i + 1) & mask) {
+        const uint32_t node = profile->children[i];
+        if (node == 0 || (profile->nodes[node - 1].parent == parent
+                          && profile->nodes[node - 1].func == func))
+            return &profile->children[i];
+    }
+}
+
+static bool grow_children(Profile *profile) {
+    uint32_t *const old = profile->children;
+    const uint32_t old_cap = profile->children_cap;
+    profile->children = calloc(old_cap * 2, sizeof(uint32_t));
+    if (profile->children == NULL) {
+        profile->children = old;
+        return false;
+    }
+    profile->children_cap = old_cap * 2;
+    for (uint32_t i = 0; i < old_cap; ++i) {
+        if (old[i] != 0) {
+            const CallNode *node = &profile->nodes[old[i] - 1];
+            *find_child(profile, node->parent, node->func) = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+// Returns the node for func called from parent, making it if needed.
+//   Returns parent if there's no memory for it.
+static uint32_t child_node(Profile *profile, uint32_t parent, uint32_t func) {
+    uint32_t *slot = find_child(profile, parent, func);
+    if (*slot != 0)
+        return *slot - 1;
+
+    if (profile->num_nodes == profile->max_nodes) {
+        CallNode *nodes = realloc(profile->nodes, 2 * sizeof(CallNode) * profile->max_nodes);
+        if (nodes == NULL)
+            return parent;
+        profile->nodes = nodes;
+        profile->max_nodes *= 2;
+    }
+    if (2 * (profile->num_nodes + 1) > profile->children_cap) {
+        if (!grow_children(profile))
+            return parent;
+        slot = find_child(profile, parent, func);
+    }
+
+    const uint32_t node = profile->num_nodes++;
+    profile->nodes[node] = (CallNode) { func, parent, 0 };
+    *slot = node + 1;
+    return node;
+}
+
+
+// Counts one retired instruction, which was ins at pc
+static inline void record(Profile *profile, const Machine *machine,
+                          uint32_t pc, Instruction ins) {
+    profile->pc_counts[pc / 4]++;
+    profile->op_counts[(ins.type == TYPE_I) * 64 + (ins.code & 0x3F)]++;
+    profile->total++;
+    profile->nodes[profile->stack[profile->depth]].self++;
+
+    if (ins.type != TYPE_R)
+        return;
+    if (ins.code == FUNC_JALR) {
+        if (profile->depth + 1 == MAX_DEPTH) {
+            profile->too_deep++;
+            return;
+        }
+        const uint32_t caller = profile->stack[profile->depth];
+        profile->stack[++profile->depth] = child_node(profile, caller, machine->pc);
+    } else if (ins.code == FUNC_JR && ins.decoded.r.s == 31) {
+        if (profile->too_deep != 0)
+            profile->too_deep--;
+        else if (profile->depth != 0)
+            profile->depth--;
+    }
+}
+
+EmulatorStatus step_machine_profiled(Machine *const machine, Profile *profile,
+                                     uint64_t budget, uint64_t *retired) {
+    if (profile->num_nodes == 0) {
+        profile->nodes[0] = (CallNode) { machine->pc, 0, 0 };
+        profile->num_nodes = 1;
+    }
+
+    const uint64_t start = m_now_ns();
+    EmulatorStatus status;
+    uint64_t count = 0;
+    for (;; ++count) {
+        if (count == budget) {
+            status = (EmulatorStatus) {IR_BUDGET_EXHAUSTED, machine->pc};
+            break;
+        }
+
+        // what's about to run, before it can overwrite itself
+        const uint32_t pc = machine->pc;
+        Instruction ins = { TYPE_INVALID };
+        if (pc % 4 == 0 && pc / 4 < machine->mem_size) {
+            if (machine->decoded != NULL)
+                ins = machine->decoded[pc / 4];
+            if (ins.type == TYPE_INVALID || ins.type == TYPE_BREAK)
+                ins = decode_instruction(machine->mem[pc / 4]);
+        }
+
+        status = step_machine(machine);
+        if (status.retcode != IR_SUCCESS)
+            break;
+        record(profile, machine, pc, ins);
+    }
+
+    *retired = count;
+    m_flush_output(machine);
+    machine->stats.wall_ns += m_now_ns() - start;
+    return status;
+}
+
+
+uint64_t profile_pc_count(const Profile *profile, uint32_t pc) {
+    return pc / 4 < profile->mem_size ? profile->pc_counts[pc / 4] : 0;
+}
+
+uint64_t profile_total(const Profile *profile) {
+    return profile->total;
+}
+
+
+typedef struct PcCount {
+    uint32_t pc;
+    uint64_t count;
+} PcCount;
+
+static int hottest_first(const void *a, const void *b) {
+    const PcCount *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+bool profile_write_flat(const Profile *profile, const char *filename, size_t max_rows) {
+    size_t num_pcs = 0;
+    for (uint32_t i = 0; i < profile->mem_size; ++i)
+        num_pcs += profile->pc_counts[i] != 0;
+
+    PcCount *pcs = malloc(sizeof(PcCount) * (num_pcs + 1));
+    FILE *out = fopen(filename, "w");
+    if (pcs == NULL || out == NULL) {
+        free(pcs);
+        if (out != NULL)
+            fclose(out);
+        return false;
+    }
+
+    size_t n = 0;
+    for (uint32_t i = 0; i < profile->mem_size; ++i)
+        if (profile->pc_counts[i] != 0)
+            pcs[n++] = (PcCount) { i * 4, profile->pc_counts[i] };
+    qsort(pcs, num_pcs, sizeof(PcCount), hottest_first);
+    if (max_rows == 0 || max_rows > num_pcs)
+        max_rows = num_pcs;
+
+    const double total = profile->total ? (double)profile->total : 1.0;
+    fprintf(out, "%" PRIu64 " instructions retired\n\n", profile->total);
+    fprintf(out, "%14s %7s  %s\n", "count", "%", "pc");
+    for (size_t i = 0; i < max_rows; ++i)
+        fprintf(out, "%14" PRIu64 " %6.2f%%  0x%08x\n",
+                pcs[i].count, 100.0 * pcs[i].count / total, pcs[i].pc);
+
+    fprintf(out, "\n%14s %7s  %s\n", "count", "%", "opcode");
+    for (uint32_t i = 0; i < NUM_OPCODES; ++i) {
+        if (profile->op_counts[i] == 0)
+            continue;
+        const Instruction ins = { i < 64 ? TYPE_R : TYPE_I, { { 0, 0, 0 } }, (uint8_t)(i % 64) };
+        const char *name = instruction_name(ins);
+        fprintf(out, "%14" PRIu64 " %6.2f%%  %s\n", profile->op_counts[i],
+                100.0 * profile->op_counts[i] / total, name != NULL ? name : "?");
+    }
+
+    free(pcs);
+    return fclose(out) == 0;
+}
+
+// Writes the chain of calls that reached node, outermost first
+static void write_stack(const Profile *profile, FILE *out, uint32_t node) {
+    if (node != 0)
+        write_stack(profile, out, profile->nodes[node].parent);
+    fprintf(out, node != 0 ? ";0x%08x" : "0x%08x", profile->nodes[node].func);
+}
+
+bool profile_write_collapsed(const Profile *profile, const char *filename) {
+    FILE *out = fopen(filename, "w");
+    if (out == NULL)
+        return false;
+
+    for (uint32_t i = 0; i < profile->num_nodes; ++i) {
+        if (profile->nodes[i].self == 0)
+            continue;
+        write_stack(profile, out, i);
+        fprintf(out, " %" PRIu64 "\n", profile->nodes[i].self);
+    }
+    return fclose(out) == 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Profiling: where a program spends its instructions.
+ *
+ * step_machine_profiled runs a machine like step_machine_n, but counts
+ * every retired instruction by pc and by opcode, and follows calls to
+ * build a call tree: jalr is a call to its target and jr $31 returns.
+ * Functions are named by their entry address.
+ *
+ * This is a separate run loop, so the other engines pay nothing for it.
+ */
+#ifndef PROFILE_H__
+#define PROFILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+typedef struct Profile Profile;
+
+// Returns an empty profile for runs of machine, or NULL.
+mips241_EXPORT Profile *profile_create(const Machine *machine);
+
+mips241_EXPORT void profile_destroy(Profile *profile);
+
+// Runs until the program stops or budget instructions have retired,
+//   adding them to profile. Sets *retired to the number that did.
+//   The first run of a profile takes the current pc as the entry point.
+mips241_EXPORT EmulatorStatus step_machine_profiled(Machine *const machine,
+                                                    Profile *profile,
+                                                    uint64_t budget,
+                                                    uint64_t *retired);
+
+// Returns how many times the instruction at pc retired.
+mips241_EXPORT uint64_t profile_pc_count(const Profile *profile, uint32_t pc);
+
+// Returns how many instructions retired in total.
+mips241_EXPORT uint64_t profile_total(const Profile *profile);
+
+// Writes the max_rows hottest pcs (all of them if 0) and a count per
+//   opcode as text. Returns false if the file can't be written.
+mips241_EXPORT bool profile_write_flat(const Profile *profile, const char *filename,
+                                       size_t max_rows);
+
+// Writes one line per call stack, like "0x00000000;0x00000040 1234",
+//   for flame graph tools. Returns false if the file can't be written.
+mips241_EXPORT bool profile_write_collapsed(const Profile *profile,
+                                            const char *filename);
+
+#endif
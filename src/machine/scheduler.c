@@ -0,0 +1,189 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "machine/scheduler.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+
+#define INITIAL_SLOTS 16
+
+typedef struct Slot {
+    Machine *machine;   // NULL for a free slot
+    enum sched_state state;
+    uint64_t retired;
+    uint32_t next_free;
+} Slot;
+
+struct Scheduler {
+    uint64_t quantum;
+    Slot *slots;
+    uint32_t num_slots;
+    uint32_t free_slot;     // head of the free list, num_slots if empty
+
+    // the ids of runnable machines, in the order they get slices. Each
+    //   machine is in it at most once, so it's as big as slots.
+    uint32_t *queue;
+    uint32_t head;
+    uint32_t count;
+};
+
+
+Scheduler *sched_create(uint64_t quantum) {
+    Scheduler *sched = calloc(1, sizeof(Scheduler));
+    if (sched == NULL)
+        return NULL;
+    sched->quantum = quantum;
+    return sched;
+}
+
+void sched_destroy(Scheduler *sched) {
+    if (sched != NULL) {
+        free(sched->slots);
+        free(sched->queue);
+        free(sched);
+    }
+}
+
+
+static Slot *get_slot(const Scheduler *sched, uint32_t id) {
+    return id < sched->num_slots && sched->slots[id].machine != NULL
+           ? &sched->slots[id] : NULL;
+}
+
+static void enqueue(Scheduler *sched, uint32_t id) {
+    sched->queue[(sched->head + sched->count++) % sched->num_slots] = id;
+    sched->slots[id].state = SCHED_RUNNABLE;
+}
+
+static uint32_t dequeue(Scheduler *sched) {
+    const uint32_t id = sched->queue[sched->head];
+    sched->head = (sched->head + 1) % sched->num_slots;
+    sched->count--;
+    return id;
+}
+
+// Doubles the slots, keeping the queue in order. Returns false if it
+//   can't.
+static bool grow(Scheduler *sched) {
+    const uint32_t old = sched->num_slots;
+    const uint32_t cap = old != 0 ? 2 * old : INITIAL_SLOTS;
+    Slot *slots = realloc(sched->slots, cap * sizeof(Slot));
+    if (slots == NULL)
+        return false;
+    sched->slots = slots;
+    uint32_t *queue = malloc(cap * sizeof(uint32_t));
+    if (queue == NULL)
+        return false;
+
+    for (uint32_t i = 0; i < sched->count; ++i)
+        queue[i] = sched->queue[(sched->head + i) % old];
+    for (uint32_t i = old; i < cap; ++i)
+        slots[i] = (Slot) { NULL, SCHED_NONE, 0, i + 1 };
+    free(sched->queue);
+    sched->queue = queue;
+    sched->head = 0;
+    sched->num_slots = cap;
+    sched->free_slot = old;
+    return true;
+}
+
+uint32_t sched_add(Scheduler *sched, Machine *machine) {
+    if (sched->free_slot == sched->num_slots && !grow(sched))
+        return SCHED_NO_ID;
+    const uint32_t id = sched->free_slot;
+    Slot *const slot = &sched->slots[id];
+    sched->free_slot = slot->next_free;
+
+    m_input_from_feed(machine);
+    slot->machine = machine;
+    slot->retired = 0;
+    enqueue(sched, id);
+    return id;
+}
+
+Machine *sched_remove(Scheduler *sched, uint32_t id) {
+    Slot *const slot = get_slot(sched, id);
+    if (slot == NULL)
+        return NULL;
+
+    if (slot->state == SCHED_RUNNABLE) {
+        // close the gap it leaves in the queue
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < sched->count; ++i) {
+            const uint32_t other = sched->queue[(sched->head + i) % sched->num_slots];
+            if (other != id)
+                sched->queue[(sched->head + kept++) % sched->num_slots] = other;
+        }
+        sched->count = kept;
+    }
+
+    Machine *const machine = slot->machine;
+    *slot = (Slot) { NULL, SCHED_NONE, 0, sched->free_slot };
+    sched->free_slot = id;
+    return machine;
+}
+
+Machine *sched_machine(const Scheduler *sched, uint32_t id) {
+    const Slot *const slot = get_slot(sched, id);
+    return slot != NULL ? slot->machine : NULL;
+}
+
+enum sched_state sched_get_state(const Scheduler *sched, uint32_t id) {
+    const Slot *const slot = get_slot(sched, id);
+    return slot != NULL ? slot->state : SCHED_NONE;
+}
+
+size_t sched_runnable(const Scheduler *sched) {
+    return sched->count;
+}
+
+
+void sched_feed_input(Scheduler *sched, uint32_t id, const uint8_t *bytes, size_t len) {
+    Slot *const slot = get_slot(sched, id);
+    if (slot == NULL)
+        return;
+    m_feed_input(slot->machine, bytes, len);
+    if (slot->state == SCHED_WAITING && len != 0)
+        enqueue(sched, id);
+}
+
+void sched_close_input(Scheduler *sched, uint32_t id) {
+    Slot *const slot = get_slot(sched, id);
+    if (slot == NULL)
+        return;
+    m_close_input(slot->machine);
+    if (slot->state == SCHED_WAITING)
+        enqueue(sched, id);
+}
+
+void sched_resume(Scheduler *sched, uint32_t id) {
+    Slot *const slot = get_slot(sched, id);
+    if (slot != NULL && slot->state == SCHED_STOPPED)
+        enqueue(sched, id);
+}
+
+
+size_t sched_run(Scheduler *sched, uint64_t budget, SchedEvent *events,
+                 size_t max_events) {
+    size_t num_events = 0;
+    uint64_t spent = 0;
+    while (sched->count != 0 && num_events < max_events && spent < budget) {
+        const uint32_t id = dequeue(sched);
+        Slot *const slot = &sched->slots[id];
+        const uint64_t left = budget - spent;
+        uint64_t retired;
+        const EmulatorStatus status =
+            step_machine_n(slot->machine, left < sched->quantum ? left : sched->quantum,
+                           &retired);
+        spent += retired;
+        slot->retired += retired;
+
+        if (status.retcode == IR_BUDGET_EXHAUSTED) {
+            enqueue(sched, id);
+            continue;
+        }
+        slot->state = status.retcode == IR_INPUT_WAIT ? SCHED_WAITING : SCHED_STOPPED;
+        events[num_events++] = (SchedEvent) { id, status, slot->retired };
+    }
+    return num_events;
+}
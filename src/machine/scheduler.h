@@ -0,0 +1,80 @@
+/**
+ * Runs many machines on one host thread, round-robin, a slice of at most
+ * quantum instructions each at a time.
+ *
+ * A machine's input becomes a feed when it's added (see machine/io.h),
+ * so rather than blocking the thread, a machine that reads input nobody
+ * has given it yet is parked until sched_feed_input or sched_close_input.
+ * sched_run reports each machine that parks or stops as an event. A
+ * machine stays in the scheduler, and must outlive its time there, until
+ * it's taken out with sched_remove.
+ */
+#ifndef SCHEDULER_H__
+#define SCHEDULER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+#define SCHED_NO_ID UINT32_MAX
+
+typedef struct Scheduler Scheduler;
+
+enum sched_state {
+    SCHED_RUNNABLE,     // waiting for its next slice
+    SCHED_WAITING,      // parked until it has input
+    SCHED_STOPPED,      // finished, failed or at a breakpoint
+    SCHED_NONE          // no machine by that id
+};
+
+// Something that happened to a machine in sched_run: it stopped with
+//   status, or parked with IR_INPUT_WAIT, having run retired instructions
+//   in total.
+typedef struct SchedEvent {
+    uint32_t id;
+    EmulatorStatus status;
+    uint64_t retired;
+} SchedEvent;
+
+// Returns an empty scheduler giving machines quantum instructions a
+//   slice, or NULL.
+// Requires: quantum > 0
+mips241_EXPORT Scheduler *sched_create(uint64_t quantum);
+
+// Frees the scheduler, but none of its machines.
+mips241_EXPORT void sched_destroy(Scheduler *sched);
+
+// Adds a machine, ready to run from its pc, switching its input to an
+//   empty feed. Returns its id, which is reused once it's removed, or
+//   SCHED_NO_ID if there's no room for it.
+mips241_EXPORT uint32_t sched_add(Scheduler *sched, Machine *machine);
+
+// Takes a machine out and returns it, or NULL if there's no such id.
+mips241_EXPORT Machine *sched_remove(Scheduler *sched, uint32_t id);
+
+// Returns the machine by that id, or NULL.
+mips241_EXPORT Machine *sched_machine(const Scheduler *sched, uint32_t id);
+
+mips241_EXPORT enum sched_state sched_get_state(const Scheduler *sched, uint32_t id);
+
+// How many machines are waiting for a slice.
+mips241_EXPORT size_t sched_runnable(const Scheduler *sched);
+
+// Gives a machine more input, and runs it again if it was parked.
+mips241_EXPORT void sched_feed_input(Scheduler *sched, uint32_t id,
+                                     const uint8_t *bytes, size_t len);
+
+// Ends a machine's input, and runs it again if it was parked.
+mips241_EXPORT void sched_close_input(Scheduler *sched, uint32_t id);
+
+// Runs a stopped machine again from its pc, as after a breakpoint.
+mips241_EXPORT void sched_resume(Scheduler *sched, uint32_t id);
+
+// Runs slices until no machine is runnable, max_events events have been
+//   written to events, or about budget instructions have run across all
+//   machines. Returns how many events were written.
+mips241_EXPORT size_t sched_run(Scheduler *sched, uint64_t budget,
+                                SchedEvent *events, size_t max_events);
+
+#endif
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE // memfd_create
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/machine.h"
+#include "machine/snapshot.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef MFD_CLOEXEC
+#define MIPS241_MEMFD
+#endif
+#endif
+
+#define PAGE_WORDS 1024
+
+struct MachineSnapshot {
+    uint32_t registers[NUM_REGISTERS];
+    uint32_t pc;
+    uint32_t hi;
+    uint32_t lo;
+    uint32_t mem_size;
+    int fd;             // memfd holding memory, or -1
+    uint32_t *mem;      // a copy of memory when there is no memfd
+};
+
+
+// Copies num_words of memory, leaving zero pages alone so they stay
+//   unbacked in dst
+static void copy_pages(uint32_t *dst, const uint32_t *src, uint32_t num_words) {
+    for (uint32_t page = 0; page < num_words; page += PAGE_WORDS) {
+        const uint32_t count = num_words - page < PAGE_WORDS ? num_words - page : PAGE_WORDS;
+        uint32_t bits = 0;
+        for (uint32_t i = 0; i < count; ++i)
+            bits |= src[page + i];
+        if (bits != 0)
+            memcpy(dst + page, src + page, sizeof(uint32_t) * count);
+    }
+}
+
+#ifdef MIPS241_MEMFD
+// Puts memory in a memfd for clones to map. Returns the fd, or -1.
+static int share_memory(const Machine *machine) {
+    const size_t bytes = sizeof(uint32_t) * (size_t)machine->mem_size;
+    const int fd = memfd_create("mips241-snapshot", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, (off_t)bytes) == 0) {
+        uint32_t *shared = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (shared != MAP_FAILED) {
+            copy_pages(shared, machine->mem, machine->mem_size);
+            munmap(shared, bytes);
+            return fd;
+        }
+    }
+    close(fd);
+    return -1;
+}
+#endif
+
+
+MachineSnapshot *m_snapshot(const Machine *machine) {
+    MachineSnapshot *snapshot = malloc(sizeof(MachineSnapshot));
+    if (snapshot == NULL)
+        return NULL;
+
+    memcpy(snapshot->registers, machine->registers, sizeof(machine->registers));
+    snapshot->pc = machine->pc;
+    snapshot->hi = machine->hi;
+    snapshot->lo = machine->lo;
+    snapshot->mem_size = machine->mem_size;
+    snapshot->fd = -1;
+    snapshot->mem = NULL;
+
+#ifdef MIPS241_MEMFD
+    snapshot->fd = share_memory(machine);
+    if (snapshot->fd >= 0)
+        return snapshot;
+#endif
+
+    // no copy-on-write, so keep a copy to copy from
+    snapshot->mem = m_alloc_pages(sizeof(uint32_t) * (size_t)machine->mem_size);
+    if (snapshot->mem == NULL) {
+        free(snapshot);
+        return NULL;
+    }
+    copy_pages(snapshot->mem, machine->mem, machine->mem_size);
+    return snapshot;
+}
+
+
+void m_snapshot_destroy(MachineSnapshot *snapshot) {
+    if (snapshot != NULL) {
+#ifdef MIPS241_MEMFD
+        if (snapshot->fd >= 0)
+            close(snapshot->fd);
+#endif
+        m_free_pages(snapshot->mem, sizeof(uint32_t) * (size_t)snapshot->mem_size);
+        free(snapshot);
+    }
+}
+
+
+Machine *m_clone(const MachineSnapshot *snapshot) {
+    const size_t bytes = sizeof(uint32_t) * (size_t)snapshot->mem_size;
+    uint32_t *mem = NULL;
+
+#ifdef MIPS241_MEMFD
+    if (snapshot->fd >= 0) {
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_NORESERVE, snapshot->fd, 0);
+        if (mem == MAP_FAILED)
+            return NULL;
+    }
+#endif
+    if (mem == NULL) {
+        mem = m_alloc_pages(bytes);
+        if (mem == NULL)
+            return NULL;
+        copy_pages(mem, snapshot->mem, snapshot->mem_size);
+    }
+
+    Machine *m = m_create(snapshot->mem_size, mem);
+    memcpy(m->registers, snapshot->registers, sizeof(m->registers));
+    m->pc = snapshot->pc;
+    m->hi = snapshot->hi;
+    m->lo = snapshot->lo;
+    return m;
+}
@@ -0,0 +1,29 @@
+/**
+ * Snapshots of a Machine, and clones made from them.
+ *
+ * A snapshot holds a machine's registers, pc, hi, lo and memory. Clones
+ * map the snapshot's memory copy-on-write where the host allows it, so
+ * making one is cheap and it only pays for the pages it writes. Each
+ * clone gets its own I/O channels, connected to stdin and stdout.
+ */
+#ifndef SNAPSHOT_H__
+#define SNAPSHOT_H__
+
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+typedef struct MachineSnapshot MachineSnapshot;
+
+// Captures the state of machine. The machine can carry on running,
+//   or be destroyed, without affecting the snapshot.
+mips241_EXPORT MachineSnapshot *m_snapshot(const Machine *machine);
+
+// Frees a snapshot. Clones made from it are not affected.
+mips241_EXPORT void m_snapshot_destroy(MachineSnapshot *snapshot);
+
+// Returns a new machine in the state the snapshot captured.
+//   Free it with destroy_machine.
+mips241_EXPORT Machine *m_clone(const MachineSnapshot *snapshot);
+
+#endif
@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 200112L // clock_gettime
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "machine/machine.h"
+
+#if defined(CLOCK_MONOTONIC)
+#define MIPS241_MONOTONIC
+#endif
+
+
+uint64_t m_now_ns(void) {
+#ifdef MIPS241_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+    return (uint64_t)((double)clock() * (1e9 / CLOCKS_PER_SEC));
+}
+
+
+void m_get_stats(const Machine *machine, MachineStats *stats) {
+    *stats = machine->stats;
+}
+
+void m_reset_stats(Machine *machine) {
+    memset(&machine->stats, 0, sizeof(machine->stats));
+}
+
+
+bool m_write_stats(const Machine *machine, FILE *out, bool json) {
+    const MachineStats *s = &machine->stats;
+    const double seconds = s->wall_ns / 1e9;
+    const double mips = s->wall_ns != 0 ? s->retired / (s->wall_ns / 1e3) : 0;
+
+    int n;
+    if (json) {
+        n = fprintf(out,
+                    "{\"retired\": %" PRIu64 ", \"loads\": %" PRIu64
+                    ", \"stores\": %" PRIu64 ", \"branches_taken\": %" PRIu64
+                    ", \"branches_not_taken\": %" PRIu64 ", \"calls\": %" PRIu64
+                    ", \"input_bytes\": %" PRIu64 ", \"output_bytes\": %" PRIu64
+                    ", \"wall_seconds\": %.6f, \"mips\": %.2f}\n",
+                    s->retired, s->loads, s->stores, s->branches_taken,
+                    s->branches_not_taken, s->calls, s->input_bytes,
+                    s->output_bytes, seconds, mips);
+    } else {
+        n = fprintf(out,
+                    "instructions retired  %" PRIu64 "\n"
+                    "loads                 %" PRIu64 "\n"
+                    "stores                %" PRIu64 "\n"
+                    "branches taken        %" PRIu64 "\n"
+                    "branches not taken    %" PRIu64 "\n"
+                    "calls                 %" PRIu64 "\n"
+                    "input bytes           %" PRIu64 "\n"
+                    "output bytes          %" PRIu64 "\n"
+                    "wall time             %.6f s\n"
+                    "emulated MIPS         %.2f\n",
+                    s->retired, s->loads, s->stores, s->branches_taken,
+                    s->branches_not_taken, s->calls, s->input_bytes,
+                    s->output_bytes, seconds, mips);
+    }
+    return n >= 0;
+}
@@ -0,0 +1,283 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "common/defs.h"
+#include "machine/engine.h"
+#include "machine/impl.h"
+#include "machine/machine.h"
+
+#if defined(__GNUC__) && !defined(MIPS241_NO_COMPUTED_GOTO)
+    #define USE_COMPUTED_GOTO
+    // labels as values are a GNU extension
+    #pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Fields of the current instruction word
+#define S ((word >> 21) & 0x1F)
+#define T ((word >> 16) & 0x1F)
+#define D ((word >> 11) & 0x1F)
+#define IMM ((int32_t)((word & 0xFFFF) ^ 0x8000) - 0x8000)
+
+// One dispatch index per R-type func, and 64 + opcode for I-types
+#define INDEX(WORD) (((WORD) >> 26) ? ((WORD) >> 26) | 64 : (WORD) & 0x3F)
+#define NUM_HANDLERS 128
+
+#define make_signed(X) \
+       (int32_t)( (X > INT32_MAX) ? X - UINT32_MAX - 1 : X )
+
+#ifdef USE_COMPUTED_GOTO
+    #define NEXT() do { FETCH(); goto *handlers[INDEX(word)]; } while (0)
+#else
+    #define NEXT() goto DISPATCH
+#endif
+
+// Fetch the next word, leaving the loop for anything but plain sequential
+//   execution within memory. Alignment only needs checking after jumps.
+#define FETCH() \
+    do { \
+        regs[0] = 0; \
+        if (pc >= fetch_limit) goto FETCH_SLOW; \
+        word = mem[pc / 4]; \
+        pc += 4; \
+        ran.retired++; \
+    } while (0)
+
+// Give the current instruction to step_machine, which counts it itself
+#define BAIL() do { pc -= 4; ran.retired--; goto SLOW; } while (0)
+
+// Adds what ran to the machine's stats, and starts again from zero
+static void add_stats(Machine *machine, MachineStats *ran) {
+    MachineStats *const stats = &machine->stats;
+    stats->retired += ran->retired;
+    stats->loads += ran->loads;
+    stats->stores += ran->stores;
+    stats->branches_taken += ran->branches_taken;
+    stats->branches_not_taken += ran->branches_not_taken;
+    stats->calls += ran->calls;
+    *ran = (MachineStats) { 0 };
+}
+
+EmulatorStatus run_threaded(Machine *const machine) {
+    // this reads instructions straight from memory, so it can't see
+    //   breakpoints; the block engine stops for them
+    if (machine->debug != NULL) {
+        uint64_t retired;
+        return run_blocks(machine, UINT64_MAX, &retired);
+    }
+
+    uint32_t *const mem = machine->mem;
+    const uint32_t mem_size = machine->mem_size;
+    const uint64_t mem_bytes = (uint64_t)mem_size * 4;
+    // fetching at or above this goes the slow way
+    const uint32_t fetch_limit =
+        mem_bytes < RETURN_ADDRESS ? (uint32_t)mem_bytes : RETURN_ADDRESS;
+
+    uint32_t regs[NUM_REGISTERS];
+    uint32_t pc, hi, lo, word;
+    EmulatorStatus status;
+    // counted here and added to machine->stats on the way out
+    MachineStats ran = { 0 };
+
+#ifdef USE_COMPUTED_GOTO
+    static const void *const handlers[NUM_HANDLERS] = {
+        [0 ... NUM_HANDLERS - 1] = &&SLOW_DECODED,
+        [FUNC_ADD] = &&H_ADD,
+        [FUNC_SUB] = &&H_SUB,
+        [FUNC_MULTU] = &&H_MULTU,
+        [FUNC_MULT] = &&H_MULT,
+        [FUNC_DIV] = &&H_DIV,
+        [FUNC_DIVU] = &&H_DIVU,
+        [FUNC_MFLO] = &&H_MFLO,
+        [FUNC_MFHI] = &&H_MFHI,
+        [FUNC_LIS] = &&H_LIS,
+        [FUNC_SLT] = &&H_SLT,
+        [FUNC_SLTU] = &&H_SLTU,
+        [FUNC_JR] = &&H_JR,
+        [FUNC_JALR] = &&H_JALR,
+        [64 | OP_BEQ] = &&H_BEQ,
+        [64 | OP_BNE] = &&H_BNE,
+        [64 | OP_LW] = &&H_LW,
+        [64 | OP_SW] = &&H_SW
+    };
+#endif
+
+    // the first fetch goes through step_machine to check the entry pc
+    goto SLOW_ENTRY;
+
+RELOAD:
+    memcpy(regs, machine->registers, sizeof(regs));
+    pc = machine->pc;
+    hi = machine->hi;
+    lo = machine->lo;
+    if (pc % 4 != 0)
+        goto SLOW;
+
+#ifdef USE_COMPUTED_GOTO
+    NEXT();
+#else
+DISPATCH:
+    FETCH();
+    switch (INDEX(word)) {
+        case FUNC_ADD: goto H_ADD;
+        case FUNC_SUB: goto H_SUB;
+        case FUNC_MULTU: goto H_MULTU;
+        case FUNC_MULT: goto H_MULT;
+        case FUNC_DIV: goto H_DIV;
+        case FUNC_DIVU: goto H_DIVU;
+        case FUNC_MFLO: goto H_MFLO;
+        case FUNC_MFHI: goto H_MFHI;
+        case FUNC_LIS: goto H_LIS;
+        case FUNC_SLT: goto H_SLT;
+        case FUNC_SLTU: goto H_SLTU;
+        case FUNC_JR: goto H_JR;
+        case FUNC_JALR: goto H_JALR;
+        case 64 | OP_BEQ: goto H_BEQ;
+        case 64 | OP_BNE: goto H_BNE;
+        case 64 | OP_LW: goto H_LW;
+        case 64 | OP_SW: goto H_SW;
+        default: goto SLOW_DECODED;
+    }
+#endif
+
+H_ADD:
+    regs[D] = regs[S] + regs[T];
+    NEXT();
+
+H_SUB:
+    regs[D] = regs[S] - regs[T];
+    NEXT();
+
+H_MULTU:
+    {
+        const uint64_t result = (uint64_t)regs[S] * regs[T];
+        hi = result >> 32;
+        lo = result & 0xFFFFFFFF;
+    }
+    NEXT();
+
+H_MULT:
+    {
+        const uint64_t result = (int64_t)make_signed(regs[S]) * make_signed(regs[T]);
+        hi = result >> 32;
+        lo = result & 0xFFFFFFFF;
+    }
+    NEXT();
+
+H_DIV:
+    m_div(regs[S], regs[T], &hi, &lo);
+    NEXT();
+
+H_DIVU:
+    m_divu(regs[S], regs[T], &hi, &lo);
+    NEXT();
+
+H_MFLO:
+    regs[D] = lo;
+    NEXT();
+
+H_MFHI:
+    regs[D] = hi;
+    NEXT();
+
+H_LIS:
+    if (pc >= fetch_limit)
+        BAIL();
+    regs[D] = mem[pc / 4];
+    pc += 4;
+    NEXT();
+
+H_SLT:
+    regs[D] = make_signed(regs[S]) < make_signed(regs[T]);
+    NEXT();
+
+H_SLTU:
+    regs[D] = regs[S] < regs[T];
+    NEXT();
+
+H_JR:
+    pc = regs[S];
+    if (pc % 4 != 0)
+        goto EXIT_UNALIGNED_FETCH;
+    NEXT();
+
+H_JALR:
+    {
+        const uint32_t target = regs[S];
+        regs[31] = pc;
+        pc = target;
+    }
+    ran.calls++;
+    if (pc % 4 != 0)
+        goto EXIT_UNALIGNED_FETCH;
+    NEXT();
+
+H_BEQ:
+    {
+        const bool taken = regs[S] == regs[T];
+        pc += taken * IMM * 4;
+        ran.branches_taken += taken;
+        ran.branches_not_taken += !taken;
+    }
+    NEXT();
+
+H_BNE:
+    {
+        const bool taken = regs[S] != regs[T];
+        pc += taken * IMM * 4;
+        ran.branches_taken += taken;
+        ran.branches_not_taken += !taken;
+    }
+    NEXT();
+
+H_LW:
+    {
+        const uint32_t byte_addr = regs[S] + IMM;
+        // MMIO and faults go the slow way
+        if (byte_addr / 4 >= mem_size || byte_addr % 4 != 0
+            || byte_addr == MAPPED_INPUT_ADDR)
+            BAIL();
+        regs[T] = mem[byte_addr / 4];
+    }
+    ran.loads++;
+    NEXT();
+
+H_SW:
+    {
+        const uint32_t byte_addr = regs[S] + IMM;
+        if (byte_addr / 4 >= mem_size || byte_addr % 4 != 0
+            || byte_addr == MAPPED_OUTPUT_ADDR)
+            BAIL();
+        mem[byte_addr / 4] = regs[T];
+        m_invalidate_word(machine, byte_addr / 4);
+    }
+    ran.stores++;
+    NEXT();
+
+EXIT_UNALIGNED_FETCH:
+    add_stats(machine, &ran);
+    regs[0] = 0;
+    memcpy(machine->registers, regs, sizeof(regs));
+    machine->pc = pc;
+    machine->hi = hi;
+    machine->lo = lo;
+    return (EmulatorStatus) {IR_UNALIGNED_INSTRUCTION_FETCH, pc};
+
+FETCH_SLOW:
+    // pc has not been advanced yet
+    goto SLOW;
+
+SLOW_DECODED:
+    pc -= 4;
+    ran.retired--;
+SLOW:
+    add_stats(machine, &ran);
+    memcpy(machine->registers, regs, sizeof(regs));
+    machine->pc = pc;
+    machine->hi = hi;
+    machine->lo = lo;
+SLOW_ENTRY:
+    status = step_machine(machine);
+    if (status.retcode != IR_SUCCESS)
+        return status;
+    goto RELOAD;
+}
@@ -0,0 +1,432 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/decode.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+#include "machine/machine.h"
+#include "machine/trace.h"
+
+#define TRACE_NUM_REGS (NUM_REGISTERS + 2)  // then hi and lo
+
+#define TRACE_BUFFER_BYTES (1 << 20)
+#define MAX_RECORD_BYTES 160    // a sync record, with room to spare
+
+struct Trace {
+    FILE *file;
+    bool failed;                // some of it couldn't be written
+    uint32_t mem_size;
+    uint32_t *last_word;        // per word: the word last recorded there
+
+    // the state a reader has got to
+    bool synced;
+    uint32_t pc;
+    uint32_t regs[TRACE_NUM_REGS];
+
+    uint8_t *buffer;
+    size_t used;
+};
+
+
+Trace *trace_open(const Machine *machine, const char *filename) {
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (trace == NULL)
+        return NULL;
+
+    trace->mem_size = machine->mem_size;
+    trace->last_word = m_alloc_pages(sizeof(uint32_t) * (size_t)machine->mem_size);
+    trace->buffer = malloc(TRACE_BUFFER_BYTES);
+    trace->file = fopen(filename, "wb");
+    if (trace->last_word == NULL || trace->buffer == NULL || trace->file == NULL) {
+        trace_close(trace);
+        return NULL;
+    }
+    memcpy(trace->buffer, TRACE_MAGIC, strlen(TRACE_MAGIC));
+    trace->used = strlen(TRACE_MAGIC);
+    return trace;
+}
+
+static void write_buffer(Trace *trace) {
+    if (trace->used != 0 && fwrite(trace->buffer, 1, trace->used, trace->file) != trace->used)
+        trace->failed = true;
+    trace->used = 0;
+}
+
+bool trace_close(Trace *trace) {
+    if (trace == NULL)
+        return false;
+
+    bool ok = false;
+    if (trace->file != NULL) {
+        write_buffer(trace);
+        ok = fclose(trace->file) == 0 && !trace->failed;
+    }
+    m_free_pages(trace->last_word, sizeof(uint32_t) * (size_t)trace->mem_size);
+    free(trace->buffer);
+    free(trace);
+    return ok;
+}
+
+
+static inline uint8_t *put_varint(uint8_t *p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline uint8_t *put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+    return p + 4;
+}
+
+// Records the machine's whole state, if a reader wouldn't know it
+static void sync(Trace *trace, const Machine *machine) {
+    uint32_t regs[TRACE_NUM_REGS];
+    memcpy(regs, machine->registers, sizeof(machine->registers));
+    regs[REG_HI] = machine->hi;
+    regs[REG_LO] = machine->lo;
+    if (trace->synced && memcmp(regs, trace->regs, sizeof(regs)) == 0)
+        return;
+
+    if (trace->used > TRACE_BUFFER_BYTES - MAX_RECORD_BYTES)
+        write_buffer(trace);
+    uint8_t *p = trace->buffer + trace->used;
+    *p++ = TRACE_SYNC;
+    p = put_u32(p, machine->pc);
+    for (uint32_t i = 0; i < TRACE_NUM_REGS; ++i)
+        p = put_u32(p, regs[i]);
+    trace->used = p - trace->buffer;
+
+    trace->synced = true;
+    trace->pc = machine->pc;
+    memcpy(trace->regs, regs, sizeof(regs));
+}
+
+// Adds a register write to a record, if the register changed
+static inline uint8_t *put_reg(Trace *trace, const Machine *machine, uint8_t *p,
+                               uint8_t *flags, uint8_t flag, uint8_t reg) {
+    if (reg == 0 || reg == REG_NONE)
+        return p;
+    const uint32_t value = reg == REG_HI ? machine->hi
+                         : reg == REG_LO ? machine->lo
+                         : machine->registers[reg];
+    if (value == trace->regs[reg])
+        return p;
+    *flags |= flag;
+    *p++ = (uint8_t)reg;
+    p = put_varint(p, zigzag((int32_t)(value - trace->regs[reg])));
+    trace->regs[reg] = value;
+    return p;
+}
+
+EmulatorStatus step_machine_traced(Machine *const machine, Trace *trace,
+                                   uint64_t budget, uint64_t *retired) {
+    sync(trace, machine);
+
+    const uint64_t start = m_now_ns();
+    EmulatorStatus status;
+    uint64_t count = 0;
+    for (;; ++count) {
+        if (count == budget) {
+            status = (EmulatorStatus) {IR_BUDGET_EXHAUSTED, machine->pc};
+            break;
+        }
+        if (trace->used > TRACE_BUFFER_BYTES - MAX_RECORD_BYTES)
+            write_buffer(trace);
+
+        // what's about to run, before it can overwrite itself
+        const uint32_t pc = machine->pc;
+        uint32_t word = 0;
+        Instruction ins = { TYPE_INVALID };
+        if (pc % 4 == 0 && pc / 4 < machine->mem_size) {
+            word = machine->mem[pc / 4];
+            ins = decode_instruction(word);
+        }
+        uint8_t dest[2];
+        instruction_destinations(ins, dest);
+        const bool is_sw = ins.type == TYPE_I && ins.code == OP_SW;
+        const uint32_t sw_addr = machine->registers[ins.decoded.i.s] + ins.decoded.i.imm;
+        const uint32_t sw_value = machine->registers[ins.decoded.i.t];
+
+        status = step_machine(machine);
+        if (status.retcode != IR_SUCCESS)
+            break;
+
+        uint8_t *const start = trace->buffer + trace->used;
+        uint8_t flags = 0;
+        uint8_t *p = start + 1;
+        if (pc != trace->pc) {
+            flags |= TRACE_JUMP;
+            p = put_varint(p, zigzag((int32_t)(pc - trace->pc) / 4));
+        }
+        if (word != trace->last_word[pc / 4]) {
+            flags |= TRACE_WORD;
+            p = put_u32(p, word);
+            trace->last_word[pc / 4] = word;
+        }
+        p = put_reg(trace, machine, p, &flags, TRACE_REG, dest[0]);
+        p = put_reg(trace, machine, p, &flags, (flags & TRACE_REG) ? TRACE_REG2 : TRACE_REG,
+                    dest[1]);
+        if (is_sw) {
+            flags |= TRACE_MEM;
+            p = put_varint(p, sw_addr / 4);
+            p = put_varint(p, sw_value);
+        }
+        *start = flags;
+        trace->used = p - trace->buffer;
+        trace->pc = pc + (ins.type == TYPE_R && ins.code == FUNC_LIS ? 8 : 4);
+    }
+
+    uint8_t *p = trace->buffer + trace->used;
+    *p++ = TRACE_STOP;
+    *p++ = (uint8_t)status.retcode;
+    p = put_u32(p, status.pc);
+    trace->used = p - trace->buffer;
+
+    *retired = count;
+    m_flush_output(machine);
+    machine->stats.wall_ns += m_now_ns() - start;
+    return status;
+}
+
+
+// The words seen at each pc while reading a trace
+typedef struct WordMap {
+    uint32_t *keys;     // word address + 1, or 0 for an empty slot
+    uint32_t *words;
+    uint32_t count;
+    uint32_t cap;       // a power of two
+} WordMap;
+
+static uint32_t *word_slot(WordMap *map, uint32_t key) {
+    const uint32_t mask = map->cap - 1;
+    for (uint32_t i = (key * 2654435761u) & mask; ; i = (i + 1) & mask)
+        if (map->keys[i] == key || map->keys[i] == 0)
+            return &map->keys[i];
+}
+
+static bool word_map_put(WordMap *map, uint32_t pc, uint32_t word) {
+    if (2 * (map->count + 1) > map->cap) {
+        WordMap bigger = { calloc(map->cap * 2, sizeof(uint32_t)),
+                           malloc(map->cap * 2 * sizeof(uint32_t)), 0, map->cap * 2 };
+        if (bigger.keys == NULL || bigger.words == NULL) {
+            free(bigger.keys);
+            free(bigger.words);
+            return false;
+        }
+        for (uint32_t i = 0; i < map->cap; ++i) {
+            if (map->keys[i] != 0) {
+                uint32_t *slot = word_slot(&bigger, map->keys[i]);
+                *slot = map->keys[i];
+                bigger.words[slot - bigger.keys] = map->words[i];
+                bigger.count++;
+            }
+        }
+        free(map->keys);
+        free(map->words);
+        *map = bigger;
+    }
+
+    uint32_t *slot = word_slot(map, pc / 4 + 1);
+    map->count += *slot == 0;
+    *slot = pc / 4 + 1;
+    map->words[slot - map->keys] = word;
+    return true;
+}
+
+static uint32_t word_map_get(WordMap *map, uint32_t pc) {
+    const uint32_t *slot = word_slot(map, pc / 4 + 1);
+    return *slot != 0 ? map->words[slot - map->keys] : 0;
+}
+
+
+static bool get_varint(FILE *in, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        const int c = getc(in);
+        if (c == EOF)
+            return false;
+        *value |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool get_u32(FILE *in, uint32_t *value) {
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, in) != 4)
+        return false;
+    *value = bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16
+             | (uint32_t)bytes[3] << 24;
+    return true;
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+
+static const char *reg_name(uint8_t reg, char buf[8]) {
+    if (reg == REG_HI)
+        return "hi";
+    if (reg == REG_LO)
+        return "lo";
+    snprintf(buf, 8, "$%u", reg);
+    return buf;
+}
+
+#define WRITES_COLUMN 24   // where what an instruction wrote is printed
+
+// Writes word as assembly. Returns how many characters that took.
+static int disassemble(FILE *out, uint32_t word) {
+    const Instruction ins = decode_instruction(word);
+    const char *name = instruction_name(ins);
+    if (name == NULL)
+        return fprintf(out, ".word");
+
+    char operands[32];
+    if (ins.type == TYPE_R) {
+        const unsigned d = ins.decoded.r.d, s = ins.decoded.r.s, t = ins.decoded.r.t;
+        switch (ins.code) {
+            case FUNC_MULT: case FUNC_MULTU: case FUNC_DIV: case FUNC_DIVU:
+                snprintf(operands, sizeof(operands), "$%u, $%u", s, t);
+                break;
+            case FUNC_MFHI: case FUNC_MFLO: case FUNC_LIS:
+                snprintf(operands, sizeof(operands), "$%u", d);
+                break;
+            case FUNC_JR: case FUNC_JALR:
+                snprintf(operands, sizeof(operands), "$%u", s);
+                break;
+            default:
+                snprintf(operands, sizeof(operands), "$%u, $%u, $%u", d, s, t);
+        }
+    } else if (ins.code == OP_LW || ins.code == OP_SW) {
+        snprintf(operands, sizeof(operands), "$%u, %d($%u)",
+                 ins.decoded.i.t, ins.decoded.i.imm, ins.decoded.i.s);
+    } else {
+        snprintf(operands, sizeof(operands), "$%u, $%u, %d",
+                 ins.decoded.i.s, ins.decoded.i.t, ins.decoded.i.imm);
+    }
+    return fprintf(out, "%-5s %s", name, operands);
+}
+
+static const char *retcode_name(uint8_t retcode) {
+    static const char *const names[] = {
+        [IR_DONE] = "done",
+        [IR_SUCCESS] = "running",
+        [IR_UNALIGNED_MEMORY_ACCESS] = "unaligned memory access",
+        [IR_UNALIGNED_INSTRUCTION_FETCH] = "unaligned instruction fetch",
+        [IR_OUT_OF_RANGE_MEMORY_ACCESS] = "out of range memory access",
+        [IR_OUT_OF_RANGE_INSTRUCTION_FETCH] = "out of range instruction fetch",
+        [IR_INVALID_INSTRUCTION] = "invalid instruction",
+        [IR_BREAKPOINT] = "breakpoint",
+        [IR_BUDGET_EXHAUSTED] = "out of instructions",
+        [IR_INPUT_WAIT] = "waiting for input"
+    };
+    return retcode < sizeof(names) / sizeof(names[0]) ? names[retcode] : "?";
+}
+
+// Reads and prints the rest of a record with the given flags
+static bool print_record(FILE *in, FILE *out, uint8_t flags, uint32_t *pc,
+                         uint32_t regs[TRACE_NUM_REGS], WordMap *words) {
+    uint32_t value;
+    char buf[8];
+
+    if (flags == TRACE_SYNC) {
+        if (!get_u32(in, pc))
+            return false;
+        fprintf(out, "-- pc = 0x%08x", *pc);
+        for (uint8_t i = 0; i < TRACE_NUM_REGS; ++i) {
+            if (!get_u32(in, &regs[i]))
+                return false;
+            if (regs[i] != 0)
+                fprintf(out, "  %s = 0x%08x", reg_name(i, buf), regs[i]);
+        }
+        fputc('\n', out);
+        return true;
+    }
+    if (flags == TRACE_STOP) {
+        const int retcode = getc(in);
+        if (retcode == EOF || !get_u32(in, &value))
+            return false;
+        fprintf(out, "-- stopped at 0x%08x: %s\n", value, retcode_name((uint8_t)retcode));
+        return true;
+    }
+    if (flags & (TRACE_SYNC | TRACE_STOP | 0x80))
+        return false;
+
+    if (flags & TRACE_JUMP) {
+        if (!get_varint(in, &value))
+            return false;
+        *pc += (uint32_t)unzigzag(value) * 4;
+    }
+    uint32_t word;
+    if (flags & TRACE_WORD) {
+        if (!get_u32(in, &word) || !word_map_put(words, *pc, word))
+            return false;
+    } else {
+        word = word_map_get(words, *pc);
+    }
+    fprintf(out, "0x%08x  %08x  ", *pc, word);
+    const int width = disassemble(out, word);
+    if (flags & (TRACE_REG | TRACE_REG2 | TRACE_MEM))
+        fprintf(out, "%*s", width < WRITES_COLUMN ? WRITES_COLUMN - width : 0, "");
+
+    for (uint8_t flag = TRACE_REG; flag <= TRACE_REG2; flag <<= 1) {
+        if (!(flags & flag))
+            continue;
+        const int reg = getc(in);
+        if (reg == EOF || reg >= TRACE_NUM_REGS || !get_varint(in, &value))
+            return false;
+        regs[reg] += (uint32_t)unzigzag(value);
+        fprintf(out, "  %s = 0x%08x", reg_name((uint8_t)reg, buf), regs[reg]);
+    }
+    if (flags & TRACE_MEM) {
+        uint32_t addr;
+        if (!get_varint(in, &addr) || !get_varint(in, &value))
+            return false;
+        fprintf(out, "  mem[0x%08x] = 0x%08x", addr * 4, value);
+    }
+    fputc('\n', out);
+
+    const Instruction ins = decode_instruction(word);
+    *pc += ins.type == TYPE_R && ins.code == FUNC_LIS ? 8 : 4;
+    return true;
+}
+
+bool trace_print(const char *filename, FILE *out) {
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL)
+        return false;
+
+    char magic[sizeof(TRACE_MAGIC)] = { 0 };
+    WordMap words = { calloc(1024, sizeof(uint32_t)), malloc(1024 * sizeof(uint32_t)), 0, 1024 };
+    bool ok = words.keys != NULL && words.words != NULL
+              && fread(magic, 1, strlen(TRACE_MAGIC), in) == strlen(TRACE_MAGIC)
+              && strcmp(magic, TRACE_MAGIC) == 0;
+
+    uint32_t pc = 0;
+    uint32_t regs[TRACE_NUM_REGS] = { 0 };
+    int flags;
+    while (ok && (flags = getc(in)) != EOF)
+        ok = print_record(in, out, (uint8_t)flags, &pc, regs, &words);
+
+    free(words.keys);
+    free(words.words);
+    fclose(in);
+    return ok;
+}
@@ -0,0 +1,67 @@
+/**
+ * Execution traces: every retired instruction, in a compact binary file.
+ *
+ * step_machine_traced runs a machine like step_machine_n, recording the
+ * pc and word of each instruction it retires and the register, hi/lo or
+ * memory write it made. Records go into a buffer that is written out in
+ * bulk, so tracing costs a few times a plain run, not the order of
+ * magnitude printing each instruction would.
+ *
+ * The file starts with TRACE_MAGIC, then holds records. Each starts with
+ * a byte of TRACE_* flags saying what follows, in this order:
+ *     TRACE_JUMP   the pc isn't the one after the last instruction's:
+ *                  a zigzag varint of the difference in words
+ *     TRACE_WORD   the word isn't the one last recorded at this pc:
+ *                  4 bytes, little-endian
+ *     TRACE_REG    a register changed: a byte with its number (32 for
+ *                  hi, 33 for lo) and a zigzag varint of new - old
+ *     TRACE_REG2   another one, the same way
+ *     TRACE_MEM    a sw: varints of the word address and the value
+ * A record flagged TRACE_SYNC instead gives the whole state: pc and
+ * registers 0 to 33, each 4 bytes little-endian. One comes first, and
+ * again whenever registers were changed between traced runs. A record
+ * flagged TRACE_STOP ends a run: a byte of instruction_retcode, then the
+ * status pc in 4 bytes.
+ */
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "common/defs.h"
+#include "machine/machine.h"
+
+#define TRACE_MAGIC "MIPS241T"
+
+enum trace_flag {
+    TRACE_JUMP = 0x01,
+    TRACE_WORD = 0x02,
+    TRACE_REG = 0x04,
+    TRACE_REG2 = 0x08,
+    TRACE_MEM = 0x10,
+    TRACE_SYNC = 0x20,
+    TRACE_STOP = 0x40
+};
+
+typedef struct Trace Trace;
+
+// Starts a trace of runs of machine in filename, or returns NULL.
+mips241_EXPORT Trace *trace_open(const Machine *machine, const char *filename);
+
+// Writes out the rest of a trace and frees it. Returns false if any of
+//   it couldn't be written.
+mips241_EXPORT bool trace_close(Trace *trace);
+
+// Runs until the program stops or budget instructions have retired,
+//   recording them in trace. Sets *retired to the number that did.
+mips241_EXPORT EmulatorStatus step_machine_traced(Machine *const machine,
+                                                  Trace *trace,
+                                                  uint64_t budget,
+                                                  uint64_t *retired);
+
+// Prints the trace in filename as text, one instruction per line.
+//   Returns false if it can't be read or isn't a whole trace.
+mips241_EXPORT bool trace_print(const char *filename, FILE *out);
+
+#endif
@@ -0,0 +1,225 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "common/defs.h"
+#include "machine/block.h"
+#include "machine/verify.h"
+
+// how far from $30 we track offsets, to keep them well inside an int32_t
+#define MAX_STACK_OFFSET (1 << 24)
+// guarding fewer accesses than this costs more than it saves
+#define MIN_GUARDED_ACCESSES 2
+
+// What's known about a register partway through a block
+typedef enum ValueKind {
+    VALUE_UNKNOWN,
+    VALUE_ENTRY,        // whatever it was when the block started
+    VALUE_CONST,        // value
+    VALUE_ASSUMED,      // value, while the guard's assumptions hold
+    VALUE_STACK         // $30 at the start of the block plus value
+} ValueKind;
+
+typedef struct Value {
+    ValueKind kind;
+    int64_t value;
+} Value;
+
+typedef struct Verifier {
+    const Machine *machine;
+    BlockGuard *guard;
+    Value regs[NUM_REGISTERS];
+    Op *guarded[MAX_BLOCK_OPS + 1];     // safe ops relying on the guard
+    uint32_t num_guarded;
+    uint32_t num_stack;                 // of them, accesses relative to $30
+} Verifier;
+
+static Value unknown(void) {
+    return (Value) { VALUE_UNKNOWN, 0 };
+}
+
+static Value constant(uint32_t value) {
+    return (Value) { VALUE_CONST, value };
+}
+
+// A constant, assumed if either it came from is
+static Value derived(Value a, Value b, uint32_t value) {
+    return (Value) { a.kind == VALUE_ASSUMED || b.kind == VALUE_ASSUMED
+                     ? VALUE_ASSUMED : VALUE_CONST, value };
+}
+
+static bool is_constant(Value value) {
+    return value.kind == VALUE_CONST || value.kind == VALUE_ASSUMED;
+}
+
+static Value stack(int64_t offset) {
+    return offset >= -MAX_STACK_OFFSET && offset <= MAX_STACK_OFFSET
+           ? (Value) { VALUE_STACK, offset } : unknown();
+}
+
+static void set(Verifier *v, uint8_t r, Value value) {
+    if (r != 0)
+        v->regs[r] = value;
+}
+
+// The constant in a register the block hasn't touched, assuming it has
+//   the value it has now. Returns false if the guard can't take another.
+static bool assume(Verifier *v, uint8_t r) {
+    BlockGuard *const guard = v->guard;
+    if (guard->num_assumed == MAX_GUARD_ASSUMED)
+        return false;
+    guard->assumed_regs[guard->num_assumed] = r;
+    guard->assumed_values[guard->num_assumed++] = v->machine->registers[r];
+    v->regs[r] = (Value) { VALUE_ASSUMED, v->machine->registers[r] };
+    return true;
+}
+
+// An offset to add to or take from the stack pointer, if it's constant
+static bool stack_step(Verifier *v, uint8_t r, int64_t *step) {
+    if (v->regs[r].kind == VALUE_ENTRY && !assume(v, r))
+        return false;
+    if (!is_constant(v->regs[r]))
+        return false;
+    *step = (int32_t)(uint32_t)v->regs[r].value;
+    return true;
+}
+
+static Value add(Verifier *v, uint8_t s, uint8_t t) {
+    const Value a = v->regs[s], b = v->regs[t];
+    int64_t step;
+    if (is_constant(a) && is_constant(b))
+        return derived(a, b, (uint32_t)(a.value + b.value));
+    if (a.kind == VALUE_STACK && stack_step(v, t, &step))
+        return stack(a.value + step);
+    if (b.kind == VALUE_STACK && stack_step(v, s, &step))
+        return stack(b.value + step);
+    return unknown();
+}
+
+static Value sub(Verifier *v, uint8_t s, uint8_t t) {
+    const Value a = v->regs[s], b = v->regs[t];
+    int64_t step;
+    if (is_constant(a) && is_constant(b))
+        return derived(a, b, (uint32_t)(a.value - b.value));
+    if (a.kind == VALUE_STACK && stack_step(v, t, &step))
+        return stack(a.value - step);
+    return unknown();
+}
+
+// Makes op safe if its access to offset from the address in base can't
+//   fault, widening the guard if that depends on it. An access through an
+//   assumed constant relies on the guard too, though not on $30.
+static void prove(Verifier *v, Op *op, Value base, int32_t offset, OpKind safe) {
+    if (is_constant(base)) {
+        const uint32_t addr = (uint32_t)base.value + (uint32_t)offset;
+        if (addr % 4 != 0 || (uint64_t)addr + 4 > v->guard->limit)
+            return;
+        if (base.kind == VALUE_ASSUMED)
+            v->guarded[v->num_guarded++] = op;
+        op->kind = safe;
+        return;
+    }
+    if (base.kind != VALUE_STACK)
+        return;
+
+    const int64_t at = base.value + offset;
+    if (at % 4 != 0 || at < -MAX_STACK_OFFSET || at > MAX_STACK_OFFSET)
+        return;
+    BlockGuard *const guard = v->guard;
+    if (v->num_stack++ == 0) {
+        guard->lo = guard->hi = (int32_t)at;
+    } else {
+        guard->lo = at < guard->lo ? (int32_t)at : guard->lo;
+        guard->hi = at > guard->hi ? (int32_t)at : guard->hi;
+    }
+    v->guarded[v->num_guarded++] = op;
+    op->kind = safe;
+}
+
+// The kind that checks its access, for a safe kind
+static OpKind checked_kind(OpKind kind) {
+    switch (kind) {
+        case OPK_LW_SAFE: return OPK_LW;
+        case OPK_SW_SAFE: return OPK_SW;
+        case OPK_PUSH_SAFE: return OPK_PUSH;
+        case OPK_POP_SAFE: return OPK_POP;
+        default: return kind;
+    }
+}
+
+
+void verify_block(const Machine *machine, Block *block) {
+    BlockGuard *const guard = &block->guard;
+    *guard = (BlockGuard) { .on = false };
+    // mapped I/O is at the top of the address space
+    const uint64_t mem_bytes = (uint64_t)machine->mem_size * 4;
+    guard->limit = mem_bytes < MAPPED_OUTPUT_ADDR ? mem_bytes : MAPPED_OUTPUT_ADDR;
+
+    Verifier v = { .machine = machine, .guard = guard };
+    for (int r = 0; r < NUM_REGISTERS; ++r)
+        v.regs[r] = (Value) { VALUE_ENTRY, 0 };
+    v.regs[0] = constant(0);
+    v.regs[30] = stack(0);
+
+    for (uint32_t i = 0; i < block->num_ops; ++i) {
+        Op *const op = &block->ops[i];
+        switch ((OpKind)op->kind) {
+            case OPK_ADD:
+                set(&v, op->r[0], add(&v, op->r[1], op->r[2]));
+                break;
+            case OPK_SUB:
+                set(&v, op->r[0], sub(&v, op->r[1], op->r[2]));
+                break;
+            case OPK_MFHI:
+            case OPK_MFLO:
+            case OPK_SLT:
+            case OPK_SLTU:
+                set(&v, op->r[0], unknown());
+                break;
+            case OPK_LIS:
+                set(&v, op->r[0], constant(op->imm));
+                break;
+            case OPK_LIS_ADD:
+            case OPK_LIS_SUB:
+                set(&v, op->r[0], constant(op->imm));
+                set(&v, op->r[1], op->kind == OPK_LIS_ADD ? add(&v, op->r[2], op->r[3])
+                                                          : sub(&v, op->r[2], op->r[3]));
+                break;
+            case OPK_LW:
+                prove(&v, op, v.regs[op->r[1]], (int32_t)op->imm, OPK_LW_SAFE);
+                set(&v, op->r[0], unknown());
+                break;
+            case OPK_SW:
+                prove(&v, op, v.regs[op->r[1]], (int32_t)op->imm, OPK_SW_SAFE);
+                break;
+            case OPK_PUSH:
+                prove(&v, op, v.regs[30], -4, OPK_PUSH_SAFE);
+                set(&v, 30, sub(&v, 30, op->r[1]));
+                break;
+            case OPK_POP:
+                set(&v, 30, add(&v, 30, op->r[1]));
+                prove(&v, op, v.regs[30], -4, OPK_POP_SAFE);
+                set(&v, op->r[0], unknown());
+                break;
+            default:
+                // mult and div only touch hi and lo, and the rest end
+                //   the block
+                break;
+        }
+    }
+
+    if (v.num_guarded >= MIN_GUARDED_ACCESSES) {
+        guard->on = true;
+        return;
+    }
+    // not worth checking, but the constant accesses can stay safe
+    for (uint32_t i = 0; i < v.num_guarded; ++i)
+        v.guarded[i]->kind = checked_kind((OpKind)v.guarded[i]->kind);
+    guard->num_assumed = 0;
+}
+
+void unverify_block(Block *block) {
+    for (uint32_t i = 0; i < block->num_ops; ++i)
+        block->ops[i].kind = checked_kind((OpKind)block->ops[i].kind);
+    block->guard.on = false;
+    block->native = NULL;
+    block->heat = 0;
+}
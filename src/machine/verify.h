@@ -0,0 +1,53 @@
+/**
+ * A static pass over translated blocks that proves which of their loads
+ * and stores can't fault, so the block engine and the JIT can run them
+ * without checking their addresses.
+ *
+ * It follows the ops of a block from its start, tracking which registers
+ * hold lis constants and which hold $30 plus a known offset. An access
+ * through a constant is safe if the constant address is an aligned word
+ * in memory and not mapped I/O. An access through $30 is safe if the
+ * block's guard holds: $30 is aligned and far enough inside memory for
+ * every such access in the block. Stack pointer adjustments through a
+ * register the block doesn't set (like the $4 holding 4 that CS 241 code
+ * pushes and pops with) are taken to have the value they had when the
+ * block was translated, and the guard checks that too. An access
+ * through such a register counts as guarded, since it's only safe while
+ * the guard holds.
+ *
+ * A block whose guard doesn't hold is single-stepped through
+ * step_machine, so faults are reported just as they would be otherwise.
+ * One whose guard keeps failing is put back to checking everything.
+ */
+#ifndef VERIFY_H__
+#define VERIFY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "machine/block.h"
+#include "machine/machine.h"
+
+// times a guard can fail before its block goes back to checked ops
+#define GUARD_FAILURE_LIMIT 8
+
+// Turns the accesses in a freshly translated block that can't fault
+//   into safe ops, setting up its guard if any of them need one.
+void verify_block(const Machine *machine, Block *block);
+
+// Turns a block's safe ops back into checked ones and drops its guard.
+//   Its compiled code, which has the safe ops built in, is forgotten.
+void unverify_block(Block *block);
+
+// Whether a block's guard holds for the machine as it is now.
+static inline bool guard_holds(const BlockGuard *guard, const Machine *machine) {
+    const uint32_t sp = machine->registers[30];
+    if (sp % 4 != 0)
+        return false;
+    for (uint8_t i = 0; i < guard->num_assumed; ++i)
+        if (machine->registers[guard->assumed_regs[i]] != guard->assumed_values[i])
+            return false;
+    return (int64_t)sp + guard->lo >= 0
+           && (uint64_t)((int64_t)sp + guard->hi + 4) <= guard->limit;
+}
+
+#endif
@@ -0,0 +1,514 @@
+/**
+ * Runs many programs against their inputs in parallel and checks the
+ * results, in one process.
+ *
+ * Usage: mips241-batch [-j threads] [-q] manifest...
+ *
+ * Each line of a manifest is a job: a program file followed by any of
+ *     input=FILE     bytes the program reads (nothing by default)
+ *     expect=FILE    everything the legacy frontend would print: output,
+ *                    registers and status
+ *     output=FILE    only the output the program writes
+ *     $N=VALUE       the value register N must end up with
+ *     load-at=ADDR   where to load the program (0 by default)
+ *     max-instructions=COUNT
+ * Paths are relative to the manifest. A line with nothing but a program
+ * expects expect/<program stem>.expect, so runtest.sh configs of machine
+ * code run in basic mode, like test/basic/basic.config, are manifests
+ * too. Programs are always loaded as machine code, and nothing sets up
+ * registers or arrays the way --mode twoints and array do, so the
+ * ascii, twoints and array configs aren't. Blank lines and lines
+ * starting with # are skipped.
+ *
+ * Jobs are spread across threads that steal work from each other once
+ * their own runs out. Each thread reuses one Machine for all of its jobs.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "emulator/emulator.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+#include "machine/machine.h"
+
+#define STACK_ADDRESS 0x01000000 // $30 starts here, like the frontends
+#define MAX_REG_CHECKS 32
+
+typedef struct Job {
+    char *name;             // as written in the manifest
+    char *program;
+    char *input;            // all NULL when not given
+    char *expect;
+    char *output;
+    uint32_t load_at;
+    uint64_t max_instructions;
+    uint8_t num_reg_checks;
+    uint8_t reg_index[MAX_REG_CHECKS];
+    uint32_t reg_value[MAX_REG_CHECKS];
+
+    // results
+    bool passed;
+    char *message;          // why it failed
+    uint64_t retired;
+    double seconds;
+} Job;
+
+typedef struct Jobs {
+    Job *jobs;
+    size_t count;
+    size_t cap;
+} Jobs;
+
+typedef struct Worker {
+    pthread_mutex_t lock;
+    size_t next;            // jobs [next, end) are queued here
+    size_t end;
+    pthread_t thread;
+    struct Runner *runner;
+} Worker;
+
+typedef struct Runner {
+    Job *jobs;
+    Worker *workers;
+    size_t num_workers;
+} Runner;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xmalloc(size_t bytes) {
+    void *p = malloc(bytes);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s) {
+    char *copy = xmalloc(strlen(s) + 1);
+    strcpy(copy, s);
+    return copy;
+}
+
+static char *format(const char *fmt, const char *arg) {
+    const size_t len = strlen(fmt) + strlen(arg) + 1;
+    char *s = xmalloc(len);
+    snprintf(s, len, fmt, arg);
+    return s;
+}
+
+// Returns dir/path, or path if it is absolute
+static char *relative_to(const char *dir, const char *path) {
+    if (path[0] == '/' || dir[0] == '\0')
+        return xstrdup(path);
+    char *joined = xmalloc(strlen(dir) + strlen(path) + 2);
+    sprintf(joined, "%s/%s", dir, path);
+    return joined;
+}
+
+// Reads a whole file. Returns NULL if it can't.
+static uint8_t *read_file(const char *filename, size_t *len) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return NULL;
+
+    size_t cap = 4096;
+    uint8_t *bytes = xmalloc(cap);
+    *len = 0;
+    size_t got;
+    while ((got = fread(bytes + *len, 1, cap - *len, f)) != 0) {
+        *len += got;
+        if (*len == cap) {
+            cap *= 2;
+            uint8_t *grown = realloc(bytes, cap);
+            if (grown == NULL) {
+                free(bytes);
+                fclose(f);
+                return NULL;
+            }
+            bytes = grown;
+        }
+    }
+    fclose(f);
+    return bytes;
+}
+
+
+/*
+ * Manifests
+ */
+
+static Job *add_job(Jobs *jobs) {
+    if (jobs->count == jobs->cap) {
+        jobs->cap = jobs->cap == 0 ? 64 : jobs->cap * 2;
+        Job *grown = realloc(jobs->jobs, jobs->cap * sizeof(Job));
+        if (grown == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        jobs->jobs = grown;
+    }
+    Job *job = &jobs->jobs[jobs->count++];
+    memset(job, 0, sizeof(Job));
+    job->max_instructions = UINT64_MAX;
+    return job;
+}
+
+// Fills in one option of a job. Returns false if it doesn't make sense.
+static bool parse_option(Job *job, const char *dir, char *option) {
+    char *value = strchr(option, '=');
+    if (value == NULL)
+        return false;
+    *value++ = '\0';
+
+    char *end;
+    errno = 0;
+    if (strcmp(option, "input") == 0) {
+        job->input = relative_to(dir, value);
+    } else if (strcmp(option, "expect") == 0) {
+        job->expect = relative_to(dir, value);
+    } else if (strcmp(option, "output") == 0) {
+        job->output = relative_to(dir, value);
+    } else if (strcmp(option, "load-at") == 0) {
+        const unsigned long addr = strtoul(value, &end, 0);
+        if (*end != '\0' || errno != 0 || addr > UINT32_MAX || addr % 4 != 0)
+            return false;
+        job->load_at = (uint32_t)addr;
+    } else if (strcmp(option, "max-instructions") == 0) {
+        job->max_instructions = strtoull(value, &end, 0);
+        if (*end != '\0' || errno != 0)
+            return false;
+    } else if (option[0] == '$') {
+        const unsigned long reg = strtoul(option + 1, &end, 10);
+        if (*end != '\0' || reg >= NUM_REGISTERS
+            || job->num_reg_checks == MAX_REG_CHECKS)
+            return false;
+        const unsigned long long word = strtoull(value, &end, 0);
+        if (*end != '\0' || errno != 0 || word > UINT32_MAX)
+            return false;
+        job->reg_index[job->num_reg_checks] = (uint8_t)reg;
+        job->reg_value[job->num_reg_checks++] = (uint32_t)word;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void read_manifest(Jobs *jobs, const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open manifest %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    char *dir = xstrdup(filename);
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    else
+        dir[0] = '\0';
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    for (unsigned lineno = 1; getline(&line, &line_cap, f) != -1; ++lineno) {
+        char *token = strtok(line, " \t\r\n");
+        if (token == NULL || token[0] == '#')
+            continue;
+
+        Job *job = add_job(jobs);
+        job->name = xstrdup(token);
+        job->program = relative_to(dir, token);
+        while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+            if (!parse_option(job, dir, token)) {
+                fprintf(stderr, "%s:%u: bad option %s\n", filename, lineno, token);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (job->expect == NULL && job->output == NULL && job->num_reg_checks == 0) {
+            char *stem = xstrdup(job->name);
+            char *dot = strrchr(stem, '.');
+            if (dot != NULL && strchr(dot, '/') == NULL)
+                *dot = '\0';
+            char *expect = format("expect/%s.expect", stem);
+            job->expect = relative_to(dir, expect);
+            free(expect);
+            free(stem);
+        }
+    }
+
+    free(line);
+    free(dir);
+    fclose(f);
+}
+
+
+/*
+ * Running jobs
+ */
+
+// Appends what the legacy frontend prints after a run
+static char *legacy_report(Machine *m, EmulatorStatus status,
+                           const uint8_t *output, size_t output_len, size_t *len) {
+    const char *status_line = status_string(status.retcode);
+    const size_t cap = output_len + NUM_REGISTERS * 32 + strlen(status_line) + 2;
+    char *report = xmalloc(cap);
+
+    memcpy(report, output, output_len);
+    size_t used = output_len;
+    for (uint8_t i = 0; i < NUM_REGISTERS; ++i)
+        used += sprintf(report + used, "register %2d: 0x%08x\n", i, m->registers[i]);
+    used += sprintf(report + used, "%s\n", status_line);
+    *len = used;
+    return report;
+}
+
+// Returns NULL if actual matches the contents of filename, or why not
+static char *compare_file(const char *filename, const void *actual, size_t len) {
+    size_t expected_len;
+    uint8_t *expected = read_file(filename, &expected_len);
+    if (expected == NULL)
+        return format("unable to read %s", filename);
+
+    char *message = NULL;
+    size_t i = 0;
+    while (i < len && i < expected_len && ((const uint8_t *)actual)[i] == expected[i])
+        ++i;
+    if (i != len || i != expected_len) {
+        const size_t message_len = strlen(filename) + 64;
+        message = xmalloc(message_len);
+        snprintf(message, message_len, "differs from %s at byte %zu", filename, i);
+    }
+    free(expected);
+    return message;
+}
+
+static void run_job(Machine *m, Job *job) {
+    const double start = now();
+    job->passed = false;
+
+    FILE *program = fopen(job->program, "rb");
+    if (program == NULL || fseek(program, 0, SEEK_END) != 0) {
+        if (program != NULL)
+            fclose(program);
+        job->message = format("unable to read %s", job->program);
+        return;
+    }
+    const size_t program_len = (size_t)ftell(program);
+    rewind(program);
+    // load_program gives up on the whole process if it doesn't fit
+    if (job->load_at / 4 > m->mem_size
+        || program_len / 4 > m->mem_size - job->load_at / 4) {
+        fclose(program);
+        job->message = xstrdup("program is too big");
+        return;
+    }
+
+    size_t input_len = 0;
+    uint8_t *input = NULL;
+    if (job->input != NULL && (input = read_file(job->input, &input_len)) == NULL) {
+        fclose(program);
+        job->message = format("unable to read %s", job->input);
+        return;
+    }
+
+    const uint32_t end_address = load_program(program, m, job->load_at);
+    m->registers[30] = end_address > STACK_ADDRESS ? end_address : STACK_ADDRESS;
+    m_input_from_buffer(m, input, input_len);
+    free(input);
+    m_clear_captured_output(m);
+
+    const EmulatorStatus status = step_machine_n(m, job->max_instructions, &job->retired);
+
+    size_t output_len;
+    const uint8_t *output = m_captured_output(m, &output_len);
+    if (job->output != NULL)
+        job->message = compare_file(job->output, output, output_len);
+    if (job->message == NULL && job->expect != NULL) {
+        size_t report_len;
+        char *report = legacy_report(m, status, output, output_len, &report_len);
+        job->message = compare_file(job->expect, report, report_len);
+        free(report);
+    }
+    for (uint8_t i = 0; job->message == NULL && i < job->num_reg_checks; ++i) {
+        const uint8_t reg = job->reg_index[i];
+        if (m->registers[reg] != job->reg_value[i]) {
+            char message[80];
+            snprintf(message, sizeof(message), "$%u is 0x%08x, not 0x%08x",
+                     reg, m->registers[reg], job->reg_value[i]);
+            job->message = xstrdup(message);
+        }
+    }
+
+    job->passed = job->message == NULL;
+    job->seconds = now() - start;
+}
+
+
+// Takes the next job for a worker, stealing half of the largest queue
+//   when its own is empty. Returns false when there's nothing left.
+static bool take_job(Worker *self, size_t *job) {
+    Runner *const runner = self->runner;
+
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        if (self->next < self->end) {
+            *job = self->next++;
+            pthread_mutex_unlock(&self->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        Worker *victim = NULL;
+        size_t most = 0;
+        for (size_t i = 0; i < runner->num_workers; ++i) {
+            Worker *other = &runner->workers[i];
+            pthread_mutex_lock(&other->lock);
+            const size_t queued = other->end - other->next;
+            pthread_mutex_unlock(&other->lock);
+            if (queued > most) {
+                most = queued;
+                victim = other;
+            }
+        }
+        if (victim == NULL)
+            return false;
+
+        // take the back half, the victim keeps going from the front
+        pthread_mutex_lock(&victim->lock);
+        const size_t queued = victim->end - victim->next;
+        size_t start = 0, end = 0;
+        if (queued > 0) {
+            start = victim->end - (queued + 1) / 2;
+            end = victim->end;
+            victim->end = start;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (start < end) {
+            pthread_mutex_lock(&self->lock);
+            self->next = start;
+            self->end = end;
+            pthread_mutex_unlock(&self->lock);
+        }
+    }
+}
+
+static void *work(void *arg) {
+    Worker *const self = arg;
+    Machine *m = NULL;
+    size_t job;
+
+    while (take_job(self, &job)) {
+        if (m == NULL) {
+            m = init_machine(0);
+            m_output_capture(m);
+        } else {
+            reset_machine(m);
+        }
+        run_job(m, &self->runner->jobs[job]);
+    }
+
+    destroy_machine(m);
+    return NULL;
+}
+
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-j threads] [-q] manifest...\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool quiet = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:q")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind == argc || threads < 1)
+        usage(argv[0]);
+
+    init_emulator();
+    Jobs jobs = { 0 };
+    for (int i = optind; i < argc; ++i)
+        read_manifest(&jobs, argv[i]);
+    if ((size_t)threads > jobs.count)
+        threads = jobs.count > 0 ? (long)jobs.count : 1;
+
+    // deal out contiguous runs of jobs, workers steal to even them out
+    Runner runner = { jobs.jobs, xmalloc(threads * sizeof(Worker)), (size_t)threads };
+    for (long i = 0; i < threads; ++i) {
+        Worker *w = &runner.workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->next = jobs.count * i / threads;
+        w->end = jobs.count * (i + 1) / threads;
+        w->runner = &runner;
+    }
+
+    const double start = now();
+    for (long i = 0; i < threads; ++i) {
+        if (pthread_create(&runner.workers[i].thread, NULL, work, &runner.workers[i]) != 0) {
+            fprintf(stderr, "Unable to start a worker thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (long i = 0; i < threads; ++i)
+        pthread_join(runner.workers[i].thread, NULL);
+    const double elapsed = now() - start;
+
+    size_t passed = 0;
+    uint64_t retired = 0;
+    for (size_t i = 0; i < jobs.count; ++i) {
+        const Job *job = &jobs.jobs[i];
+        passed += job->passed;
+        retired += job->retired;
+        if (!job->passed)
+            printf("FAIL %s: %s\n", job->name, job->message);
+        else if (!quiet)
+            printf("PASS %s: %.3f ms, %" PRIu64 " instructions\n",
+                   job->name, job->seconds * 1e3, job->retired);
+    }
+    printf("%zu/%zu passed in %.3f s on %ld threads, %" PRIu64 " instructions\n",
+           passed, jobs.count, elapsed, threads, retired);
+
+    for (size_t i = 0; i < jobs.count; ++i) {
+        Job *job = &jobs.jobs[i];
+        free(job->name);
+        free(job->program);
+        free(job->input);
+        free(job->expect);
+        free(job->output);
+        free(job->message);
+    }
+    for (long i = 0; i < threads; ++i)
+        pthread_mutex_destroy(&runner.workers[i].lock);
+    free(runner.workers);
+    free(jobs.jobs);
+
+    return passed == jobs.count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,22 @@
+/**
+ * Prints an execution trace written by step_machine_traced as text.
+ *
+ * Usage: mips241-trace tracefile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "machine/trace.h"
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s tracefile\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!trace_print(argv[1], stdout)) {
+        fflush(stdout);
+        fprintf(stderr, "%s: can't read the trace in %s\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,550 @@
+/**
+ * Sweeps every encoding of every instruction template through an engine
+ * and checks it against a reference model, on all cores.
+ *
+ * Usage: opcode_sweep [-e step|blocks|jit|threaded] [-j threads] [-s stride]
+ *                     [-t trials] [-m max-reported] template-file...
+ *
+ * A template is a line of 32 characters, 0, 1 or x, like those in
+ * opcodes-template.txt; each x is a bit to try both ways. Each encoding
+ * is run trials times (1 by default), from a random pc with random
+ * registers, hi and lo, which are biased so that loads, stores and jumps
+ * often land in memory, on the mapped I/O addresses and on edge cases of
+ * division. Every other word of memory holds an invalid instruction, so a
+ * run stops right after the instruction under test, or after two of them
+ * if it branches back to itself. run_threaded has no budget, so for it
+ * the reference runs until it stops as well, and the few trials that
+ * don't stop within MAX_THREADED_STEPS instructions are let go.
+ *
+ * The reference model below is written straight from the instruction set,
+ * sharing no code with the engines. A stride of N tries every Nth
+ * encoding, for quick runs.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "common/defs.h"
+#include "machine/block.h"
+#include "machine/engine.h"
+#include "machine/impl.h"
+#include "machine/io.h"
+#include "machine/machine.h"
+
+#define SWEEP_MEMORY_BYTES 65536
+#define SWEEP_WORDS (SWEEP_MEMORY_BYTES / 4)
+#define CHUNK_ENCODINGS 65536
+#define MAX_TEMPLATES 256
+#define INPUT_BYTE 'Z'
+#define MAX_THREADED_STEPS 8
+// the trial's word and the one after, and a store per instruction run
+#define MAX_WRITTEN (2 + MAX_THREADED_STEPS)
+
+typedef struct Template {
+    char text[33];
+    uint32_t fixed;     // the 1 bits
+    uint32_t mask;      // the x bits
+    uint64_t count;     // encodings tried, after the stride
+
+    // results
+    uint64_t trials;
+    uint64_t mismatches;
+} Template;
+
+enum engine { ENGINE_STEP, ENGINE_BLOCKS, ENGINE_JIT, ENGINE_THREADED };
+
+static struct {
+    Template templates[MAX_TEMPLATES];
+    size_t num_templates;
+    enum engine engine;
+    uint64_t stride;
+    uint32_t trials;
+    uint64_t max_reported;
+
+    pthread_mutex_t lock;
+    size_t next_template;   // next chunk to hand out
+    uint64_t next_start;
+    uint64_t reported;
+} sweep;
+
+
+static inline uint64_t next_random(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+// What memory holds outside of the words a trial sets: invalid
+//   instructions (opcode 0x3F), different at every address
+static inline uint32_t pattern(uint32_t idx) {
+    return 0xFC000000u | ((idx * 2654435761u) >> 6);
+}
+
+// The encoding numbered i of a template
+static uint32_t encoding(const Template *t, uint64_t i) {
+    uint32_t word = t->fixed;
+    for (uint32_t bit = 1; bit != 0 && i != 0; bit <<= 1) {
+        if (t->mask & bit) {
+            if (i & 1)
+                word |= bit;
+            i >>= 1;
+        }
+    }
+    return word;
+}
+
+
+// The reference model: a machine whose memory is the pattern, but for
+//   a few words
+typedef struct RefMachine {
+    uint32_t regs[NUM_REGISTERS];
+    uint32_t pc;
+    uint32_t hi;
+    uint32_t lo;
+    uint32_t written_idx[MAX_WRITTEN];
+    uint32_t written[MAX_WRITTEN];
+    uint32_t num_written;
+    uint64_t output_count;
+    uint8_t output_last;
+} RefMachine;
+
+static uint32_t ref_load(const RefMachine *r, uint32_t idx) {
+    for (uint32_t i = r->num_written; i-- > 0; )
+        if (r->written_idx[i] == idx)
+            return r->written[i];
+    return pattern(idx);
+}
+
+static void ref_store(RefMachine *r, uint32_t idx, uint32_t value) {
+    for (uint32_t i = 0; i < r->num_written; ++i) {
+        if (r->written_idx[i] == idx) {
+            r->written[i] = value;
+            return;
+        }
+    }
+    r->written_idx[r->num_written] = idx;
+    r->written[r->num_written++] = value;
+}
+
+static EmulatorStatus ref_status(enum instruction_retcode retcode, uint32_t pc) {
+    return (EmulatorStatus) { retcode, pc };
+}
+
+static EmulatorStatus ref_step(RefMachine *r) {
+    const uint32_t pc = r->pc;
+    if (pc % 4 != 0)
+        return ref_status(IR_UNALIGNED_INSTRUCTION_FETCH, pc);
+    if (pc == RETURN_ADDRESS)
+        return ref_status(IR_DONE, pc);
+    if (pc / 4 >= SWEEP_WORDS)
+        return ref_status(IR_OUT_OF_RANGE_INSTRUCTION_FETCH, pc);
+
+    const uint32_t word = ref_load(r, pc / 4);
+    const uint32_t opcode = word >> 26;
+    const uint32_t s = (word >> 21) & 31, t = (word >> 16) & 31, d = (word >> 11) & 31;
+    const uint32_t rs = r->regs[s], rt = r->regs[t];
+    r->pc = pc + 4;
+
+    if (opcode == 0) {
+        switch (word & 63) {
+            case 0x20: r->regs[d] = rs + rt; break;
+            case 0x22: r->regs[d] = rs - rt; break;
+            case 0x18: {
+                const int64_t product = (int64_t)(int32_t)rs * (int32_t)rt;
+                r->hi = (uint32_t)((uint64_t)product >> 32);
+                r->lo = (uint32_t)product;
+                break;
+            }
+            case 0x19: {
+                const uint64_t product = (uint64_t)rs * rt;
+                r->hi = (uint32_t)(product >> 32);
+                r->lo = (uint32_t)product;
+                break;
+            }
+            case 0x1A:
+                // by zero changes nothing; the one overflow wraps
+                if (rt != 0) {
+                    const int64_t q = (int64_t)(int32_t)rs / (int32_t)rt;
+                    r->lo = (uint32_t)q;
+                    r->hi = (uint32_t)((int64_t)(int32_t)rs - q * (int32_t)rt);
+                }
+                break;
+            case 0x1B:
+                if (rt != 0) {
+                    r->lo = rs / rt;
+                    r->hi = rs % rt;
+                }
+                break;
+            case 0x10: r->regs[d] = r->hi; break;
+            case 0x12: r->regs[d] = r->lo; break;
+            case 0x14:
+                if (r->pc / 4 >= SWEEP_WORDS)
+                    return ref_status(IR_OUT_OF_RANGE_INSTRUCTION_FETCH, r->pc);
+                r->regs[d] = ref_load(r, r->pc / 4);
+                r->pc += 4;
+                break;
+            case 0x2A: r->regs[d] = (int32_t)rs < (int32_t)rt; break;
+            case 0x2B: r->regs[d] = rs < rt; break;
+            case 0x08: r->pc = rs; break;
+            case 0x09: r->regs[31] = r->pc; r->pc = rs; break;
+            default: return ref_status(IR_INVALID_INSTRUCTION, pc);
+        }
+    } else {
+        const uint32_t offset = (uint32_t)(int32_t)(int16_t)(word & 0xFFFF);
+        const uint32_t addr = rs + offset;
+        if (opcode == 0x23 || opcode == 0x2B) {
+            const bool mapped = (opcode == 0x23 && addr == 0xFFFF000Cu)
+                                || (opcode == 0x2B && addr == 0xFFFF0004u);
+            if (!mapped && addr / 4 >= SWEEP_WORDS)
+                return ref_status(IR_OUT_OF_RANGE_MEMORY_ACCESS, addr);
+            if (addr % 4 != 0)
+                return ref_status(IR_UNALIGNED_MEMORY_ACCESS, addr);
+        }
+        switch (opcode) {
+            case 0x23:
+                r->regs[t] = addr == 0xFFFF000Cu ? INPUT_BYTE : ref_load(r, addr / 4);
+                break;
+            case 0x2B:
+                if (addr == 0xFFFF0004u) {
+                    r->output_count++;
+                    r->output_last = (uint8_t)rt;
+                } else {
+                    ref_store(r, addr / 4, rt);
+                }
+                break;
+            case 0x04: if (rs == rt) r->pc += offset * 4; break;
+            case 0x05: if (rs != rt) r->pc += offset * 4; break;
+            default: return ref_status(IR_INVALID_INSTRUCTION, pc);
+        }
+    }
+    r->regs[0] = 0;
+    return ref_status(IR_SUCCESS, r->pc);
+}
+
+
+typedef struct Worker {
+    pthread_t thread;
+    Machine *machine;
+    uint64_t output_count;
+    uint8_t output_last;
+} Worker;
+
+static size_t read_input(void *ctx, uint8_t *buf, size_t cap) {
+    (void)ctx;
+    memset(buf, INPUT_BYTE, cap);
+    return cap;
+}
+
+static void write_output(void *ctx, const uint8_t *bytes, size_t len) {
+    Worker *w = ctx;
+    if (len != 0) {
+        w->output_count += len;
+        w->output_last = bytes[len - 1];
+    }
+}
+
+// A register value to start with, often one that matters to the
+//   instruction: an address in memory for offset, the mapped addresses,
+//   or an edge of division
+static uint32_t random_value(uint64_t *rng, int32_t offset) {
+    const uint64_t x = next_random(rng);
+    switch (x % 16) {
+        case 0: case 1: case 2: case 3:
+            return (uint32_t)((x >> 8) % SWEEP_WORDS) * 4 - (uint32_t)offset;
+        case 4: return 0xFFFF000Cu - (uint32_t)offset;
+        case 5: return 0xFFFF0004u - (uint32_t)offset;
+        case 6: return 0;
+        case 7: return 0xFFFFFFFFu;
+        case 8: return 0x80000000u;
+        case 9: return RETURN_ADDRESS;
+        default: return (uint32_t)(x >> 16);
+    }
+}
+
+// Runs the engine under test for at most two instructions, or until it
+//   stops for run_threaded
+static EmulatorStatus run_engine(Machine *m) {
+    EmulatorStatus status;
+    if (sweep.engine == ENGINE_THREADED) {
+        status = run_threaded(m);
+    } else if (sweep.engine == ENGINE_STEP) {
+        status = step_machine(m);
+        if (status.retcode == IR_SUCCESS)
+            status = step_machine(m);
+        if (status.retcode == IR_SUCCESS)
+            status = (EmulatorStatus) { IR_BUDGET_EXHAUSTED, m->pc };
+    } else {
+        uint64_t retired;
+        status = run_blocks(m, 2, &retired);
+    }
+    m_flush_output(m);
+    return status;
+}
+
+static void report(const Template *t, uint32_t word, const RefMachine *start,
+                   EmulatorStatus got, EmulatorStatus want, const char *what) {
+    pthread_mutex_lock(&sweep.lock);
+    if (sweep.reported++ < sweep.max_reported) {
+        printf("mismatch in %s: word 0x%08x at pc 0x%08x: %s "
+               "(got retcode %d pc 0x%08x, expected retcode %d pc 0x%08x)\n",
+               t->text, word, start->pc, what, got.retcode, got.pc, want.retcode, want.pc);
+        printf("    registers:");
+        for (uint32_t i = 0; i < NUM_REGISTERS; ++i)
+            printf("%s $%u=0x%08x", i % 8 == 0 ? "\n    " : "", i, start->regs[i]);
+        printf("\n    hi=0x%08x lo=0x%08x\n", start->hi, start->lo);
+    }
+    pthread_mutex_unlock(&sweep.lock);
+}
+
+// Runs word once; returns whether the engine agreed with the reference
+static bool trial(Worker *w, const Template *t, uint32_t word, uint64_t *rng) {
+    Machine *m = w->machine;
+    RefMachine ref = { { 0 }, 0, 0, 0, { 0 }, { 0 }, 0, 0, 0 };
+
+    // a pc with room for a lis constant, now and then without
+    const uint64_t x = next_random(rng);
+    ref.pc = x % 64 == 0 ? SWEEP_MEMORY_BYTES - 4
+                         : (uint32_t)((x >> 8) % (SWEEP_WORDS - 1)) * 4;
+    const int32_t offset = (word >> 26) != 0 ? (int16_t)(word & 0xFFFF) : 0;
+    for (uint32_t i = 1; i < NUM_REGISTERS; ++i)
+        ref.regs[i] = random_value(rng, offset);
+    ref.hi = random_value(rng, 0);
+    ref.lo = random_value(rng, 0);
+    ref_store(&ref, ref.pc / 4, word);
+    if (ref.pc / 4 + 1 < SWEEP_WORDS)
+        ref_store(&ref, ref.pc / 4 + 1, (uint32_t)next_random(rng));
+    const RefMachine start = ref;
+
+    for (uint32_t i = 0; i < ref.num_written; ++i)
+        m_write_word(m, ref.written_idx[i], ref.written[i]);
+    memcpy(m->registers, ref.regs, sizeof(m->registers));
+    m->pc = ref.pc;
+    m->hi = ref.hi;
+    m->lo = ref.lo;
+    w->output_count = 0;
+
+    EmulatorStatus want = ref_step(&ref);
+    if (sweep.engine == ENGINE_THREADED) {
+        for (uint32_t n = 1; want.retcode == IR_SUCCESS && n < MAX_THREADED_STEPS; ++n)
+            want = ref_step(&ref);
+    } else {
+        if (want.retcode == IR_SUCCESS)
+            want = ref_step(&ref);
+        if (want.retcode == IR_SUCCESS)
+            want = ref_status(IR_BUDGET_EXHAUSTED, ref.pc);
+    }
+    // still running, so run_threaded might never come back; nothing
+    //   has run on m, so its memory only needs the trial's words back
+    if (want.retcode == IR_SUCCESS) {
+        m_write_word(m, start.pc / 4, pattern(start.pc / 4));
+        if (start.pc / 4 + 1 < SWEEP_WORDS)
+            m_write_word(m, start.pc / 4 + 1, pattern(start.pc / 4 + 1));
+        return true;
+    }
+    const EmulatorStatus got = run_engine(m);
+
+    const char *what = NULL;
+    if (got.retcode != want.retcode || got.pc != want.pc)
+        what = "status";
+    else if (want.retcode == IR_BUDGET_EXHAUSTED && m->pc != ref.pc)
+        what = "pc";
+    else if (memcmp(m->registers, ref.regs, sizeof(ref.regs)) != 0)
+        what = "registers";
+    else if (m->hi != ref.hi || m->lo != ref.lo)
+        what = "hi/lo";
+    else if (w->output_count != ref.output_count
+             || (ref.output_count != 0 && w->output_last != ref.output_last))
+        what = "output";
+    for (uint32_t i = 0; i < ref.num_written; ++i)
+        if (what == NULL && m->mem[ref.written_idx[i]] != ref.written[i])
+            what = "memory";
+    if (what != NULL)
+        report(t, word, &start, got, want, what);
+
+    // put memory back the way it was
+    for (uint32_t i = 0; i < ref.num_written; ++i)
+        m_write_word(m, ref.written_idx[i], pattern(ref.written_idx[i]));
+    return what == NULL;
+}
+
+// Takes the next chunk of encodings, as a template and a range of them
+static bool take_chunk(Template **t, uint64_t *start, uint64_t *end) {
+    pthread_mutex_lock(&sweep.lock);
+    while (sweep.next_template < sweep.num_templates
+           && sweep.next_start >= sweep.templates[sweep.next_template].count) {
+        sweep.next_template++;
+        sweep.next_start = 0;
+    }
+    const bool found = sweep.next_template < sweep.num_templates;
+    if (found) {
+        *t = &sweep.templates[sweep.next_template];
+        *start = sweep.next_start;
+        *end = *start + CHUNK_ENCODINGS < (*t)->count ? *start + CHUNK_ENCODINGS : (*t)->count;
+        sweep.next_start = *end;
+    }
+    pthread_mutex_unlock(&sweep.lock);
+    return found;
+}
+
+static void *work(void *arg) {
+    Worker *const w = arg;
+    w->machine = init_machine(SWEEP_MEMORY_BYTES);
+    for (uint32_t i = 0; i < SWEEP_WORDS; ++i)
+        m_write_word(w->machine, i, pattern(i));
+    m_input_from_callback(w->machine, read_input, NULL);
+    m_output_to_callback(w->machine, write_output, w);
+    if (sweep.engine == ENGINE_JIT)
+        block_cache(w->machine)->jit_threshold = 1;
+
+    Template *t;
+    uint64_t start, end;
+    while (take_chunk(&t, &start, &end)) {
+        // the same chunk always gets the same random state
+        uint64_t rng = (start + 1) * 0x9E3779B97F4A7C15ull ^ (uint64_t)(t - sweep.templates);
+        uint64_t trials = 0, mismatches = 0;
+        for (uint64_t i = start; i < end; ++i) {
+            const uint32_t word = encoding(t, i * sweep.stride);
+            for (uint32_t k = 0; k < sweep.trials; ++k) {
+                mismatches += !trial(w, t, word, &rng);
+                ++trials;
+            }
+        }
+
+        pthread_mutex_lock(&sweep.lock);
+        t->trials += trials;
+        t->mismatches += mismatches;
+        pthread_mutex_unlock(&sweep.lock);
+    }
+
+    destroy_machine(w->machine);
+    return NULL;
+}
+
+
+static bool read_templates(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "can't open %s\n", filename);
+        return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (strlen(line) != 32 || strspn(line, "01x") != 32
+            || sweep.num_templates == MAX_TEMPLATES) {
+            fprintf(stderr, "%s: bad template \"%s\"\n", filename, line);
+            fclose(f);
+            return false;
+        }
+
+        Template *t = &sweep.templates[sweep.num_templates++];
+        memset(t, 0, sizeof(*t));
+        strcpy(t->text, line);
+        uint32_t xs = 0;
+        for (int i = 0; i < 32; ++i) {
+            const uint32_t bit = 1u << (31 - i);
+            if (line[i] == '1')
+                t->fixed |= bit;
+            else if (line[i] == 'x') {
+                t->mask |= bit;
+                ++xs;
+            }
+        }
+        t->count = ((1ull << xs) + sweep.stride - 1) / sweep.stride;
+    }
+    fclose(f);
+    return true;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-e step|blocks|jit|threaded] [-j threads] [-s stride] [-t trials] "
+            "[-m max-reported] template-file...\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    sweep.engine = ENGINE_STEP;
+    sweep.stride = 1;
+    sweep.trials = 1;
+    sweep.max_reported = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:j:s:t:m:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "step") == 0)
+                    sweep.engine = ENGINE_STEP;
+                else if (strcmp(optarg, "blocks") == 0)
+                    sweep.engine = ENGINE_BLOCKS;
+                else if (strcmp(optarg, "jit") == 0)
+                    sweep.engine = ENGINE_JIT;
+                else if (strcmp(optarg, "threaded") == 0)
+                    sweep.engine = ENGINE_THREADED;
+                else
+                    usage(argv[0]);
+                break;
+            case 'j': threads = strtol(optarg, NULL, 10); break;
+            case 's': sweep.stride = strtoull(optarg, NULL, 10); break;
+            case 't': sweep.trials = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'm': sweep.max_reported = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind == argc || sweep.stride == 0 || sweep.trials == 0)
+        usage(argv[0]);
+    if (threads < 1)
+        threads = 1;
+    for (int i = optind; i < argc; ++i)
+        if (!read_templates(argv[i]))
+            return EXIT_FAILURE;
+
+    pthread_mutex_init(&sweep.lock, NULL);
+    Worker *workers = calloc((size_t)threads, sizeof(Worker));
+    if (workers == NULL)
+        return EXIT_FAILURE;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "can't start a thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (long i = 0; i < threads; ++i)
+        pthread_join(workers[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    const double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    uint64_t encodings = 0, trials = 0, mismatches = 0;
+    printf("%-32s %12s %12s %10s\n", "template", "encodings", "trials", "mismatches");
+    for (size_t i = 0; i < sweep.num_templates; ++i) {
+        const Template *t = &sweep.templates[i];
+        printf("%-32s %12" PRIu64 " %12" PRIu64 " %10" PRIu64 "\n",
+               t->text, t->count, t->trials, t->mismatches);
+        encodings += t->count;
+        trials += t->trials;
+        mismatches += t->mismatches;
+    }
+    printf("%" PRIu64 " encodings, %" PRIu64 " trials, %" PRIu64 " mismatches "
+           "in %.2f s on %ld threads: %.2f M trials/s\n",
+           encodings, trials, mismatches, seconds, threads, trials / seconds / 1e6);
+
+    free(workers);
+    pthread_mutex_destroy(&sweep.lock);
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
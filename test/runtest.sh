@@ -1,21 +1,38 @@
 #!/usr/bin/env sh
 
 # Smells like runscript from CS246
+#
+# Usage: runtest.sh binary config [racket|file [options...]]
+# racket or file passes each program to binary by name, with options
+# before it, rather than on standard input. A program's standard input
+# is then its stem with .in, if there is one.
 
 failed=0
+binary="${1}"
+config="${2}"
+mode="${3}"
+if [ $# -gt 3 ]; then
+    shift 3
+else
+    shift $#
+fi
 
 # absolute path to directory containing the config file
-path_prefix=$(readlink -f $(dirname "${2}"))
+path_prefix=$(readlink -f $(dirname "${config}"))
 # other test files are relative to $path_prefix
 
 while read filename; do
     OUTFILE=$(mktemp)
     STEM=${filename%.*}
     EXPECTFILE="$path_prefix/expect/${STEM}.expect"
-    if [ "${3}" = "racket" ]; then
-        "${1}" "${path_prefix}/${filename}" > "${OUTFILE}" 2>&1
+    INFILE="$path_prefix/${STEM}.in"
+    if [ "${mode}" = "racket" ] || [ "${mode}" = "file" ]; then
+        if [ ! -f "${INFILE}" ]; then
+            INFILE=/dev/null
+        fi
+        "${binary}" "$@" "${path_prefix}/${filename}" < "${INFILE}" > "${OUTFILE}" 2>&1
     else
-        "${1}" < "${path_prefix}/${filename}" > "${OUTFILE}" 2>&1
+        "${binary}" < "${path_prefix}/${filename}" > "${OUTFILE}" 2>&1
     fi
 
     cmp "${OUTFILE}" "${EXPECTFILE}"
@@ -26,6 +43,6 @@ while read filename; do
     fi
 
     rm "${OUTFILE}"
-done < "${2}"
+done < "${config}"
 
 exit ${failed}
@@ -0,0 +1,213 @@
+#include "minunit.h"
+#include "assembler/assembler.h"
+#include "assembler/cache.h"
+#include "common/defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENC_R(FUNC, D, S, T) \
+    (((uint32_t)(S) << 21) | ((uint32_t)(T) << 16) | ((uint32_t)(D) << 11) \
+     | (uint32_t)(FUNC))
+#define ENC_I(OP, S, T, IMM) \
+    (((uint32_t)(OP) << 26) | ((uint32_t)(S) << 21) | ((uint32_t)(T) << 16) \
+     | (uint16_t)(IMM))
+
+#define LEN(ARRAY) (sizeof(ARRAY) / sizeof(ARRAY[0]))
+#define CACHE_DIR "test_asm_cache/nested"
+
+// Assembles source and checks it gives the words expected, big-endian
+static bool assembles_to(const char *source, const uint32_t *expected, size_t len) {
+    char error[128];
+    size_t code_len;
+    uint8_t *code = asm_assemble(source, strlen(source), &code_len, error, sizeof(error));
+    if (code == NULL) {
+        printf("%s\n", error);
+        return false;
+    }
+    bool same = code_len == len * 4;
+    for (size_t i = 0; same && i < len; ++i)
+        same = ((uint32_t)code[4 * i] << 24 | (uint32_t)code[4 * i + 1] << 16
+                | (uint32_t)code[4 * i + 2] << 8 | code[4 * i + 3]) == expected[i];
+    asm_free(code);
+    return same;
+}
+
+// Checks that source doesn't assemble, with error starting with message
+static bool fails_with(const char *source, const char *message) {
+    char error[128];
+    size_t code_len;
+    uint8_t *code = asm_assemble(source, strlen(source), &code_len, error, sizeof(error));
+    asm_free(code);
+    return code == NULL && strncmp(error, message, strlen(message)) == 0;
+}
+
+
+// Every instruction, as cs241.binasm assembles them
+static const char *test_instructions(void) {
+    mu_set_test_name();
+    static const char source[] =
+        "add $1, $2, $3\n"
+        "sub $4,$5,$6\n"
+        "slt $7, $8, $9\n"
+        "sltu $10, $11, $12\n"
+        "mult $13, $14\n"
+        "multu $15, $16\n"
+        "div $17, $18\n"
+        "divu $19, $20\n"
+        "mfhi $21\n"
+        "mflo $22\n"
+        "lis $23\n"
+        "jr $31\n"
+        "jalr $24\n"
+        "beq $1, $2, -1\n"
+        "bne $3, $4, 0x10\n"
+        "lw $5, -4($30)\n"
+        "sw $6, 0xfffc($29)\n";
+    static const uint32_t expected[] = {
+        ENC_R(FUNC_ADD, 1, 2, 3), ENC_R(FUNC_SUB, 4, 5, 6),
+        ENC_R(FUNC_SLT, 7, 8, 9), ENC_R(FUNC_SLTU, 10, 11, 12),
+        ENC_R(FUNC_MULT, 0, 13, 14), ENC_R(FUNC_MULTU, 0, 15, 16),
+        ENC_R(FUNC_DIV, 0, 17, 18), ENC_R(FUNC_DIVU, 0, 19, 20),
+        ENC_R(FUNC_MFHI, 21, 0, 0), ENC_R(FUNC_MFLO, 22, 0, 0),
+        ENC_R(FUNC_LIS, 23, 0, 0),
+        ENC_R(FUNC_JR, 0, 31, 0), ENC_R(FUNC_JALR, 0, 24, 0),
+        ENC_I(OP_BEQ, 1, 2, -1), ENC_I(OP_BNE, 3, 4, 0x10),
+        ENC_I(OP_LW, 30, 5, -4), ENC_I(OP_SW, 29, 6, -4)
+    };
+    mu_assert(assembles_to(source, expected, LEN(expected)), "bad instruction encodings");
+    return NULL;
+}
+
+// .word, labels as branch targets and values, and comments
+static const char *test_words_and_labels(void) {
+    mu_set_test_name();
+    static const char source[] =
+        "; counts down from 3\n"
+        "start: lis $1 ; comment\n"
+        "       .word 3\n"
+        "loop:  sub $1, $1, $2\n"
+        "       bne $1, $0, loop\n"
+        "a: b:\n"
+        "       beq $0, $0, end\n"
+        "       .word end\n"
+        "       .word -1\n"
+        "       .word 4294967295\n"
+        "       .word 0xABCDEF01\n"
+        "end:   jr $31";
+    static const uint32_t expected[] = {
+        ENC_R(FUNC_LIS, 1, 0, 0), 3,
+        ENC_R(FUNC_SUB, 1, 1, 2),
+        ENC_I(OP_BNE, 1, 0, -2),
+        ENC_I(OP_BEQ, 0, 0, 4),
+        36, 0xffffffff, 0xffffffff, 0xabcdef01,
+        ENC_R(FUNC_JR, 0, 31, 0)
+    };
+    mu_assert(assembles_to(source, expected, LEN(expected)), "bad words or labels");
+    mu_assert(assembles_to("", NULL, 0), "empty source isn't an empty program");
+    return NULL;
+}
+
+// Errors name the line they're on
+static const char *test_errors(void) {
+    mu_set_test_name();
+    mu_assert(fails_with("add $1, $2, $3\nfoo $1\n", "line 2: unknown instruction"),
+              "unknown instruction");
+    mu_assert(fails_with("add $1, $2, $32", "line 1: bad register"), "register out of range");
+    mu_assert(fails_with("add $1, $2", "line 1: expected ','"), "missing operand");
+    mu_assert(fails_with("jr $31 $1", "line 1: expected the end"), "extra operand");
+    mu_assert(fails_with("beq $0, $0, 32768", "line 1: integer out of range"),
+              "immediate too big");
+    mu_assert(fails_with("lw $1, -32769($2)", "line 1: integer out of range"),
+              "immediate too small");
+    mu_assert(fails_with("lw $1, 0x10000($2)", "line 1: hex integer out of range"),
+              "hex immediate too big");
+    mu_assert(fails_with(".word 4294967296", "line 1: integer out of range"), "word too big");
+    mu_assert(fails_with("\n\nbne $1, $0, nowhere", "line 3: no such label: nowhere"),
+              "missing label");
+    mu_assert(fails_with("x: jr $31\nx: jr $31", "line 2: duplicate label: x"),
+              "duplicate label");
+    mu_assert(fails_with("lw $1, label($2)\nlabel:", "line 1: bad integer"),
+              "label as a memory offset");
+    return NULL;
+}
+
+// Branches reach 2^15 words either way, and no further
+static const char *test_branch_range(void) {
+    mu_set_test_name();
+    const size_t filler = 32768;
+    char *source = malloc(filler * 6 + 64);
+    mu_assert(source != NULL, "can't allocate the source");
+    strcpy(source, "beq $0, $0, far\n");
+    char *end = source + strlen(source);
+    for (size_t i = 0; i < filler; ++i, end += 6)
+        memcpy(end, "jr $0\n", 6);
+    strcpy(end, "far: jr $31\n");
+    const bool too_far = fails_with(source, "line 1: branch to far is too far");
+
+    // one word less reaches
+    memcpy(end - 6, "far: jr $31\n", 13);
+    char error[128];
+    size_t code_len;
+    uint8_t *code = asm_assemble(source, strlen(source), &code_len, error, sizeof(error));
+    const bool reaches = code != NULL && code[2] == 0x7f && code[3] == 0xff;
+    asm_free(code);
+    free(source);
+    mu_assert(too_far, "branch out of range assembled");
+    mu_assert(reaches, "branch in range didn't assemble");
+    return NULL;
+}
+
+// Puts code in a new directory, and only gets it back for the same source
+//   and tool
+static const char *test_cache(void) {
+    mu_set_test_name();
+    static const char source[] = "lis $1\n.word 42\njr $31\n";
+    static const uint8_t code[] = { 0, 0, 8, 20, 0, 0, 0, 42, 3, 224, 0, 8 };
+    const size_t len = strlen(source);
+    mu_assert(asm_cache_put(CACHE_DIR, ASM_TOOL, source, len, code, sizeof(code)),
+              "can't cache code");
+
+    size_t code_len;
+    uint8_t *cached = asm_cache_get(CACHE_DIR, ASM_TOOL, source, len, &code_len);
+    const bool hit = cached != NULL && code_len == sizeof(code)
+                     && memcmp(cached, code, sizeof(code)) == 0;
+    asm_free(cached);
+    mu_assert(hit, "cached code not found");
+
+    mu_assert(asm_cache_get(CACHE_DIR, "java cs241.binasm", source, len, &code_len) == NULL,
+              "found code from another tool");
+    mu_assert(asm_cache_get(CACHE_DIR, ASM_TOOL, source, len - 1, &code_len) == NULL,
+              "found code for other source");
+    mu_assert(asm_cache_get(NULL, ASM_TOOL, source, len, &code_len) == NULL,
+              "found code without a cache");
+    return NULL;
+}
+
+
+static const char *all_tests(void) {
+    mu_run_test(test_instructions);
+    mu_run_test(test_words_and_labels);
+    mu_run_test(test_errors);
+    mu_run_test(test_branch_range);
+    mu_run_test(test_cache);
+    // Note: all tests must run here!
+
+    return NULL;
+}
+
+int main(void) {
+    const char *result = all_tests();
+
+    if (result != NULL) {
+        printf("Test failed: ");
+        mu_print_failing_test();
+        printf("%s\n", result);
+    } else {
+        printf("Tests passed!");
+    }
+
+    printf("Tests run: %d\n", tests_run);
+
+    return result != NULL;
+}
@@ -1,6 +1,7 @@
 #include "minunit.h"
 #include "machine/decode.h"
 #include <stdio.h>
+#include <string.h>
 
 // Helper functions for testing boilerplate
 static const char *_test_decode_rtype(
@@ -117,6 +118,54 @@ static const char *test_decode_jalr(void) {
     return test_decode_rtype(0x03400009, 0, 26, 0, FUNC_JALR);
 }
 
+// Every word above, decoded in bulk each way this host can: more than a
+//   vector's worth, and not a multiple of one, so the scalar tail runs too
+static const char *test_decode_instructions(void) {
+    mu_set_test_name();
+    static const uint32_t cases[] = {
+        0x00430820, 0x00492822, 0x00c70018, 0x01090019, 0x014b001a,
+        0x018d001b, 0x00007810, 0x00007012, 0x00008014, 0x8e51ffe8,
+        0xae930000, 0x02d7a82a, 0x03fff82b, 0x10850010, 0x1719fa0b,
+        0x03e00008, 0x03400009, 0xffffffff, 0x00000000, 0x80008000
+    };
+    enum { NUM_CASES = sizeof(cases) / sizeof(cases[0]), N = 3 * 32 + 7 };
+    uint32_t words[N];
+    uint8_t type[N], code[N], s[N], t[N], d[N];
+    int16_t imm[N];
+    const DecodedTable table = { type, code, s, t, d, imm };
+    for (size_t i = 0; i < N; ++i)
+        words[i] = cases[i % NUM_CASES] ^ (uint32_t)(i / NUM_CASES) << 11;
+
+    static const enum decode_path paths[] = {
+        DECODE_WITH_BEST, DECODE_WITH_SCALAR, DECODE_WITH_SSE2, DECODE_WITH_AVX2
+    };
+    for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); ++p) {
+        // no entry is left over from the last way
+        memset(type, 0xFF, sizeof(type));
+        if (!decode_instructions_with(paths[p], words, N, &table)) {
+            mu_assert(paths[p] != DECODE_WITH_BEST && paths[p] != DECODE_WITH_SCALAR,
+                      "no portable decoding");
+            continue;
+        }
+        for (size_t i = 0; i < N; ++i) {
+            const Instruction want = decode_instruction(words[i]);
+            const Instruction got = decoded_table_get(&table, i);
+            mu_assert(got.type == want.type, "bad type");
+            mu_assert(got.code == want.code, "bad code");
+            if (want.type == TYPE_R) {
+                mu_assert(got.decoded.r.d == want.decoded.r.d, "bad $d");
+                mu_assert(got.decoded.r.s == want.decoded.r.s, "bad $s");
+                mu_assert(got.decoded.r.t == want.decoded.r.t, "bad $t");
+            } else {
+                mu_assert(got.decoded.i.s == want.decoded.i.s, "bad $s");
+                mu_assert(got.decoded.i.t == want.decoded.i.t, "bad $t");
+                mu_assert(got.decoded.i.imm == want.decoded.i.imm, "bad immediate value");
+            }
+        }
+    }
+    return NULL;
+}
+
 
 static const char *all_tests(void) {
     mu_run_test(test_decode_add);
@@ -136,6 +185,7 @@ static const char *all_tests(void) {
     mu_run_test(test_decode_bne);
     mu_run_test(test_decode_jr);
     mu_run_test(test_decode_jalr);
+    mu_run_test(test_decode_instructions);
     // Note: all tests must run here!
 
     return NULL;
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200112L // fdopen
+
+#include "minunit.h"
+#include "machine/machine.h"
+#include "emulator/emulator.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_MEMORY_BYTES (64 * 1024)
+#define PROGRAM_FILE "test_emulator_program.bin"
+#define DUMP_FILE "test_emulator_dump.bin"
+
+// 5 words and a stray byte, which is ignored
+static const uint8_t program[] = {
+    0x00, 0x00, 0x08, 0x14, 0xde, 0xad, 0xbe, 0xef,
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+    0x09, 0x0a, 0x0b, 0x0c, 0xff
+};
+
+static const char *check_loaded(const Machine *m, uint32_t offset) {
+    mu_assert(m->pc == offset, "bad pc after load");
+    mu_assert(m->mem[offset / 4 - 1] == 0, "loaded before the offset");
+    mu_assert(m->mem[offset / 4] == 0x00000814, "bad first word");
+    mu_assert(m->mem[offset / 4 + 1] == 0xdeadbeef, "bad byte order");
+    mu_assert(m->mem[offset / 4 + 4] == 0x090a0b0c, "bad last word");
+    mu_assert(m->mem[offset / 4 + 5] == 0, "loaded a partial word");
+    return NULL;
+}
+
+static long file_size(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+
+// Regular files are mapped
+static const char *test_load_file(void) {
+    mu_set_test_name();
+    FILE *f = fopen(PROGRAM_FILE, "wb");
+    fwrite(program, 1, sizeof(program), f);
+    fclose(f);
+
+    Machine *m = init_machine(TEST_MEMORY_BYTES);
+    load_program(fopen(PROGRAM_FILE, "rb"), m, 64);
+    const char *message = check_loaded(m, 64);
+    destroy_machine(m);
+    remove(PROGRAM_FILE);
+    return message;
+}
+
+// Pipes are read
+static const char *test_load_pipe(void) {
+    mu_set_test_name();
+    int fds[2];
+    mu_assert(pipe(fds) == 0, "can't make a pipe");
+    mu_assert(write(fds[1], program, sizeof(program)) == sizeof(program),
+              "can't fill the pipe");
+    close(fds[1]);
+
+    Machine *m = init_machine(TEST_MEMORY_BYTES);
+    load_program(fdopen(fds[0], "rb"), m, 4);
+    const char *message = check_loaded(m, 4);
+    destroy_machine(m);
+    return message;
+}
+
+static const char *test_dump(void) {
+    mu_set_test_name();
+    Machine *m = init_machine(TEST_MEMORY_BYTES);
+    m_write_word(m, 1, 0x01020304);
+    m_write_word(m, 2000, 0xdeadbeef);
+
+    dump_memory(m, DUMP_FILE);
+    mu_assert(file_size(DUMP_FILE) == TEST_MEMORY_BYTES, "bad full dump size");
+
+    // word 2000 is on the second 4 KB page
+    dump_memory_trimmed(m, DUMP_FILE);
+    mu_assert(file_size(DUMP_FILE) == 8192, "bad trimmed dump size");
+
+    uint8_t bytes[8];
+    FILE *f = fopen(DUMP_FILE, "rb");
+    mu_assert(fread(bytes, 1, 8, f) == 8, "can't read the dump");
+    fseek(f, 8000, SEEK_SET);
+    mu_assert(fread(bytes, 1, 4, f) == 4, "can't read the dump");
+    fclose(f);
+    mu_assert(memcmp(bytes, "\xde\xad\xbe\xef", 4) == 0, "bad dump byte order");
+
+    destroy_machine(m);
+    remove(DUMP_FILE);
+    return NULL;
+}
+
+
+static const char *all_tests(void) {
+    mu_run_test(test_load_file);
+    mu_run_test(test_load_pipe);
+    mu_run_test(test_dump);
+    // Note: all tests must run here!
+
+    return NULL;
+}
+
+int main(void) {
+    const char *result = all_tests();
+
+    if (result != NULL) {
+        printf("Test failed: ");
+        mu_print_failing_test();
+        printf("%s\n", result);
+    } else {
+        printf("Tests passed!");
+    }
+
+    printf("Tests run: %d\n", tests_run);
+
+    return result != NULL;
+}
@@ -0,0 +1,1042 @@
+#include "minunit.h"
+#include "machine/machine.h"
+#include "machine/impl.h"
+#include "machine/engine.h"
+#include "machine/block.h"
+#include "machine/io.h"
+#include "machine/snapshot.h"
+#include "machine/image.h"
+#include "machine/profile.h"
+#include "machine/debug.h"
+#include "machine/trace.h"
+#include "machine/history.h"
+#include "machine/scheduler.h"
+#include "machine/verify.h"
+#include <stdio.h>
+#include <string.h>
+
+#define ENC_R(FUNC, D, S, T) \
+    (((uint32_t)(S) << 21) | ((uint32_t)(T) << 16) | ((uint32_t)(D) << 11) \
+     | (uint32_t)(FUNC))
+#define ENC_I(OP, S, T, IMM) \
+    (((uint32_t)(OP) << 26) | ((uint32_t)(S) << 21) | ((uint32_t)(T) << 16) \
+     | (uint16_t)(IMM))
+
+#define TEST_MEMORY_BYTES 4096
+
+// Loads a program at address 0 and gets the machine ready to run it
+static Machine *load_test_program(const uint32_t *program, uint32_t len) {
+    Machine *m = init_machine(TEST_MEMORY_BYTES);
+    for (uint32_t i = 0; i < m->mem_size; ++i)
+        m_write_word(m, i, i < len ? program[i] : 0);
+    for (uint8_t i = 0; i < NUM_REGISTERS; ++i)
+        m->registers[i] = 0;
+    m->pc = 0;
+    m->hi = m->lo = 0;
+    m->registers[30] = TEST_MEMORY_BYTES;
+    m->registers[31] = RETURN_ADDRESS;
+    return m;
+}
+
+#define LEN(ARRAY) (sizeof(ARRAY) / sizeof(ARRAY[0]))
+
+// $3 = 5 + 4 + 3 + 2 + 1
+static const uint32_t branch_loop[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), 5,
+    ENC_R(FUNC_LIS, 2, 0, 0), 1,
+    ENC_R(FUNC_ADD, 3, 3, 1),
+    ENC_R(FUNC_SUB, 1, 1, 2),
+    ENC_I(OP_BNE, 1, 0, -3),
+    ENC_I(OP_BEQ, 0, 0, 1),
+    ENC_R(FUNC_ADD, 3, 0, 0), // skipped
+    ENC_R(FUNC_JR, 0, 31, 0)
+};
+
+static const uint32_t load_store[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), 0xdeadbeef,
+    ENC_I(OP_SW, 30, 1, -4),
+    ENC_I(OP_LW, 30, 2, -4),
+    ENC_I(OP_LW, 30, 3, -2),
+};
+
+static const uint32_t out_of_range[] = {
+    ENC_I(OP_SW, 30, 1, 0),
+};
+
+static const uint32_t invalid_instruction[] = {
+    ENC_R(FUNC_ADD, 1, 0, 0),
+    0xffffffff
+};
+
+static const uint32_t self_modifying[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), ENC_R(FUNC_SUB, 3, 3, 2), // new instruction
+    ENC_R(FUNC_LIS, 2, 0, 0), 1,
+    ENC_R(FUNC_LIS, 4, 0, 0), 2,
+    // loop:
+    ENC_R(FUNC_ADD, 3, 3, 2), // 1st pass: $3 += 1, 2nd pass: $3 -= 1
+    ENC_I(OP_SW, 0, 1, 24),
+    ENC_R(FUNC_SUB, 4, 4, 2),
+    ENC_I(OP_BNE, 4, 0, -4),
+    ENC_R(FUNC_JR, 0, 31, 0)
+};
+
+static const uint32_t predecode_off[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), 7,
+    ENC_R(FUNC_ADD, 2, 1, 1),
+    ENC_R(FUNC_JR, 0, 31, 0)
+};
+
+// Calls and returns through jalr/jr, with mult/div on the way
+static const uint32_t call_return[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), 7,
+    ENC_R(FUNC_LIS, 2, 0, 0), 0xfffffffd, // -3
+    ENC_I(OP_SW, 30, 31, -4),
+    ENC_R(FUNC_LIS, 5, 0, 0), 40,
+    ENC_R(FUNC_JALR, 0, 5, 0),
+    ENC_I(OP_LW, 30, 31, -4),
+    ENC_R(FUNC_JR, 0, 31, 0),
+    // 40: function
+    ENC_R(FUNC_MULT, 0, 1, 2),
+    ENC_R(FUNC_MFLO, 3, 0, 0),
+    ENC_R(FUNC_MFHI, 4, 0, 0),
+    ENC_R(FUNC_DIV, 0, 1, 2),
+    ENC_R(FUNC_MFLO, 6, 0, 0),
+    ENC_R(FUNC_MFHI, 7, 0, 0),
+    ENC_R(FUNC_MULTU, 0, 1, 2),
+    ENC_R(FUNC_MFHI, 8, 0, 0),
+    ENC_R(FUNC_SLT, 9, 2, 1),
+    ENC_R(FUNC_SLTU, 10, 2, 1),
+    ENC_R(FUNC_ADD, 0, 1, 1), // writes to $0 are dropped
+    ENC_R(FUNC_JR, 0, 31, 0)
+};
+
+// Jumps to an unaligned address
+static const uint32_t unaligned_jump[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), 6,
+    ENC_R(FUNC_JR, 0, 1, 0)
+};
+
+// Runs straight off the end of memory
+static const uint32_t run_off_end[] = {
+    ENC_I(OP_BEQ, 0, 0, TEST_MEMORY_BYTES / 4 - 2),
+};
+
+// Stack pushes and pops plus lis idioms, which the block engine fuses
+static const uint32_t push_pop[] = {
+    ENC_R(FUNC_LIS, 4, 0, 0), 4,
+    ENC_R(FUNC_LIS, 1, 0, 0), 11,
+    ENC_I(OP_SW, 30, 1, -4), ENC_R(FUNC_SUB, 30, 30, 4),     // push $1
+    ENC_R(FUNC_LIS, 1, 0, 0), 0,
+    ENC_R(FUNC_ADD, 30, 30, 4), ENC_I(OP_LW, 30, 2, -4),     // pop $2
+    ENC_R(FUNC_LIS, 3, 0, 0), 8, ENC_R(FUNC_ADD, 5, 3, 2),
+    ENC_R(FUNC_LIS, 3, 0, 0), 8, ENC_R(FUNC_SUB, 6, 2, 3),
+    ENC_R(FUNC_LIS, 0, 0, 0), 5, ENC_R(FUNC_ADD, 7, 0, 0),   // $0 stays 0
+    ENC_R(FUNC_ADD, 30, 30, 4), ENC_I(OP_LW, 30, 8, -4),     // pop past the top
+};
+
+// A push that stores over its own sub
+static const uint32_t push_over_itself[] = {
+    ENC_R(FUNC_LIS, 30, 0, 0), 24,
+    ENC_R(FUNC_LIS, 1, 0, 0), 0,
+    ENC_I(OP_SW, 30, 1, -4), ENC_R(FUNC_SUB, 30, 30, 4),
+};
+
+// Reads two bytes and writes them back in reverse, then reads past EOF
+static const uint32_t echo_reversed[] = {
+    ENC_R(FUNC_LIS, 5, 0, 0), 0xFFFF000C,
+    ENC_I(OP_LW, 5, 1, 0),
+    ENC_I(OP_LW, 5, 2, 0),
+    ENC_I(OP_SW, 5, 2, -8),
+    ENC_I(OP_SW, 5, 1, -8),
+    ENC_I(OP_LW, 5, 3, 0),
+    ENC_R(FUNC_JR, 0, 31, 0),
+};
+
+// Stores near the top of memory and reads it back
+static const uint32_t high_store[] = {
+    ENC_R(FUNC_LIS, 5, 0, 0), 0xF0000000,
+    ENC_R(FUNC_LIS, 1, 0, 0), 241,
+    ENC_I(OP_SW, 5, 1, 8),
+    ENC_I(OP_LW, 5, 2, 8),
+    ENC_I(OP_LW, 5, 3, 12),
+    ENC_R(FUNC_JR, 0, 31, 0),
+};
+
+// Pushes and pops a hundred times through $4, which the stack block
+//   doesn't set itself. The first block swaps $4 between 8 and 4 when
+//   started with $7 = 12, so the stack block's guard then keeps failing.
+static const uint32_t stack_loop[] = {
+    ENC_R(FUNC_LIS, 4, 0, 0), 4,
+    ENC_R(FUNC_LIS, 1, 0, 0), 100,
+    ENC_R(FUNC_LIS, 8, 0, 0), 1,
+    ENC_R(FUNC_LIS, 9, 0, 0), 0xFFFF0004,
+    ENC_R(FUNC_SUB, 4, 7, 4),                               // loop:
+    ENC_I(OP_BEQ, 0, 0, 0),
+    ENC_I(OP_SW, 30, 1, -4), ENC_R(FUNC_SUB, 30, 30, 4),     // push $1
+    ENC_I(OP_SW, 30, 1, -4), ENC_R(FUNC_SUB, 30, 30, 4),     // push $1
+    ENC_R(FUNC_ADD, 30, 30, 4), ENC_I(OP_LW, 30, 2, -4),     // pop $2
+    ENC_R(FUNC_ADD, 30, 30, 4), ENC_I(OP_LW, 30, 3, -4),     // pop $3
+    ENC_I(OP_SW, 0, 2, 4000),
+    ENC_I(OP_SW, 9, 8, 0),                                  // mapped, so checked
+    ENC_R(FUNC_SUB, 1, 1, 8),
+    ENC_I(OP_BNE, 1, 0, -14),
+    ENC_R(FUNC_JR, 0, 31, 0),
+};
+#define STACK_LOOP_BLOCK 10
+
+static EmulatorStatus run_to_end(Machine *m) {
+    EmulatorStatus status;
+    do status = step_machine(m);
+    while (status.retcode == IR_SUCCESS);
+    return status;
+}
+
+
+static const char *test_branch_loop(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(branch_loop, LEN(branch_loop));
+    EmulatorStatus status = run_to_end(m);
+
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(m->registers[3] == 15, "bad loop sum");
+    destroy_machine(m);
+    return NULL;
+}
+
+// Counts branch_loop's branches and call_return's calls, loads and
+//   stores, and that resetting forgets them
+static const char *test_stats(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(branch_loop, LEN(branch_loop));
+    step_machine_loop(m);
+    MachineStats stats;
+    m_get_stats(m, &stats);
+    mu_assert(stats.retired == 19, "bad branch_loop retired count");
+    mu_assert(stats.branches_taken == 5 && stats.branches_not_taken == 1,
+              "bad branch counts");
+    mu_assert(stats.loads == 0 && stats.stores == 0 && stats.calls == 0,
+              "bad branch_loop counts");
+    reset_machine(m);
+    mu_assert(m->stats.retired == 0 && m->stats.branches_taken == 0,
+              "stats not reset");
+    destroy_machine(m);
+
+    m = load_test_program(call_return, LEN(call_return));
+    step_machine_loop(m);
+    m_get_stats(m, &stats);
+    mu_assert(stats.retired == 19, "bad call_return retired count");
+    mu_assert(stats.loads == 1 && stats.stores == 1 && stats.calls == 1,
+              "bad call_return counts");
+    destroy_machine(m);
+    return NULL;
+}
+
+static const char *test_load_store(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(load_store, LEN(load_store));
+    EmulatorStatus status = run_to_end(m);
+
+    mu_assert(m->registers[2] == 0xdeadbeef, "bad load after store");
+    mu_assert(status.retcode == IR_UNALIGNED_MEMORY_ACCESS, "unaligned load succeeded");
+    mu_assert(status.pc == TEST_MEMORY_BYTES - 2, "bad fault address");
+    destroy_machine(m);
+    return NULL;
+}
+
+static const char *test_out_of_range(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(out_of_range, LEN(out_of_range));
+    EmulatorStatus status = run_to_end(m);
+
+    mu_assert(status.retcode == IR_OUT_OF_RANGE_MEMORY_ACCESS, "out of range store succeeded");
+    mu_assert(status.pc == TEST_MEMORY_BYTES, "bad fault address");
+    destroy_machine(m);
+    return NULL;
+}
+
+static const char *test_invalid_instruction(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(invalid_instruction, LEN(invalid_instruction));
+    EmulatorStatus status = run_to_end(m);
+
+    mu_assert(status.retcode == IR_INVALID_INSTRUCTION, "invalid instruction ran");
+    mu_assert(status.pc == 4, "bad invalid instruction address");
+    destroy_machine(m);
+    return NULL;
+}
+
+// The loop body is decoded on the first pass, then overwritten by a store.
+//   The second pass must run the new instruction, not the cached one.
+static const char *test_self_modifying(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(self_modifying, LEN(self_modifying));
+    EmulatorStatus status = run_to_end(m);
+
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(m->registers[3] == 0, "ran a stale predecoded instruction");
+    destroy_machine(m);
+    return NULL;
+}
+
+static const char *test_predecode_off(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(predecode_off, LEN(predecode_off));
+    m_set_predecode(m, false);
+    EmulatorStatus status = run_to_end(m);
+
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(m->registers[2] == 14, "bad sum");
+    destroy_machine(m);
+    return NULL;
+}
+
+// Bulk copies go both ways in either byte order, and what they write
+//   is what runs, even if an old decoding of it was cached
+static const char *test_bulk_copy(void) {
+    mu_set_test_name();
+    static const uint32_t program[] = { ENC_R(FUNC_LIS, 1, 0, 0), 7, ENC_R(FUNC_JR, 0, 31, 0) };
+    Machine *m = load_test_program(program, LEN(program));
+    run_to_end(m);
+
+    const uint8_t be[] = { 0x00, 0x00, 0x08, 0x14, 0x00, 0x00, 0x00, 0x2a, 0xff };
+    mu_assert(m_write_words(m, 0, be, sizeof(be), true), "big-endian write failed");
+    mu_assert(m->mem[0] == 0x00000814 && m->mem[1] == 42 && m->mem[3] == 0,
+              "bad big-endian write");
+    m->pc = 0;
+    m->registers[31] = RETURN_ADDRESS;
+    mu_assert(run_to_end(m).retcode == IR_DONE && m->registers[1] == 42,
+              "ran a stale predecoded instruction");
+
+    uint8_t out[8];
+    mu_assert(m_read_words(m, 0, out, sizeof(out), true), "big-endian read failed");
+    mu_assert(memcmp(out, be, sizeof(out)) == 0, "bad big-endian read");
+    const uint32_t host[] = { 0x01020304, 0x05060708 };
+    mu_assert(m_write_words(m, 4, host, sizeof(host), false), "host order write failed");
+    mu_assert(m_read_words(m, 4, out, sizeof(out), false), "host order read failed");
+    mu_assert(memcmp(out, host, sizeof(out)) == 0, "bad host order copy");
+
+    uint32_t num_words;
+    const uint32_t *view = m_memory_view(m, &num_words);
+    mu_assert(num_words == m->mem_size && view[5] == 0x05060708, "bad memory view");
+    mu_assert(!m_write_words(m, m->mem_size - 1, host, sizeof(host), false),
+              "wrote past the end of memory");
+    mu_assert(!m_read_words(m, m->mem_size + 1, out, 0, false),
+              "read past the end of memory");
+    mu_assert(m->mem[m->mem_size - 1] == 0, "partly wrote past the end");
+
+    // copying data past the program keeps its blocks, copying over it doesn't
+    m->pc = 0;
+    m->registers[31] = RETURN_ADDRESS;
+    uint64_t retired;
+    run_blocks(m, UINT64_MAX, &retired);
+    mu_assert(block_cache(m)->num_blocks != 0, "no blocks translated");
+    mu_assert(m_write_words(m, 64, host, sizeof(host), false), "data write failed");
+    mu_assert(block_cache(m)->num_blocks != 0, "data write flushed the blocks");
+    mu_assert(m_write_words(m, 0, be, sizeof(be), true), "code write failed");
+    mu_assert(block_cache(m)->num_blocks == 0, "code write kept the blocks");
+    destroy_machine(m);
+    return NULL;
+}
+
+
+static size_t read_one_x(void *ctx, uint8_t *buf, size_t cap) {
+    (void) cap;
+    buf[0] = 'x';
+    return ++*(int *)ctx <= 2;
+}
+
+static void count_output(void *ctx, const uint8_t *bytes, size_t len) {
+    (void) bytes;
+    *(size_t *)ctx += len;
+}
+
+static const char *test_io_channels(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(echo_reversed, LEN(echo_reversed));
+    m_input_from_buffer(m, (const uint8_t *)"ab", 2);
+    m_output_capture(m);
+    EmulatorStatus status = step_machine_loop(m);
+
+    size_t len;
+    const uint8_t *output = m_captured_output(m, &len);
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(len == 2 && output[0] == 'b' && output[1] == 'a', "bad captured output");
+    mu_assert(m->registers[3] == 0, "read past the end of the input");
+    destroy_machine(m);
+
+    int reads = 0;
+    size_t written = 0;
+    m = load_test_program(echo_reversed, LEN(echo_reversed));
+    m_input_from_callback(m, read_one_x, &reads);
+    m_output_to_callback(m, count_output, &written);
+    status = step_machine_loop(m);
+
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(reads == 3 && written == 2, "bad callback I/O");
+    mu_assert(m->registers[3] == 0, "read past the end of the input");
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Fresh memory is zeroed, and the whole address space can be backed
+static const char *test_sparse_memory(void) {
+    mu_set_test_name();
+    Machine *m = init_machine(0);
+    for (uint32_t i = 0; i < m->mem_size; i += 1021)
+        mu_assert(m->mem[i] == 0, "memory not zeroed");
+    destroy_machine(m);
+
+    if (sizeof(size_t) == sizeof(uint32_t))
+        return NULL;
+    m = init_machine_full();
+    for (uint32_t i = 0; i < LEN(high_store); ++i)
+        m_write_word(m, i, high_store[i]);
+    m->registers[31] = RETURN_ADDRESS;
+    EmulatorStatus status = step_machine_loop(m);
+
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(m->registers[2] == 241, "bad load from high memory");
+    mu_assert(m->registers[3] == 0, "high memory not zeroed");
+
+    // lis at the very top takes its constant from word 0, and blocks
+    //   mustn't look past the end of memory for it
+    m_write_word(m, 0x3FFFFFFD, ENC_R(FUNC_LIS, 6, 0, 0));
+    m_write_word(m, 0x3FFFFFFE, 7);
+    m_write_word(m, 0x3FFFFFFF, ENC_R(FUNC_LIS, 7, 0, 0));
+    for (int run = 0; run < 2; ++run) {
+        m->pc = 0xFFFFFFF4;
+        m->registers[6] = m->registers[7] = 0;
+        uint64_t retired;
+        status = step_machine_n(m, 2, &retired);
+        mu_assert(status.retcode == IR_BUDGET_EXHAUSTED && retired == 2, "bad run at the top");
+        mu_assert(m->registers[6] == 7 && m->registers[7] == high_store[0],
+                  "bad lis at the top");
+        mu_assert(m->pc == 4, "didn't wrap around");
+    }
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Clones pick up where the snapshot was taken and don't see each
+//   other's writes
+static const char *test_snapshot_clone(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(branch_loop, LEN(branch_loop));
+    uint64_t retired;
+    step_machine_n(m, 5, &retired);
+    MachineSnapshot *snapshot = m_snapshot(m);
+    mu_assert(snapshot != NULL, "no snapshot");
+    Machine *a = m_clone(snapshot);
+    Machine *b = m_clone(snapshot);
+    m_snapshot_destroy(snapshot);
+    mu_assert(a != NULL && b != NULL, "no clone");
+
+    m_write_word(b, 100, 241);
+    mu_assert(a->mem[100] == 0 && m->mem[100] == 0, "clone write leaked");
+    mu_assert(a->pc == m->pc && a->registers[1] == m->registers[1], "bad clone state");
+
+    mu_assert(step_machine_loop(a).retcode == IR_DONE, "clone did not finish");
+    mu_assert(step_machine_loop(b).retcode == IR_DONE, "clone did not finish");
+    mu_assert(step_machine_loop(m).retcode == IR_DONE, "program did not finish");
+    mu_assert(a->registers[3] == 15 && b->registers[3] == 15, "bad clone loop sum");
+    mu_assert(a->mem[TEST_MEMORY_BYTES / 4 - 1] == m->mem[TEST_MEMORY_BYTES / 4 - 1],
+              "bad clone store");
+    destroy_machine(a);
+    destroy_machine(b);
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// The call_return program runs 7 instructions itself and calls a function
+//   at 40 that runs 12
+static const char *test_profile(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(call_return, LEN(call_return));
+    Profile *profile = profile_create(m);
+    uint64_t retired;
+    EmulatorStatus status = step_machine_profiled(m, profile, UINT64_MAX, &retired);
+
+    mu_assert(status.retcode == IR_DONE, "program did not finish");
+    mu_assert(profile_total(profile) == retired, "bad profile total");
+    mu_assert(profile_pc_count(profile, 0) == 1, "bad entry count");
+
+    char flat[] = "test_profile_flat.txt", collapsed[] = "test_profile_folded.txt";
+    mu_assert(profile_write_flat(profile, flat, 0), "can't write flat profile");
+    mu_assert(profile_write_collapsed(profile, collapsed), "can't write collapsed stacks");
+
+    char line[64];
+    FILE *f = fopen(collapsed, "r");
+    mu_assert(fgets(line, sizeof(line), f) != NULL
+              && strcmp(line, "0x00000000 7\n") == 0, "bad caller stack");
+    mu_assert(fgets(line, sizeof(line), f) != NULL
+              && strcmp(line, "0x00000000;0x00000028 12\n") == 0, "bad callee stack");
+    fclose(f);
+
+    remove(flat);
+    remove(collapsed);
+    profile_destroy(profile);
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Traces call_return in two runs and reads it back: a line per retired
+//   instruction, with the state at the start and a stop after each run
+static const char *test_trace(void) {
+    mu_set_test_name();
+    Machine *m = load_test_program(call_return, LEN(call_return));
+    char path[] = "test_trace.bin";
+    Trace *trace = trace_open(m, path);
+    mu_assert(trace != NULL, "can't open a trace");
+    uint64_t first, second;
+    mu_assert(step_machine_traced(m, trace, 5, &first).retcode == IR_BUDGET_EXHAUSTED,
+              "traced run did not stop on budget");
+    EmulatorStatus status = step_machine_traced(m, trace, UINT64_MAX, &second);
+    mu_assert(status.retcode == IR_DONE && first + second == 19, "bad traced run");
+    mu_assert(trace_close(trace), "can't write the trace");
+
+    FILE *text = tmpfile();
+    mu_assert(trace_print(path, text), "can't read the trace back");
+    rewind(text);
+    char line[256], last[256] = "";
+    uint64_t instructions = 0, others = 0;
+    while (fgets(line, sizeof(line), text) != NULL) {
+        if (strncmp(line, "-- ", 3) == 0)
+            ++others;
+        else
+            ++instructions;
+        strcpy(last, line);
+    }
+    fclose(text);
+    mu_assert(instructions == 19 && others == 3, "bad trace records");
+    mu_assert(strcmp(last, "-- stopped at 0x8123456c: done\n") == 0, "bad trace end");
+
+    remove(path);
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Whether two machines are in the same state
+static bool same_state(const Machine *a, const Machine *b) {
+    return a->pc == b->pc && a->hi == b->hi && a->lo == b->lo
+           && memcmp(a->registers, b->registers, sizeof(a->registers)) == 0
+           && memcmp(a->mem, b->mem, sizeof(uint32_t) * a->mem_size) == 0;
+}
+
+// Checkpoints the branch loop to an image partway through, and carries on
+//   from it. Memory ends partway into a page, and writes to a loaded
+//   machine don't reach the image.
+static const char *test_image(void) {
+    mu_set_test_name();
+    Machine *m = init_machine(3 * IMAGE_PAGE_BYTES + 12);
+    for (uint32_t i = 0; i < LEN(branch_loop); ++i)
+        m_write_word(m, i, branch_loop[i]);
+    m_write_word(m, m->mem_size - 1, 241);
+    m->registers[31] = RETURN_ADDRESS;
+    uint64_t retired;
+    step_machine_n(m, 5, &retired);
+
+    char path[] = "test_image.img";
+    const ImageInfo info = { 0, 0 };
+    mu_assert(m_save_image(m, path, &info) == IMAGE_OK, "can't save an image");
+    enum image_error error;
+    ImageInfo loaded_info;
+    Machine *a = m_load_image(path, &loaded_info, &error);
+    mu_assert(a != NULL && error == IMAGE_OK, "can't load the image");
+    mu_assert(same_state(a, m), "bad image state");
+    mu_assert(loaded_info.entry == 0 && loaded_info.load_offset == 0, "bad image info");
+
+    m_write_word(a, 100, 241);
+    Machine *b = m_load_image(path, NULL, &error);
+    mu_assert(b != NULL && b->mem[100] == 0, "image write leaked");
+    mu_assert(step_machine_loop(b).retcode == IR_DONE, "image did not finish");
+    mu_assert(step_machine_loop(m).retcode == IR_DONE, "program did not finish");
+    mu_assert(same_state(b, m), "bad run from the image");
+
+    // cut off its last byte
+    static uint8_t bytes[4 * IMAGE_PAGE_BYTES];
+    FILE *f = fopen(path, "rb");
+    const size_t len = fread(bytes, 1, sizeof(bytes), f);
+    fclose(f);
+    f = fopen(path, "wb");
+    mu_assert(len > 0 && fwrite(bytes, 1, len - 1, f) == len - 1, "can't cut the image");
+    fclose(f);
+    mu_assert(m_load_image(path, NULL, &error) == NULL && error == IMAGE_CORRUPT,
+              "cut image loaded");
+    mu_assert(m_load_image("test_machine_no_such.img", NULL, &error) == NULL
+              && error == IMAGE_CANT_OPEN, "missing image loaded");
+
+    remove(path);
+    destroy_machine(a);
+    destroy_machine(b);
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Steps call_return back to where it started and back to its sw, then
+//   rewinds a long loop across checkpoints to where a shorter run ends
+static const char *test_history(void) {
+    mu_set_test_name();
+    Machine *start = load_test_program(call_return, LEN(call_return));
+    Machine *m = load_test_program(call_return, LEN(call_return));
+    History *history = history_create(0);
+    uint64_t retired;
+    mu_assert(step_machine_recorded(m, history, UINT64_MAX, &retired).retcode == IR_DONE,
+              "recorded run did not finish");
+    mu_assert(history_length(history) == retired, "bad history length");
+    mu_assert(history_reverse_to_write(m, history, TEST_MEMORY_BYTES - 4) && m->pc == 16,
+              "did not go back to the sw");
+    mu_assert(history_rewind(m, history, UINT64_MAX) == 2, "bad rewind count");
+    mu_assert(!history_step_back(m, history), "stepped back past the start");
+    mu_assert(same_state(m, start), "not back at the start");
+    history_destroy(history);
+    destroy_machine(start);
+    destroy_machine(m);
+
+    uint32_t program[LEN(branch_loop)];
+    memcpy(program, branch_loop, sizeof(program));
+    program[1] = 10000;
+    const uint64_t back = HISTORY_INTERVAL + 100;
+    Machine *expected = load_test_program(program, LEN(program));
+    m = load_test_program(program, LEN(program));
+    history = history_create(0);
+    step_machine_recorded(m, history, UINT64_MAX, &retired);
+    mu_assert(history_length(history) < retired, "history is unbounded");
+    mu_assert(history_rewind(m, history, back) == back, "bad long rewind count");
+    uint64_t ahead;
+    step_machine_n(expected, retired - back, &ahead);
+    mu_assert(same_state(m, expected), "bad state after a long rewind");
+    history_destroy(history);
+    destroy_machine(expected);
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Whether two machines counted the same, wall time aside
+static bool same_stats(const Machine *a, const Machine *b) {
+    MachineStats x = a->stats, y = b->stats;
+    x.wall_ns = y.wall_ns = 0;
+    return memcmp(&x, &y, sizeof(x)) == 0;
+}
+
+// Runs the program with step_machine and with an engine and checks that
+//   they end up in the same place, having counted the same.
+static const char *engine_agrees(EmulatorStatus (*engine)(Machine *const),
+                                 const uint32_t *program, uint32_t len) {
+    Machine *expected = load_test_program(program, len);
+    Machine *actual = load_test_program(program, len);
+    const EmulatorStatus expected_status = run_to_end(expected);
+    const EmulatorStatus actual_status = engine(actual);
+
+    mu_assert(expected_status.retcode == actual_status.retcode, "bad retcode");
+    mu_assert(expected_status.pc == actual_status.pc, "bad status pc");
+    mu_assert(expected->pc == actual->pc, "bad pc");
+    mu_assert(expected->hi == actual->hi && expected->lo == actual->lo, "bad hi/lo");
+    for (uint8_t i = 0; i < NUM_REGISTERS; ++i)
+        mu_assert(expected->registers[i] == actual->registers[i], "bad register");
+    for (uint32_t i = 0; i < expected->mem_size; ++i)
+        mu_assert(expected->mem[i] == actual->mem[i], "bad memory");
+    mu_assert(same_stats(expected, actual), "bad stats");
+
+    destroy_machine(expected);
+    destroy_machine(actual);
+    return NULL;
+}
+
+// Check an engine against every test program
+static const char *test_engine(EmulatorStatus (*engine)(Machine *const)) {
+    static const struct {
+        const uint32_t *program;
+        uint32_t len;
+    } programs[] = {
+        { branch_loop, LEN(branch_loop) },
+        { load_store, LEN(load_store) },
+        { out_of_range, LEN(out_of_range) },
+        { invalid_instruction, LEN(invalid_instruction) },
+        { self_modifying, LEN(self_modifying) },
+        { predecode_off, LEN(predecode_off) },
+        { call_return, LEN(call_return) },
+        { unaligned_jump, LEN(unaligned_jump) },
+        { run_off_end, LEN(run_off_end) },
+        { push_pop, LEN(push_pop) },
+        { push_over_itself, LEN(push_over_itself) }
+    };
+
+    for (size_t i = 0; i < LEN(programs); ++i) {
+        const char *message = engine_agrees(engine, programs[i].program, programs[i].len);
+        if (message != NULL)
+            return message;
+    }
+    return NULL;
+}
+
+static const char *test_threaded_engine(void) {
+    mu_set_test_name();
+    return test_engine(run_threaded);
+}
+
+
+static EmulatorStatus run_all_blocks(Machine *const m) {
+    uint64_t retired;
+    return run_blocks(m, UINT64_MAX, &retired);
+}
+
+static const char *test_block_engine(void) {
+    mu_set_test_name();
+    return test_engine(run_all_blocks);
+}
+
+
+// The block engine, compiling every block the first time it runs
+//   if there is a JIT
+static EmulatorStatus run_blocks_jit_first(Machine *const m) {
+    block_cache(m)->jit_threshold = 1;
+    uint64_t retired;
+    return run_blocks(m, UINT64_MAX, &retired);
+}
+
+static const char *test_jit_engine(void) {
+    mu_set_test_name();
+    return test_engine(run_blocks_jit_first);
+}
+
+
+// Runs the stack loop with and without compiled blocks, with $30 where
+//   its guard holds, misaligned and too low, and with $4 changing under
+//   it, checking it against step_machine and that only the right ops
+//   went unchecked.
+static const char *test_verify(void) {
+    mu_set_test_name();
+    static const struct {
+        uint32_t sp;
+        uint32_t swap;      // $7
+        bool guarded;       // after running
+    } cases[] = {
+        { TEST_MEMORY_BYTES, 0, true },
+        { TEST_MEMORY_BYTES, 12, false },
+        { TEST_MEMORY_BYTES - 2, 0, true },
+        { 4, 0, true },
+    };
+
+    for (uint32_t jit_threshold = 1; jit_threshold <= 2; ++jit_threshold) {
+        for (size_t i = 0; i < LEN(cases); ++i) {
+            Machine *expected = load_test_program(stack_loop, LEN(stack_loop));
+            Machine *actual = load_test_program(stack_loop, LEN(stack_loop));
+            expected->registers[30] = actual->registers[30] = cases[i].sp;
+            expected->registers[7] = actual->registers[7] = cases[i].swap;
+            block_cache(actual)->jit_threshold = jit_threshold;
+            m_output_capture(expected);
+            m_output_capture(actual);
+
+            const EmulatorStatus expected_status = run_to_end(expected);
+            uint64_t retired;
+            const EmulatorStatus actual_status = run_blocks(actual, UINT64_MAX, &retired);
+            mu_assert(expected_status.retcode == actual_status.retcode, "bad verified retcode");
+            mu_assert(expected_status.pc == actual_status.pc, "bad verified status pc");
+            mu_assert(memcmp(expected->registers, actual->registers,
+                             sizeof(expected->registers)) == 0, "bad verified registers");
+            mu_assert(memcmp(expected->mem, actual->mem,
+                             expected->mem_size * 4) == 0, "bad verified memory");
+
+            const Block *block = block_cache(actual)->map[STACK_LOOP_BLOCK];
+            mu_assert(block != NULL, "stack block not translated");
+            mu_assert(block->guard.on == cases[i].guarded, "bad guard");
+            const OpKind safe[] = { OPK_PUSH_SAFE, OPK_PUSH_SAFE, OPK_POP_SAFE,
+                                    OPK_POP_SAFE, OPK_SW_SAFE, OPK_SW };
+            const OpKind checked[] = { OPK_PUSH, OPK_PUSH, OPK_POP,
+                                       OPK_POP, OPK_SW, OPK_SW };
+            for (size_t op = 0; op < LEN(safe); ++op)
+                mu_assert(block->ops[op].kind
+                          == (cases[i].guarded ? safe : checked)[op], "bad op kind");
+
+            destroy_machine(expected);
+            destroy_machine(actual);
+        }
+    }
+
+    // $4 is assumed to be 4 to move $30 by it, which mustn't leave the
+    //   load through it proven once the guard is dropped
+    static const uint32_t assumed[] = {
+        ENC_R(FUNC_ADD, 30, 30, 4),
+        ENC_I(OP_LW, 4, 1, 0),
+        ENC_R(FUNC_JR, 0, 31, 0),
+    };
+    for (uint32_t jit_threshold = 1; jit_threshold <= 2; ++jit_threshold) {
+        Machine *expected = load_test_program(assumed, LEN(assumed));
+        Machine *actual = load_test_program(assumed, LEN(assumed));
+        block_cache(actual)->jit_threshold = jit_threshold;
+        for (int run = 0; run < 3; ++run) {
+            const uint32_t r4 = run < 2 ? 4 : 0x7FFFF000;
+            for (Machine **m = (Machine *[]) { expected, actual, NULL }; *m; ++m) {
+                (*m)->pc = 0;
+                (*m)->registers[4] = r4;
+                (*m)->registers[30] = TEST_MEMORY_BYTES;
+                (*m)->registers[31] = RETURN_ADDRESS;
+            }
+            const EmulatorStatus expected_status = run_to_end(expected);
+            uint64_t retired;
+            const EmulatorStatus actual_status = run_blocks(actual, UINT64_MAX, &retired);
+            mu_assert(expected_status.retcode == actual_status.retcode, "bad assumed retcode");
+            mu_assert(expected_status.pc == actual_status.pc, "bad assumed status pc");
+            mu_assert(memcmp(expected->registers, actual->registers,
+                             sizeof(expected->registers)) == 0, "bad assumed registers");
+        }
+        destroy_machine(expected);
+        destroy_machine(actual);
+    }
+    return NULL;
+}
+
+
+// Runs the branch loop in slices of every budget up to its length, with
+//   and without compiled blocks. Each run must stop exactly on budget and
+//   the slices must add up to the same run as step_machine.
+static const char *test_budget(void) {
+    mu_set_test_name();
+    Machine *expected = load_test_program(branch_loop, LEN(branch_loop));
+    uint64_t total = 0;
+    while (step_machine(expected).retcode == IR_SUCCESS)
+        ++total;
+
+    for (uint32_t jit_threshold = 1; jit_threshold <= 2; ++jit_threshold) {
+        for (uint64_t budget = 1; budget <= total + 1; ++budget) {
+            Machine *m = load_test_program(branch_loop, LEN(branch_loop));
+            block_cache(m)->jit_threshold = jit_threshold;
+            EmulatorStatus status;
+            uint64_t sum = 0, retired;
+            while ((status = step_machine_n(m, budget, &retired)).retcode
+                   == IR_BUDGET_EXHAUSTED) {
+                mu_assert(retired == budget, "stopped short of the budget");
+                mu_assert(status.pc == m->pc, "bad budget status pc");
+                sum += retired;
+            }
+            sum += retired;
+
+            mu_assert(status.retcode == IR_DONE, "program did not finish");
+            mu_assert(sum == total, "bad retired count");
+            mu_assert(m->registers[3] == expected->registers[3], "bad loop sum");
+            destroy_machine(m);
+        }
+    }
+    destroy_machine(expected);
+    return NULL;
+}
+
+
+// Reads a byte into $3 and another into $4, for the scheduler to wait on
+static const uint32_t read_two[] = {
+    ENC_R(FUNC_LIS, 1, 0, 0), 0xffff000c,
+    ENC_I(OP_LW, 1, 3, 0),
+    ENC_I(OP_LW, 1, 4, 0),
+    ENC_R(FUNC_JR, 0, 31, 0)
+};
+
+// Reuses a machine with call_return loaded as its baseline, running it
+//   with step_machine, then with blocks and compiled blocks, which are
+//   kept. Only the stack page gets dirty, and resetting puts it back.
+static const char *test_dirty_pages(void) {
+    mu_set_test_name();
+    const uint32_t bytes = 4 * DIRTY_PAGE_WORDS * 4;
+    Machine *m = init_machine(bytes);
+    for (uint32_t i = 0; i < LEN(call_return); ++i)
+        m_write_word(m, i, call_return[i]);
+    m->registers[30] = bytes;
+    m->registers[31] = RETURN_ADDRESS;
+
+    uint32_t pages[4];
+    mu_assert(m_num_pages(m) == 4, "bad page count");
+    mu_assert(m_dirty_pages(m, pages, 4) == 1 && pages[0] == 0, "program page not dirty");
+    mu_assert(m_set_baseline(m), "can't set a baseline");
+    mu_assert(m_dirty_pages(m, pages, 4) == 0, "dirty after setting the baseline");
+
+    for (uint32_t jit_threshold = 0; jit_threshold <= 2; ++jit_threshold) {
+        if (jit_threshold == 0) {
+            run_to_end(m);
+        } else {
+            block_cache(m)->jit_threshold = jit_threshold;
+            uint64_t retired;
+            run_blocks(m, UINT64_MAX, &retired);
+        }
+        mu_assert(m->registers[3] == (uint32_t)-21, "bad reused run");
+        mu_assert(m_dirty_pages(m, pages, 4) == 1 && pages[0] == 3, "bad dirty pages");
+        mu_assert(m_page_dirty(m, 3) && !m_page_dirty(m, 0), "bad dirty page");
+        mu_assert(m_changed_pages(m, pages, 4) == 1 && pages[0] == 3, "bad changed pages");
+
+        reset_machine(m);
+        mu_assert(m_dirty_pages(m, pages, 4) == 0, "dirty after reset");
+        mu_assert(m->mem[bytes / 4 - 1] == 0, "stack not restored");
+        mu_assert(m->mem[0] == call_return[0], "program not kept");
+        mu_assert(m->registers[30] == bytes && m->registers[3] == 0 && m->pc == 0,
+                  "registers not restored");
+    }
+
+    // without a baseline, everything goes back to zero
+    m_clear_baseline(m);
+    reset_machine(m);
+    mu_assert(m->mem[0] == 0 && m->registers[30] == 0, "not zeroed");
+    mu_assert(m_changed_pages(m, pages, 4) == 0, "changed after zeroing");
+    destroy_machine(m);
+    return NULL;
+}
+
+
+// Interleaves copies of branch_loop in slices of 3 instructions, parks
+//   read_two on each of its reads, and reuses the id of a removed machine
+static const char *test_scheduler(void) {
+    mu_set_test_name();
+    Machine *expected = load_test_program(branch_loop, LEN(branch_loop));
+    uint64_t total = 0;
+    while (step_machine(expected).retcode == IR_SUCCESS)
+        ++total;
+
+    Scheduler *sched = sched_create(3);
+    mu_assert(sched != NULL, "can't create a scheduler");
+    enum { NUM_LOOPS = 20 };
+    Machine *loops[NUM_LOOPS];
+    for (uint32_t i = 0; i < NUM_LOOPS; ++i) {
+        loops[i] = load_test_program(branch_loop, LEN(branch_loop));
+        mu_assert(sched_add(sched, loops[i]) == i, "bad machine id");
+    }
+    Machine *reader = load_test_program(read_two, LEN(read_two));
+    const uint32_t reader_id = sched_add(sched, reader);
+
+    // a small budget runs only the first machines, a slice each
+    SchedEvent events[NUM_LOOPS + 1];
+    mu_assert(sched_run(sched, 6, events, LEN(events)) == 0, "finished too soon");
+    mu_assert(loops[0]->pc != 0 && loops[1]->pc != 0 && loops[2]->pc == 0,
+              "slices not round-robin");
+
+    size_t num_events = sched_run(sched, UINT64_MAX, events, LEN(events));
+    mu_assert(num_events == NUM_LOOPS + 1 && sched_runnable(sched) == 0, "bad events");
+    for (size_t i = 0; i < num_events; ++i) {
+        if (events[i].id == reader_id) {
+            mu_assert(events[i].status.retcode == IR_INPUT_WAIT && events[i].retired == 1
+                      && events[i].status.pc == 8, "reader did not wait");
+        } else {
+            mu_assert(events[i].status.retcode == IR_DONE && events[i].retired == total,
+                      "loop did not finish");
+            mu_assert(loops[events[i].id]->registers[3] == expected->registers[3],
+                      "bad loop sum");
+        }
+    }
+    mu_assert(sched_get_state(sched, reader_id) == SCHED_WAITING, "reader not parked");
+    mu_assert(sched_get_state(sched, 0) == SCHED_STOPPED, "loop not stopped");
+
+    // one byte gets it to its next read, and closing its input finishes it
+    sched_feed_input(sched, reader_id, (const uint8_t *)"A", 1);
+    mu_assert(sched_run(sched, UINT64_MAX, events, LEN(events)) == 1
+              && events[0].status.retcode == IR_INPUT_WAIT && reader->registers[3] == 'A',
+              "reader did not take its input");
+    sched_close_input(sched, reader_id);
+    mu_assert(sched_run(sched, UINT64_MAX, events, LEN(events)) == 1
+              && events[0].status.retcode == IR_DONE && events[0].retired == 4
+              && reader->registers[4] == 0, "reader did not see EOF");
+
+    mu_assert(sched_remove(sched, 5) == loops[5], "bad removed machine");
+    mu_assert(sched_machine(sched, 5) == NULL && sched_get_state(sched, 5) == SCHED_NONE,
+              "removed machine still there");
+    mu_assert(sched_add(sched, loops[5]) == 5, "id not reused");
+    mu_assert(sched_remove(sched, 5) == loops[5] && sched_runnable(sched) == 0,
+              "runnable machine not removed");
+
+    sched_destroy(sched);
+    for (uint32_t i = 0; i < NUM_LOOPS; ++i)
+        destroy_machine(loops[i]);
+    destroy_machine(reader);
+    destroy_machine(expected);
+    return NULL;
+}
+
+
+// A breakpoint in the branch loop stops every engine on each of its 5
+//   trips, and a write watchpoint stops load_store before its sw
+static const char *test_debug(void) {
+    mu_set_test_name();
+    for (uint32_t jit_threshold = 1; jit_threshold <= 2; ++jit_threshold) {
+        Machine *m = load_test_program(branch_loop, LEN(branch_loop));
+        block_cache(m)->jit_threshold = jit_threshold;
+        mu_assert(m_set_breakpoint(m, 16), "can't set a breakpoint");
+        EmulatorStatus status;
+        uint32_t stops = 0;
+        while ((status = run_threaded(m)).retcode == IR_BREAKPOINT) {
+            mu_assert(status.pc == 16 && m->pc == 16, "bad breakpoint pc");
+            mu_assert(!m_watch_hit(m, NULL), "breakpoint seen as a watchpoint");
+            ++stops;
+        }
+        mu_assert(status.retcode == IR_DONE && stops == 5, "bad breakpoint stops");
+        mu_assert(m->registers[3] == 15, "bad loop sum");
+        m_clear_breakpoint(m, 16);
+        mu_assert(m->debug == NULL, "debug state left behind");
+        destroy_machine(m);
+    }
+
+    Machine *m = load_test_program(load_store, LEN(load_store));
+    mu_assert(m_add_watchpoint(m, TEST_MEMORY_BYTES - 2, 1, WATCH_WRITE),
+              "can't add a watchpoint");
+    uint64_t retired;
+    EmulatorStatus status = step_machine_n(m, UINT64_MAX, &retired);
+    uint32_t addr;
+    mu_assert(status.retcode == IR_BREAKPOINT && status.pc == 8 && retired == 1,
+              "watchpoint did not stop the sw");
+    mu_assert(m_watch_hit(m, &addr) && addr == TEST_MEMORY_BYTES - 4, "bad watch hit");
+    mu_assert(m->mem[TEST_MEMORY_BYTES / 4 - 1] == 0, "sw ran before the stop");
+    status = step_machine_n(m, UINT64_MAX, &retired);
+    mu_assert(status.retcode == IR_UNALIGNED_MEMORY_ACCESS, "lw was watched");
+    mu_assert(m->registers[2] == 0xdeadbeef, "bad load after resuming");
+    m_clear_debug(m);
+    mu_assert(m->debug == NULL, "debug state left behind");
+    destroy_machine(m);
+    return NULL;
+}
+
+
+static const char *all_tests(void) {
+    mu_run_test(test_branch_loop);
+    mu_run_test(test_stats);
+    mu_run_test(test_load_store);
+    mu_run_test(test_out_of_range);
+    mu_run_test(test_invalid_instruction);
+    mu_run_test(test_self_modifying);
+    mu_run_test(test_predecode_off);
+    mu_run_test(test_bulk_copy);
+    mu_run_test(test_io_channels);
+    mu_run_test(test_sparse_memory);
+    mu_run_test(test_snapshot_clone);
+    mu_run_test(test_profile);
+    mu_run_test(test_trace);
+    mu_run_test(test_history);
+    mu_run_test(test_image);
+    mu_run_test(test_threaded_engine);
+    mu_run_test(test_block_engine);
+    mu_run_test(test_jit_engine);
+    mu_run_test(test_verify);
+    mu_run_test(test_budget);
+    mu_run_test(test_dirty_pages);
+    mu_run_test(test_scheduler);
+    mu_run_test(test_debug);
+    // Note: all tests must run here!
+
+    return NULL;
+}
+
+int main(void) {
+    const char *result = all_tests();
+
+    if (result != NULL) {
+        printf("Test failed: ");
+        mu_print_failing_test();
+        printf("%s\n", result);
+    } else {
+        printf("Tests passed!");
+    }
+
+    printf("Tests run: %d\n", tests_run);
+
+    return result != NULL;
+}